@@ -2,6 +2,14 @@
 #include <Timer.hpp>
 #include <iostream>
 #include <iomanip>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DARKER_X86
+#endif
 
 using LOFAR::NSTimer;
 using std::cout;
@@ -9,29 +17,231 @@ using std::cerr;
 using std::endl;
 using std::fixed;
 using std::setprecision;
+using std::thread;
+using std::vector;
+
+// The pixels [first, last) of one engine; the planes are planeSize apart
+typedef void (*darkGrayEngine)(const long planeSize, const unsigned char * inputImage, unsigned char * darkGrayImage, const long first, const long last);
+
+
+// Reference kernel, also the tail of the vector engines: not inlined
+// into them, where it could be compiled with FMA
+__attribute__((noinline)) static void darkGrayScalar(const long planeSize, const unsigned char * inputImage, unsigned char * darkGrayImage, const long first, const long last) {
+	for ( long i = first; i < last; i++ ) {
+		float grayPix = 0.0f;
+		float r = static_cast< float >(inputImage[i]);
+		float g = static_cast< float >(inputImage[planeSize + i]);
+		float b = static_cast< float >(inputImage[(2 * planeSize) + i]);
+
+		grayPix = ((0.3f * r) + (0.59f * g) + (0.11f * b));
+		grayPix = (grayPix * 0.6f) + 0.5f;
+
+		darkGrayImage[i] = static_cast< unsigned char >(grayPix);
+	}
+}
+
+#ifdef DARKER_X86
+// The vector engines do the float operations of the scalar kernel in
+// the same order, without contraction, and truncate like the cast:
+// the results are the same bits.
+
+// 4 pixels of 32-bit channels to 32-bit gray
+static inline __m128i darkGray4SSE2(const __m128i r, const __m128i g, const __m128i b) {
+	__m128 grayPix = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(0.3f), _mm_cvtepi32_ps(r)), _mm_mul_ps(_mm_set1_ps(0.59f), _mm_cvtepi32_ps(g))), _mm_mul_ps(_mm_set1_ps(0.11f), _mm_cvtepi32_ps(b)));
+
+	grayPix = _mm_add_ps(_mm_mul_ps(grayPix, _mm_set1_ps(0.6f)), _mm_set1_ps(0.5f));
+	return _mm_cvttps_epi32(grayPix);
+}
+
+// 16 pixels of 8-bit channels to 8-bit gray
+static inline __m128i darkGray16SSE2(const __m128i r8, const __m128i g8, const __m128i b8) {
+	const __m128i zero = _mm_setzero_si128();
+	__m128i r16[2] = { _mm_unpacklo_epi8(r8, zero), _mm_unpackhi_epi8(r8, zero) };
+	__m128i g16[2] = { _mm_unpacklo_epi8(g8, zero), _mm_unpackhi_epi8(g8, zero) };
+	__m128i b16[2] = { _mm_unpacklo_epi8(b8, zero), _mm_unpackhi_epi8(b8, zero) };
+	__m128i gray16[2];
+
+	for ( int h = 0; h < 2; h++ ) {
+		__m128i lo = darkGray4SSE2(_mm_unpacklo_epi16(r16[h], zero), _mm_unpacklo_epi16(g16[h], zero), _mm_unpacklo_epi16(b16[h], zero));
+		__m128i hi = darkGray4SSE2(_mm_unpackhi_epi16(r16[h], zero), _mm_unpackhi_epi16(g16[h], zero), _mm_unpackhi_epi16(b16[h], zero));
+
+		// at most 153: the signed packs do not saturate
+		gray16[h] = _mm_packs_epi32(lo, hi);
+	}
+	return _mm_packus_epi16(gray16[0], gray16[1]);
+}
+
+// 32 pixels per iteration
+static void darkGraySSE2(const long planeSize, const unsigned char * inputImage, unsigned char * darkGrayImage, const long first, const long last) {
+	long i = first;
+
+	for ( ; i + 32 <= last; i += 32 ) {
+		for ( int h = 0; h < 32; h += 16 ) {
+			__m128i r = _mm_loadu_si128(reinterpret_cast< const __m128i * >(&inputImage[i + h]));
+			__m128i g = _mm_loadu_si128(reinterpret_cast< const __m128i * >(&inputImage[planeSize + i + h]));
+			__m128i b = _mm_loadu_si128(reinterpret_cast< const __m128i * >(&inputImage[(2 * planeSize) + i + h]));
+
+			_mm_storeu_si128(reinterpret_cast< __m128i * >(&darkGrayImage[i + h]), darkGray16SSE2(r, g, b));
+		}
+	}
+	darkGrayScalar(planeSize, inputImage, darkGrayImage, i, last);
+}
+
+// 8 pixels of 8-bit channels at p to 32-bit gray
+__attribute__((target("avx2"))) static inline __m256i darkGray8AVX2(const long planeSize, const unsigned char * p) {
+	__m256 r = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast< const __m128i * >(p))));
+	__m256 g = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast< const __m128i * >(p + planeSize))));
+	__m256 b = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast< const __m128i * >(p + (2 * planeSize)))));
+	__m256 grayPix = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(0.3f), r), _mm256_mul_ps(_mm256_set1_ps(0.59f), g)), _mm256_mul_ps(_mm256_set1_ps(0.11f), b));
+
+	grayPix = _mm256_add_ps(_mm256_mul_ps(grayPix, _mm256_set1_ps(0.6f)), _mm256_set1_ps(0.5f));
+	return _mm256_cvttps_epi32(grayPix);
+}
+
+// 32 pixels per iteration
+__attribute__((target("avx2"))) static void darkGrayAVX2(const long planeSize, const unsigned char * inputImage, unsigned char * darkGrayImage, const long first, const long last) {
+	// the packs work within 128-bit lanes: put the quads back in order
+	const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	long i = first;
+
+	for ( ; i + 32 <= last; i += 32 ) {
+		__m256i ab = _mm256_packs_epi32(darkGray8AVX2(planeSize, &inputImage[i]), darkGray8AVX2(planeSize, &inputImage[i + 8]));
+		__m256i cd = _mm256_packs_epi32(darkGray8AVX2(planeSize, &inputImage[i + 16]), darkGray8AVX2(planeSize, &inputImage[i + 24]));
+
+		_mm256_storeu_si256(reinterpret_cast< __m256i * >(&darkGrayImage[i]), _mm256_permutevar8x32_epi32(_mm256_packus_epi16(ab, cd), order));
+	}
+	darkGrayScalar(planeSize, inputImage, darkGrayImage, i, last);
+}
+
+// AVX-512F has FMA, which the compiler would contract the products
+// and sums into: these operations of explicit rounding (to nearest,
+// as everywhere else) stay separate. They are the zero-masked forms
+// under a full mask because the unmasked ones start from
+// _mm512_undefined_ps(), which GCC 12 flags with -Wmaybe-uninitialized
+// in target("avx512f") functions.
+#define ROUNDING (_MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+
+__attribute__((target("avx512f"))) static inline __m512 darkGray16AVX512(const long planeSize, const unsigned char * p) {
+	__m512 r = _mm512_maskz_cvtepi32_ps(0xffff, _mm512_maskz_cvtepu8_epi32(0xffff, _mm_loadu_si128(reinterpret_cast< const __m128i * >(p))));
+	__m512 g = _mm512_maskz_cvtepi32_ps(0xffff, _mm512_maskz_cvtepu8_epi32(0xffff, _mm_loadu_si128(reinterpret_cast< const __m128i * >(p + planeSize))));
+	__m512 b = _mm512_maskz_cvtepi32_ps(0xffff, _mm512_maskz_cvtepu8_epi32(0xffff, _mm_loadu_si128(reinterpret_cast< const __m128i * >(p + (2 * planeSize)))));
+	__m512 grayPix = _mm512_maskz_add_round_ps(0xffff,
+		_mm512_maskz_add_round_ps(0xffff, _mm512_maskz_mul_round_ps(0xffff, _mm512_set1_ps(0.3f), r, ROUNDING), _mm512_maskz_mul_round_ps(0xffff, _mm512_set1_ps(0.59f), g, ROUNDING), ROUNDING),
+		_mm512_maskz_mul_round_ps(0xffff, _mm512_set1_ps(0.11f), b, ROUNDING), ROUNDING);
+
+	return _mm512_maskz_add_round_ps(0xffff, _mm512_maskz_mul_round_ps(0xffff, grayPix, _mm512_set1_ps(0.6f), ROUNDING), _mm512_set1_ps(0.5f), ROUNDING);
+}
+
+// 64 pixels per iteration
+__attribute__((target("avx512f"))) static void darkGrayAVX512(const long planeSize, const unsigned char * inputImage, unsigned char * darkGrayImage, const long first, const long last) {
+	long i = first;
+
+	for ( ; i + 64 <= last; i += 64 ) {
+		for ( int q = 0; q < 64; q += 16 ) {
+			__m512i gray = _mm512_maskz_cvttps_epi32(0xffff, darkGray16AVX512(planeSize, &inputImage[i + q]));
+
+			_mm_storeu_si128(reinterpret_cast< __m128i * >(&darkGrayImage[i + q]), _mm512_maskz_cvtepi32_epi8(0xffff, gray));
+		}
+	}
+	darkGrayScalar(planeSize, inputImage, darkGrayImage, i, last);
+}
+#endif
+
+#ifdef DARKER_X86
+#define X86_ENGINE(engine) engine
+#else
+#define X86_ENGINE(engine) 0
+#endif
+
+// The engines from the narrowest; the x86 ones are null elsewhere
+static const struct {
+	const char * name;
+	darkGrayEngine engine;
+} engines[] = {
+	{ "scalar", darkGrayScalar },
+	{ "sse2", X86_ENGINE(darkGraySSE2) },
+	{ "avx2", X86_ENGINE(darkGrayAVX2) },
+	{ "avx512", X86_ENGINE(darkGrayAVX512) },
+};
+static const int engineCount = sizeof(engines) / sizeof(engines[0]);
+
+static bool supported(const int e) {
+	if ( engines[e].engine == 0 ) {
+		return false;
+	}
+#ifdef DARKER_X86
+	__builtin_cpu_init();
+	if ( engines[e].engine == darkGrayAVX2 ) {
+		return __builtin_cpu_supports("avx2");
+	} else if ( engines[e].engine == darkGrayAVX512 ) {
+		return __builtin_cpu_supports("avx512f");
+	}
+#endif
+	return true;
+}
+
+// The widest engine of this CPU, or the one named in DARKER_ENGINE
+// (scalar, sse2, avx2, avx512), else the widest below it that it has
+static int pickEngine() {
+	const char * wanted = getenv("DARKER_ENGINE");
+	int e = engineCount - 1;
+
+	if ( wanted != 0 ) {
+		while ( e >= 0 && strcmp(engines[e].name, wanted) != 0 ) {
+			e--;
+		}
+		if ( e < 0 ) {
+			cerr << "darker: unknown DARKER_ENGINE \"" << wanted << "\" (scalar, sse2, avx2 or avx512)" << endl;
+			exit(1);
+		}
+	}
+	while ( !supported(e) ) {
+		if ( wanted != 0 ) {
+			cerr << "darker: no " << engines[e].name << " on this machine, using " << engines[e - 1].name << endl;
+		}
+		e--;
+	}
+	return e;
+}
+
+// One per core, or DARKER_THREADS
+static int pickThreads(const int height) {
+	const char * wanted = getenv("DARKER_THREADS");
+	int threads = (wanted != 0) ? atoi(wanted) : static_cast< int >(thread::hardware_concurrency());
+
+	if ( threads < 1 ) {
+		threads = 1;
+	}
+	return (threads < height) ? threads : ((height > 0) ? height : 1);
+}
 
 
 void darkGray(const int width, const int height, const unsigned char * inputImage, unsigned char * darkGrayImage) {
 	NSTimer kernelTime = NSTimer("darker", false, false);
-	
+	const long planeSize = static_cast< long >(width) * height;
+	const int e = pickEngine();
+	darkGrayEngine engine = engines[e].engine;
+	int threads = pickThreads(height);
+	vector< thread > workers;
+
 	kernelTime.start();
-	// Kernel
-	for ( int y = 0; y < height; y++ ) {
-		for ( int x = 0; x < width; x++ ) {
-			float grayPix = 0.0f;
-			float r = static_cast< float >(inputImage[(y * width) + x]);
-			float g = static_cast< float >(inputImage[(width * height) + (y * width) + x]);
-			float b = static_cast< float >(inputImage[(2 * width * height) + (y * width) + x]);
-
-			grayPix = ((0.3f * r) + (0.59f * g) + (0.11f * b));
-			grayPix = (grayPix * 0.6f) + 0.5f;
-
-			darkGrayImage[(y * width) + x] = static_cast< unsigned char >(grayPix);
-		}
+	// Kernel: every thread an equal share of the rows
+	for ( int t = 1; t < threads; t++ ) {
+		long first = static_cast< long >(width) * (static_cast< long >(height) * t / threads);
+		long last = static_cast< long >(width) * (static_cast< long >(height) * (t + 1) / threads);
+
+		workers.push_back(thread(engine, planeSize, inputImage, darkGrayImage, first, last));
+	}
+	engine(planeSize, inputImage, darkGrayImage, 0, static_cast< long >(width) * (height / threads));
+	for ( unsigned int t = 0; t < workers.size(); t++ ) {
+		workers[t].join();
 	}
 	// /Kernel
 	kernelTime.stop();
-	
+
+	if ( getenv("DARKER_VERBOSE") != 0 ) {
+		cerr << "darker: " << engines[e].name << " engine, " << threads << " threads" << endl;
+	}
 	// Time GFLOP/s GB/s
 	cout << fixed << setprecision(6) << kernelTime.getElapsed() << setprecision(3) << " " << (static_cast< long long unsigned int >(width) * height * 7) / 1000000000.0 / kernelTime.getElapsed() << " " << (static_cast< long long unsigned int >(width) * height * (4 * sizeof(unsigned char))) / 1000000000.0 / kernelTime.getElapsed() << endl;
-}
\ No newline at end of file
+}
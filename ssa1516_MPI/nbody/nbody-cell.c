@@ -0,0 +1,402 @@
+/*
+    Short-range force backend with cell lists (--forces=cell).
+
+    The pair force is the clamped one of the direct sum less its value
+    at the cutoff radius, so that it falls continuously to zero there,
+    and nothing beyond. Space is cut into a uniform grid of cells at
+    least the cutoff wide, so that a body only meets the bodies of its
+    own and the eight neighbouring cells: O(N) for bounded density.
+    Every step the bodies are counting sorted by cell into a
+    contiguous copy, unless none of them changed cell.
+
+    With a replicating parallel layer every process holds the grid of
+    all the bodies and takes the same share of the cells as its pair
+    range is of all the pairs (or, owner-computes, the whole force on
+    its own bodies). With a distributed one (--exchange=orb) it holds
+    its own bodies plus the halo the layer imports: the bodies of the
+    other processes within the cutoff of its own.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+#include "nbody.h"
+#include "nbody-tree.h"
+
+#define CELL_DIVISIONS  16      /* default cutoff: the shorter side over this */
+
+typedef struct {
+    double cutoff;
+    double xsize, ysize;        /* sides of a cell, at least the cutoff */
+    int nx, ny;
+    treePoint *points;          /* the bodies held here, then the halo */
+    treePoint *sorted;          /* the same by cell */
+    int *order;                 /* point of every sorted one */
+    int *cell;                  /* cell of every point, -1: none yet */
+    double *force;              /* x and y force on every sorted point */
+    int cap;                    /* room for points */
+    int count;                  /* points of the last sort */
+    int *start;                 /* first sorted point of every cell, and the end */
+    int *fill;
+
+    long steps;
+    long sorts;                 /* steps some body changed cell */
+    long moved;                 /* bodies that did (of an unchanged set) */
+    long long pairs;            /* pair forces evaluated (once for both ends, or per end) */
+    long long candidates;       /* the pairs of neighbouring cells looked at */
+    long long halo;             /* bodies imported */
+    double gridTime;            /* halo import and sort */
+    double forceTime;
+} cellType;
+
+
+static double
+now(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + (tv.tv_usec / 1000000.0);
+}
+
+/*  1 / d of the direct sum, linear inside the clamping distance m */
+static inline double
+clamped(double d, double m) {
+    return (d < m) ? (2 * m - d) / (m * m) : 1 / d;
+}
+
+/*  Force of q on p and, if 'potential', their potential; 0 if they
+    are not closer than the cutoff
+*/
+static inline int
+pair_force(const cellType *cl, const treePoint *p, const treePoint *q, double gravity,
+           double *xf, double *yf, double *potential) {
+    double dx = q->x - p->x;
+    double dy = q->y - p->y;
+    double dsqr = dx * dx + dy * dy;
+    double rc = cl->cutoff;
+    double mindist, mindsqr, gmm, edge, force, d;
+
+    if (dsqr >= rc * rc) {
+        return 0;
+    }
+    mindist = p->radius + q->radius;
+    mindsqr = mindist * mindist;
+    gmm = p->mass * q->mass * gravity;
+    edge = gmm / ((rc * rc < mindsqr) ? mindsqr : rc * rc);
+    force = gmm / ((dsqr < mindsqr) ? mindsqr : dsqr) - edge;
+    d = sqrt(dsqr);
+    if (d > 0) {
+        *xf = force * dx / d;
+        *yf = force * dy / d;
+    } else {
+        /* along +x on the lower original index, as in the direct sum */
+        *xf = (p->id < q->id) ? force : -force;
+        *yf = 0;
+    }
+    if (potential) {
+        /* minus the work of the force out to the cutoff */
+        *potential = -gmm * (clamped(d, mindist) - clamped(rc, mindist)) + edge * (rc - d);
+    }
+    return 1;
+}
+
+static int
+cell_of(const cellType *cl, const treePoint *p) {
+    double x = p->x / cl->xsize;
+    double y = p->y / cl->ysize;
+    int i = (x >= 0) ? (x < cl->nx ? (int) x : cl->nx - 1) : 0;
+    int j = (y >= 0) ? (y < cl->ny ? (int) y : cl->ny - 1) : 0;
+
+    return j * cl->nx + i;
+}
+
+/*  Room for 'count' points; the cells of the new ones are unknown */
+static int
+reserve(cellType *cl, int count) {
+    int cap = cl->cap;
+    treePoint *points, *sorted;
+    int *order, *cell;
+    double *force;
+
+    if (count <= cap) {
+        return 0;
+    }
+    while (cap < count) {
+        cap = cap ? 2 * cap : 1024;
+    }
+    if ((points = realloc(cl->points, sizeof(treePoint) * cap)) != 0) {
+        cl->points = points;
+    }
+    if ((sorted = realloc(cl->sorted, sizeof(treePoint) * cap)) != 0) {
+        cl->sorted = sorted;
+    }
+    if ((order = realloc(cl->order, sizeof(int) * cap)) != 0) {
+        cl->order = order;
+    }
+    if ((cell = realloc(cl->cell, sizeof(int) * cap)) != 0) {
+        cl->cell = cell;
+    }
+    if ((force = realloc(cl->force, sizeof(double) * 2 * cap)) != 0) {
+        cl->force = force;
+    }
+    if (points == 0 || sorted == 0 || order == 0 || cell == 0 || force == 0) {
+        return -1;
+    }
+    memset(cl->cell + cl->cap, -1, sizeof(int) * (cap - cl->cap));
+    cl->cap = cap;
+    return 0;
+}
+
+/*  Sort the 'count' points by cell, counting, unless they are the
+    same points in the same cells as last time
+*/
+static void
+sort_points(cellType *cl, int count) {
+    int cells = cl->nx * cl->ny;
+    int i, c, moved = 0;
+
+    for (i = 0; i < count; ++i) {
+        c = cell_of(cl, &cl->points[i]);
+        moved += (c != cl->cell[i]);
+        cl->cell[i] = c;
+    }
+    if (moved > 0 || count != cl->count) {
+        memset(cl->start, 0, sizeof(int) * (cells + 1));
+        for (i = 0; i < count; ++i) {
+            cl->start[cl->cell[i] + 1]++;
+        }
+        for (c = 0; c < cells; ++c) {
+            cl->start[c + 1] += cl->start[c];
+            cl->fill[c] = cl->start[c];
+        }
+        for (i = 0; i < count; ++i) {
+            cl->order[cl->fill[cl->cell[i]]++] = i;
+        }
+        if (count == cl->count) {
+            cl->moved += moved;
+        }
+        cl->count = count;
+        cl->sorts++;
+    }
+    for (i = 0; i < count; ++i) {
+        cl->sorted[i] = cl->points[cl->order[i]];
+    }
+}
+
+/*  Pairs of the cells [lo, hi) within each one and with the four
+    neighbours after it, every pair once
+*/
+static double
+half_shell(nbodySim *sim, cellType *cl, int lo, int hi) {
+    static const int di[4] = { 1, -1, 0, 1 };
+    static const int dj[4] = { 0, 1, 1, 1 };
+    double potential = 0, e, xf, yf;
+    double *energy = sim->diagStep ? &e : 0;
+    int c, a, b, k;
+
+    for (c = lo; c < hi; ++c) {
+        int i = c % cl->nx, j = c / cl->nx;
+
+        for (a = cl->start[c]; a < cl->start[c + 1]; ++a) {
+            const treePoint *p = &cl->sorted[a];
+
+            for (k = -1; k < 4; ++k) {
+                int ii = i + (k < 0 ? 0 : di[k]);
+                int jj = j + (k < 0 ? 0 : dj[k]);
+                int n = jj * cl->nx + ii;
+
+                if (ii < 0 || ii >= cl->nx || jj >= cl->ny) {
+                    continue;
+                }
+                for (b = (k < 0 ? a + 1 : cl->start[n]); b < cl->start[n + 1]; ++b) {
+                    cl->candidates++;
+                    if (pair_force(cl, p, &cl->sorted[b], sim->gravity, &xf, &yf, energy)) {
+                        cl->force[2 * a] += xf;
+                        cl->force[2 * a + 1] += yf;
+                        cl->force[2 * b] -= xf;
+                        cl->force[2 * b + 1] -= yf;
+                        cl->pairs++;
+                        if (energy) {
+                            potential += e;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return potential;
+}
+
+/*  The whole force on the points of the bodies [first, last), from
+    their own and the eight neighbouring cells; the first point is
+    body lo
+*/
+static double
+full_shell(nbodySim *sim, cellType *cl, int lo) {
+    double potential = 0, e, xf, yf;
+    double *energy = sim->diagStep ? &e : 0;
+    int a, b, n;
+
+    for (a = 0; a < cl->count; ++a) {
+        const treePoint *p = &cl->sorted[a];
+        int body = lo + cl->order[a];
+        int c = cl->cell[cl->order[a]];
+        int i = c % cl->nx, j = c / cl->nx, ii, jj;
+        long hits = 0;
+
+        if (body < sim->first || body >= sim->last) {
+            continue;
+        }
+        for (jj = (j > 0 ? j - 1 : 0); jj <= j + 1 && jj < cl->ny; ++jj) {
+            for (ii = (i > 0 ? i - 1 : 0); ii <= i + 1 && ii < cl->nx; ++ii) {
+                n = jj * cl->nx + ii;
+                for (b = cl->start[n]; b < cl->start[n + 1]; ++b) {
+                    if (b == a) {
+                        continue;
+                    }
+                    cl->candidates++;
+                    if (pair_force(cl, p, &cl->sorted[b], sim->gravity, &xf, &yf, energy)) {
+                        cl->force[2 * a] += xf;
+                        cl->force[2 * a + 1] += yf;
+                        hits++;
+                        if (energy) {
+                            /* every pair is seen from both ends */
+                            potential += e / 2;
+                        }
+                    }
+                }
+            }
+        }
+        cl->pairs += hits;
+        sim->work[body] = hits;
+    }
+    return potential;
+}
+
+static int
+cell_init(nbodySim *sim) {
+    cellType *cl = calloc(1, sizeof(cellType));
+    int shorter = (sim->xdim < sim->ydim) ? sim->xdim : sim->ydim;
+
+    if (cl == 0) {
+        return -1;
+    }
+    sim->forceState = cl;
+    cl->cutoff = sim->p.cutoff > 0 ? sim->p.cutoff : (double) shorter / CELL_DIVISIONS;
+    /* cells of a pixel at least */
+    cl->nx = (cl->cutoff > 1) ? (int) (sim->xdim / cl->cutoff) : sim->xdim;
+    cl->ny = (cl->cutoff > 1) ? (int) (sim->ydim / cl->cutoff) : sim->ydim;
+    cl->nx = cl->nx > 1 ? cl->nx : 1;
+    cl->ny = cl->ny > 1 ? cl->ny : 1;
+    cl->xsize = (double) sim->xdim / cl->nx;
+    cl->ysize = (double) sim->ydim / cl->ny;
+    cl->start = malloc(sizeof(int) * ((long) cl->nx * cl->ny + 1));
+    cl->fill = malloc(sizeof(int) * cl->nx * cl->ny);
+    if (cl->start == 0 || cl->fill == 0 ||
+            (sim->work == 0 && (sim->work = malloc(sizeof(float) * sim->bodyCt)) == 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+static int
+cell_forces(nbodySim *sim) {
+    cellType *cl = sim->forceState;
+    int distributed = (sim->exchange && sim->exchange->halo);
+    int lo = distributed ? sim->first : 0;
+    int own = distributed ? sim->last - sim->first : sim->bodyCt;
+    treePoint *remote = 0;
+    double t = now();
+    int count = own, b, s;
+
+    if (distributed) {
+        int n = sim->exchange->halo(sim, cl->cutoff, &remote);
+
+        count += n;
+        cl->halo += n;
+    }
+    /* after the halo, which is collective */
+    if (reserve(cl, count) < 0) {
+        fprintf(stderr, "Out of memory for the cell lists of %d bodies\n", count);
+        free(remote);
+        return -1;
+    }
+    for (b = 0; b < own; ++b) {
+        treePoint *p = &cl->points[b];
+
+        p->x = X(lo + b);
+        p->y = Y(lo + b);
+        p->mass = M(lo + b);
+        p->radius = R(lo + b);
+        p->id = sim->ids ? sim->ids[lo + b] : lo + b;
+    }
+    if (remote) {
+        memcpy(cl->points + own, remote, sizeof(treePoint) * (count - own));
+        free(remote);
+    }
+    sort_points(cl, count);
+    cl->gridTime += now() - t;
+
+    t = now();
+    memset(cl->force, 0, sizeof(double) * 2 * count);
+    if (distributed || sim->owner) {
+        sim->potential += full_shell(sim, cl, lo);
+    } else {
+        /* the share of the cells that the pair range is of the pairs */
+        long long pairs = nbody_pair_count(sim->bodyCt);
+        int cells = cl->nx * cl->ny;
+
+        sim->potential += half_shell(sim, cl, (int) ((double) sim->pairLo / pairs * cells),
+                                     (int) ((double) sim->pairHi / pairs * cells));
+    }
+    for (s = 0; s < count; ++s) {
+        int p = cl->order[s];
+
+        if (p < own) {
+            XF(lo + p) += cl->force[2 * s];
+            YF(lo + p) += cl->force[2 * s + 1];
+        }
+    }
+    cl->forceTime += now() - t;
+    cl->steps++;
+    return 0;
+}
+
+static void
+cell_report(nbodySim *sim, FILE *out) {
+    cellType *cl = sim->forceState;
+    double steps = cl->steps ? cl->steps : 1;
+
+    fprintf(out, "Cell forces: %dx%d cells of %.3fx%.3f, cutoff %.3f, %.0f pair forces of %.0f candidates per step, "
+            "sorted in %ld of %ld steps (%.1f bodies changed cell per step)",
+            cl->nx, cl->ny, cl->xsize, cl->ysize, cl->cutoff, cl->pairs / steps, cl->candidates / steps,
+            cl->sorts, cl->steps, cl->moved / steps);
+    if (sim->exchange && sim->exchange->halo) {
+        fprintf(out, ", halo of %.0f bodies", cl->halo / steps);
+    }
+    fprintf(out, ", grid %10.3f seconds, forces %10.3f seconds\n", cl->gridTime, cl->forceTime);
+}
+
+static void
+cell_free(nbodySim *sim) {
+    cellType *cl = sim->forceState;
+
+    free(sim->work);
+    sim->work = 0;
+    if (cl == 0) {
+        return;
+    }
+    free(cl->points);
+    free(cl->sorted);
+    free(cl->order);
+    free(cl->cell);
+    free(cl->force);
+    free(cl->start);
+    free(cl->fill);
+    free(cl);
+}
+
+const nbodyForces nbody_cell = {
+    "cell", cell_init, cell_forces, cell_free, 0, 0, cell_report, 1, 1
+};
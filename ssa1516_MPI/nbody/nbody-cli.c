@@ -0,0 +1,235 @@
+/*
+    Command line of the N-Body front-ends.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nbody-cli.h"
+
+#define MAXOPTIONS  64
+
+static const struct option common[] = {
+    { "init",       required_argument, 0, 'i' },
+    { "init-file",  required_argument, 0, 'f' },
+    { "diag",       required_argument, 0, 'd' },
+    { "publish",    required_argument, 0, 'p' },
+    { "publish-every", required_argument, 0, 'P' },
+    { "reorder",    required_argument, 0, 'r' },
+    { "curve",      required_argument, 0, 'C' },
+    { "counters",   no_argument,       0, 'c' },
+    { "numa",       required_argument, 0, 'n' },
+    { "huge",       required_argument, 0, 'H' },
+    { "theta",      required_argument, 0, 'a' },
+    { "mesh",       required_argument, 0, 'm' },
+    { "cutoff",     required_argument, 0, 'K' },
+    { "gravity",    required_argument, 0, 'V' },
+    { "friction",   required_argument, 0, 'u' },
+    { "ooc",        required_argument, 0, 'o' },
+    { "forces",     required_argument, 0, 'F' },
+    { "threads",    required_argument, 0, 't' },
+    { "tile",       required_argument, 0, 'w' },
+    { "autotune",   no_argument,       0, 'T' },
+    { "no-autotune", no_argument,      0, 'N' },
+    { "dump",       required_argument, 0, 'D' },
+    { "dump-state", required_argument, 0, 'S' },
+    { 0, 0, 0, 0 }
+};
+
+static const char *
+backend_names(void) {
+    static char names[256];
+    const nbodyForces *const *backends = nbody_backends();
+    int i;
+
+    names[0] = 0;
+    for (i = 0; backends[i]; ++i) {
+        strncat(names, i ? "|" : "", sizeof(names) - strlen(names) - 1);
+        strncat(names, backends[i]->name, sizeof(names) - strlen(names) - 1);
+    }
+    return names;
+}
+
+static void
+usage(char *prog, const cliExtra *extra) {
+    fprintf(stderr,
+            "Usage: %s [options] num_bodies secs_per_update ppm_output_file steps\n"
+            "  --init=GEN          random|uniform|plummer|galaxies|disk|lattice\n"
+            "  --init-file=FILE    load bodies from a binary state file\n"
+            "  --diag=K            report energy and momentum drift every K steps\n"
+            "  --publish=NAME      publish positions in POSIX shared memory NAME\n"
+            "  --publish-every=K   ... every K steps (default 100)\n"
+            "  --reorder=K         sort the bodies along a space-filling curve every K steps\n"
+            "  --curve=NAME        morton|hilbert (default morton)\n"
+            "  --counters          report hardware cache counters of the main loop\n"
+            "  --numa=POLICY       first-touch|interleave placement of the body arrays\n"
+            "  --huge=PAGES        none|thp|explicit 2 MB pages for the body arrays\n"
+            "  --theta=T           opening angle of the tree backend (default 0.5)\n"
+            "  --mesh=H            mesh spacing of the pm backend in pixels\n"
+            "  --cutoff=RC         interaction range of the cell backend in pixels\n"
+            "  --gravity=G         gravitational constant (default 1.1)\n"
+            "  --friction=F        friction coefficient (default 0.01)\n"
+            "  --ooc=FILE          keep the bodies in FILE, mapped (no body limit)\n"
+            "  --forces=NAME       force backend: %s\n"
+            "  --threads=T         threads of threaded backends (default: one per core)\n"
+            "  --tile=W            tile width of tiled backends\n"
+            "  --autotune          time the backends and knobs, cache and use the fastest\n"
+            "  --no-autotune       ignore the tuning cache\n"
+            "  --dump=FILE         write the final bodies to FILE instead of the standard output\n"
+            "  --dump-state=FILE   write the final bodies to a binary state file (see --init-file)\n"
+            "%s",
+            prog, backend_names(), (extra && extra->usage) ? extra->usage : "");
+}
+
+/*  Parse the command line into cli, or exit with a usage message */
+int
+cli_parse(int argc, char **argv, nbodyCli *cli, const cliExtra *extra) {
+    struct option options[MAXOPTIONS];
+    int n = 0;
+    int opt, i;
+
+    nbody_defaults(&cli->params);
+    cli->publish = 0;
+    cli->publishEvery = 100;
+    cli->tune = TUNE_AUTO;
+    cli->counters = 0;
+    cli->unlimited = 0;
+    cli->dump = 0;
+    cli->dumpState = 0;
+    for (i = 0; common[i].name; ++i) {
+        options[n++] = common[i];
+    }
+    for (i = 0; extra && extra->options[i].name && n < MAXOPTIONS - 1; ++i) {
+        options[n++] = extra->options[i];
+    }
+    memset(&options[n], 0, sizeof(options[n]));
+
+    while ((opt = getopt_long(argc, argv, "i:f:d:", options, 0)) != -1) {
+        switch (opt) {
+        case 'i':
+            if (init_parse(optarg, &cli->params.init) < 0) {
+                fprintf(stderr, "Unknown initial condition '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'f':
+            cli->params.init = INIT_FILE;
+            cli->params.initFile = optarg;
+            break;
+        case 'd':
+            cli->params.diagEvery = atoi(optarg);
+            break;
+        case 'p':
+            cli->publish = optarg;
+            break;
+        case 'P':
+            if ((cli->publishEvery = atoi(optarg)) < 1) {
+                cli->publishEvery = 1;
+            }
+            break;
+        case 'r':
+            cli->params.reorderEvery = atoi(optarg);
+            break;
+        case 'C':
+            if (nbody_parse_curve(optarg, &cli->params.curve) < 0) {
+                fprintf(stderr, "Unknown curve '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'c':
+            cli->counters = 1;
+            break;
+        case 'n':
+            if (mem_parse_place(optarg, &cli->params.place) < 0) {
+                fprintf(stderr, "Unknown placement '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'H':
+            if (mem_parse_huge(optarg, &cli->params.huge) < 0) {
+                fprintf(stderr, "Unknown huge pages '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'a':
+            cli->params.theta = atof(optarg);
+            break;
+        case 'm':
+            cli->params.meshCell = atof(optarg);
+            break;
+        case 'K':
+            cli->params.cutoff = atof(optarg);
+            break;
+        case 'V':
+            cli->params.gravity = atof(optarg);
+            break;
+        case 'u':
+            cli->params.friction = atof(optarg);
+            break;
+        case 'o':
+            cli->params.stateFile = optarg;
+            break;
+        case 'F':
+            if ((cli->params.forces = nbody_find_forces(optarg)) == 0) {
+                fprintf(stderr, "Unknown force backend '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 't':
+            cli->params.threads = atoi(optarg);
+            break;
+        case 'w':
+            cli->params.tile = atoi(optarg);
+            break;
+        case 'T':
+            cli->tune = TUNE_FORCE;
+            break;
+        case 'N':
+            cli->tune = TUNE_OFF;
+            break;
+        case 'D':
+            cli->dump = optarg;
+            break;
+        case 'S':
+            cli->dumpState = optarg;
+            break;
+        case '?':
+            usage(argv[0], extra);
+            exit(1);
+        default:
+            if (extra == 0 || extra->handle(cli, opt, optarg) < 0) {
+                usage(argv[0], extra);
+                exit(1);
+            }
+            break;
+        }
+    }
+    if (argc - optind != 4 ||
+            (cli->params.init == INIT_FILE && cli->params.initFile == 0)) {
+        usage(argv[0], extra);
+        exit(1);
+    }
+    argv += optind - 1;
+
+    if (cli->params.stateFile && cli->params.reorderEvery > 0) {
+        fprintf(stderr, "--reorder needs the bodies in memory, not with --ooc\n");
+        exit(1);
+    }
+    if (cli->params.stateFile && cli->params.forces == 0) {
+        cli->params.forces = &nbody_direct_ooc;
+    }
+
+    /*the limit is for the O(N^2) exact backends held in memory*/
+    if ((cli->params.bodyCt = atol(argv[1])) > MAXBODIES && cli->params.stateFile == 0 &&
+            !(cli->params.forces && cli->params.forces->approximate) && !cli->unlimited) {
+        fprintf(stderr, "Using only %d bodies...\n", MAXBODIES);
+        cli->params.bodyCt = MAXBODIES;
+    } else if (cli->params.bodyCt < 2) {
+        fprintf(stderr, "Using two bodies...\n");
+        cli->params.bodyCt = 2;
+    }
+    cli->secsup = atoi(argv[2]);
+    cli->ppmFile = argv[3];
+    cli->steps = atoi(argv[4]);
+    return 0;
+}
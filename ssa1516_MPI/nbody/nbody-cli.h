@@ -0,0 +1,39 @@
+/*
+    Command line of the N-Body front-ends.
+*/
+
+#ifndef NBODY_CLI_H
+#define NBODY_CLI_H
+
+#include <getopt.h>
+#include "nbody.h"
+#include "nbody-tune.h"
+
+#define MAXBODIES  10000
+
+typedef struct {
+    nbodyParams params;
+    unsigned int secsup;        /* seconds between display updates */
+    char *ppmFile;
+    int steps;
+    char *publish;              /* shared memory name for positions, 0: none */
+    int publishEvery;           /* steps between published frames */
+    tuneMode tune;
+    int counters;               /* report hardware counters of the main loop */
+    int unlimited;              /* no MAXBODIES limit (set by front-end options) */
+    char *dump;                 /* text output file, 0: the standard output */
+    char *dumpState;            /* binary state file of the final bodies, 0: none */
+} nbodyCli;
+
+/*  Options only one front-end understands: long options whose
+    handler returns -1 on a bad argument.
+*/
+typedef struct {
+    const struct option *options;   /* terminated by a zero entry */
+    int (*handle)(nbodyCli *cli, int opt, char *arg);
+    const char *usage;
+} cliExtra;
+
+int cli_parse(int argc, char **argv, nbodyCli *cli, const cliExtra *extra);
+
+#endif
@@ -0,0 +1,197 @@
+/*
+    Fast output of the state of a simulation.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "nbody-dump.h"
+#include "nbody-threads.h"
+
+/*  v as printf("%10.3f") would write it; returns the length */
+int
+dump_value(double v, char *out) {
+    char digits[24];
+    double a = fabs(v);
+    double scaled = a * 1000;
+    long long r, ip;
+    int n = 0, len, pad;
+
+    /* a * 1000 is off by at most 1.2e-4 below 1e9: round it unless
+       that could cross a half, where printf rounds the exact value */
+    if (!(a < 1e9) || fabs(scaled - floor(scaled) - 0.5) < 1e-3) {
+        return snprintf(out, DUMP_VALUE_MAX, "%10.3f", v);
+    }
+    r = (long long) (scaled + 0.5);
+    ip = r / 1000;
+    digits[n++] = '0' + r % 10;
+    digits[n++] = '0' + r / 10 % 10;
+    digits[n++] = '0' + r / 100 % 10;
+    digits[n++] = '.';
+    do {
+        digits[n++] = '0' + ip % 10;
+        ip /= 10;
+    } while (ip > 0);
+    /* also for the negative values that round to zero, as printf */
+    if (signbit(v)) {
+        digits[n++] = '-';
+    }
+
+    pad = (n < 10) ? 10 - n : 0;
+    memset(out, ' ', pad);
+    for (len = pad; n > 0; ) {
+        out[len++] = digits[--n];
+    }
+    out[len] = 0;
+    return len;
+}
+
+/*  The nbody_print() line of slot b */
+int
+dump_line(const nbodySim *sim, int b, char *out) {
+    double v[6];
+    int i, len = 0;
+
+    v[0] = X(b);
+    v[1] = Y(b);
+    v[2] = XF(b);
+    v[3] = YF(b);
+    v[4] = XV(b);
+    v[5] = YV(b);
+    for (i = 0; i < 6; ++i) {
+        len += dump_value(v[i], out + len);
+        out[len++] = (i < 5) ? ' ' : '\n';
+    }
+    return len;
+}
+
+/*  The state file record of slot b */
+void
+dump_body(const nbodySim *sim, int b, initBodyType *out) {
+    out->x = X(b);
+    out->y = Y(b);
+    out->xv = XV(b);
+    out->yv = YV(b);
+    out->mass = M(b);
+    out->radius = R(b);
+}
+
+/*  Slot of every body in the original order (malloc()ed), or 0 if
+    the bodies were never reordered */
+int *
+dump_slots(const nbodySim *sim) {
+    int *slot;
+    int b;
+
+    if (sim->ids == 0 || (slot = malloc(sizeof(int) * sim->bodyCt)) == 0) {
+        return 0;
+    }
+    for (b = 0; b < sim->bodyCt; ++b) {
+        slot[sim->ids[b]] = b;
+    }
+    return slot;
+}
+
+typedef struct {
+    const nbodySim *sim;
+    int *slot;
+    int first;                  /* body of the first chunk of this round */
+    char **text;                /* the chunk of every thread */
+    size_t *len;
+} dumpRound;
+
+static void
+format_chunk(void *arg, int id, int count) {
+    dumpRound *round = arg;
+    const nbodySim *sim = round->sim;
+    int lo = round->first + id * DUMP_CHUNK;
+    int hi = (lo + DUMP_CHUNK < sim->bodyCt) ? lo + DUMP_CHUNK : sim->bodyCt;
+    char *text = round->text[id];
+    size_t len = 0;
+    int i;
+
+    for (i = lo; i < hi; ++i) {
+        len += dump_line(sim, round->slot ? round->slot[i] : i, text + len);
+    }
+    round->len[id] = len;
+}
+
+/*  nbody_print(): chunks of DUMP_CHUNK bodies formatted by a pool
+    of threads, round by round, each round written at once */
+int
+dump_text(const nbodySim *sim, FILE *out) {
+    int chunks = (sim->bodyCt + DUMP_CHUNK - 1) / DUMP_CHUNK;
+    int chunk = (sim->bodyCt < DUMP_CHUNK) ? sim->bodyCt : DUMP_CHUNK;
+    threadPool *pool = 0;
+    dumpRound round;
+    int threads = 1, t, ok = 1;
+
+    if (chunks > 1 && (pool = pool_create(sim->p.threads)) != 0) {
+        threads = pool_size(pool);
+    }
+    round.sim = sim;
+    round.slot = dump_slots(sim);
+    round.text = calloc(threads, sizeof(char *));
+    round.len = calloc(threads, sizeof(size_t));
+    for (t = 0; round.text && t < threads; ++t) {
+        ok = ok && (round.text[t] = malloc((size_t) chunk * DUMP_LINE_MAX)) != 0;
+    }
+    ok = ok && round.text && round.len && (sim->ids == 0 || round.slot);
+
+    for (round.first = 0; ok && round.first < sim->bodyCt; round.first += threads * DUMP_CHUNK) {
+        int n = (sim->bodyCt - round.first + DUMP_CHUNK - 1) / DUMP_CHUNK;
+
+        memset(round.len, 0, sizeof(size_t) * threads);
+        if (pool && n > 1) {
+            pool_run(pool, format_chunk, &round);
+        } else {
+            format_chunk(&round, 0, 1);
+        }
+        for (t = 0; t < threads && t < n; ++t) {
+            ok = ok && fwrite(round.text[t], 1, round.len[t], out) == round.len[t];
+        }
+    }
+
+    for (t = 0; round.text && t < threads; ++t) {
+        free(round.text[t]);
+    }
+    free(round.text);
+    free(round.len);
+    free(round.slot);
+    pool_destroy(pool);
+    return ok ? 0 : -1;
+}
+
+/*  Binary state file of all the bodies, in the original order */
+int
+dump_state(const nbodySim *sim, FILE *out) {
+    uint64_t count = sim->bodyCt;
+    int *slot = dump_slots(sim);
+    initBodyType body;
+    int i, ok;
+
+    ok = (sim->ids == 0 || slot) &&
+         fwrite(INIT_FILE_MAGIC, 1, 8, out) == 8 && fwrite(&count, 8, 1, out) == 1;
+    for (i = 0; ok && i < sim->bodyCt; ++i) {
+        dump_body(sim, slot ? slot[i] : i, &body);
+        ok = (fwrite(&body, sizeof(body), 1, out) == 1);
+    }
+    free(slot);
+    return ok ? 0 : -1;
+}
+
+/*  dump_state() or dump_text() into a new file at path */
+int
+dump_write(const nbodySim *sim, const char *path, int binary) {
+    FILE *out = fopen(path, binary ? "wb" : "w");
+    int ok;
+
+    if (out == 0) {
+        return -1;
+    }
+    ok = ((binary ? dump_state(sim, out) : dump_text(sim, out)) == 0);
+    ok = (fclose(out) == 0) && ok;
+    return ok ? 0 : -1;
+}
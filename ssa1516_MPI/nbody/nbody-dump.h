@@ -0,0 +1,31 @@
+/*
+    Fast output of the state of a simulation.
+
+    Text is the layout of nbody_print(), six "%10.3f" columns per
+    body in the original body order, formatted with integer arithmetic
+    (printf only for values it cannot round safely), byte for byte as
+    printf would. Binary is the state file of nbody-init.h, which
+    --init-file reads back.
+*/
+
+#ifndef NBODY_DUMP_H
+#define NBODY_DUMP_H
+
+#include <stdio.h>
+#include "nbody.h"
+
+#define DUMP_LINE       66      /* bytes of a text line whose values all fit their 10 columns */
+#define DUMP_VALUE_MAX  320     /* longest "%10.3f" of a double */
+#define DUMP_LINE_MAX   (6 * DUMP_VALUE_MAX + 6)
+#define DUMP_CHUNK      16384   /* bodies formatted per task */
+#define DUMP_HEADER     16      /* bytes before the records of a state file */
+
+int dump_value(double v, char *out);
+int dump_line(const nbodySim *sim, int b, char *out);
+void dump_body(const nbodySim *sim, int b, initBodyType *out);
+int *dump_slots(const nbodySim *sim);
+int dump_text(const nbodySim *sim, FILE *out);
+int dump_state(const nbodySim *sim, FILE *out);
+int dump_write(const nbodySim *sim, const char *path, int binary);
+
+#endif
@@ -0,0 +1,461 @@
+/*
+    N-Body ensemble driver: many independent simulations (a parameter
+    sweep) in one program, spread over the MPI processes and, within
+    each, over a pool of threads. The final state of every member goes
+    to one output file, with an index of where each member starts.
+
+    The sweep file has one group of members per line; every key=value
+    takes a comma-separated list of values (integer keys also a..b),
+    and a line stands for every combination of them, e.g.
+
+        # 3 x 8 runs of 500 bodies
+        bodies=500 steps=2000 seed=1..8 friction=0,0.01,0.02
+
+    Keys: bodies, steps, seed, gravity, friction, dt, init, forces,
+    theta, cutoff, size (WxH pixels, default 1024x768).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <mpi.h>
+#include "nbody.h"
+#include "nbody-threads.h"
+
+#define LINE_MAX_LEN    1024
+#define MAX_KEYS        16
+
+typedef struct {
+    nbodyParams params;
+    int steps;
+    int owner;                  /* process that runs it */
+    char *result;               /* its output, on the owner */
+    size_t resultLen;
+    double seconds;
+} memberType;
+
+typedef struct {
+    memberType *members;
+    int count;
+    int cap;
+} sweepType;
+
+/*  Members of this process, claimed by the threads of the pool */
+typedef struct {
+    sweepType *sweep;
+    int *mine;
+    int mineCt;
+    int next;
+    pthread_mutex_t lock;       /* next, and the rand() stream of INIT_RANDOM */
+} runType;
+
+
+static int
+add_member(sweepType *sweep, const nbodyParams *p, int steps) {
+    if (sweep->count == sweep->cap) {
+        int cap = sweep->cap ? 2 * sweep->cap : 64;
+        memberType *more = realloc(sweep->members, sizeof(memberType) * cap);
+
+        if (more == 0) {
+            return -1;
+        }
+        sweep->members = more;
+        sweep->cap = cap;
+    }
+    memset(&sweep->members[sweep->count], 0, sizeof(memberType));
+    sweep->members[sweep->count].params = *p;
+    sweep->members[sweep->count].steps = steps;
+    ++sweep->count;
+    return 0;
+}
+
+/*  Apply one value of a key; -1 if either is bad */
+static int
+set_key(nbodyParams *p, int *steps, const char *key, const char *value) {
+    if (strcmp(key, "bodies") == 0) {
+        return (p->bodyCt = atoi(value)) >= 2 ? 0 : -1;
+    } else if (strcmp(key, "steps") == 0) {
+        return (*steps = atoi(value)) >= 0 ? 0 : -1;
+    } else if (strcmp(key, "seed") == 0) {
+        p->seed = strtoul(value, 0, 10);
+    } else if (strcmp(key, "gravity") == 0) {
+        p->gravity = atof(value);
+    } else if (strcmp(key, "friction") == 0) {
+        p->friction = atof(value);
+    } else if (strcmp(key, "dt") == 0) {
+        return (p->dt = atof(value)) > 0 ? 0 : -1;
+    } else if (strcmp(key, "theta") == 0) {
+        p->theta = atof(value);
+    } else if (strcmp(key, "cutoff") == 0) {
+        return (p->cutoff = atof(value)) > 0 ? 0 : -1;
+    } else if (strcmp(key, "init") == 0) {
+        return init_parse(value, &p->init);
+    } else if (strcmp(key, "forces") == 0) {
+        return (p->forces = nbody_find_forces(value)) ? 0 : -1;
+    } else if (strcmp(key, "size") == 0) {
+        return sscanf(value, "%dx%d", &p->xdim, &p->ydim) == 2 && p->xdim > 0 && p->ydim > 0 ? 0 : -1;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/*  Every combination of the values of keys [k, n) on top of p */
+static int
+expand(sweepType *sweep, char **keys, char **values, int k, int n, nbodyParams p, int steps) {
+    char list[LINE_MAX_LEN];
+    char *value, *save;
+
+    if (k == n) {
+        return add_member(sweep, &p, steps);
+    }
+    strcpy(list, values[k]);
+    for (value = strtok_r(list, ",", &save); value; value = strtok_r(0, ",", &save)) {
+        char *dots = strstr(value, "..");
+
+        if (dots) {
+            long lo = atol(value), hi = atol(dots + 2), i;
+
+            for (i = lo; i <= hi; ++i) {
+                char one[32];
+
+                snprintf(one, sizeof(one), "%ld", i);
+                if (set_key(&p, &steps, keys[k], one) < 0 ||
+                        expand(sweep, keys, values, k + 1, n, p, steps) < 0) {
+                    return -1;
+                }
+            }
+        } else if (set_key(&p, &steps, keys[k], value) < 0 ||
+                   expand(sweep, keys, values, k + 1, n, p, steps) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*  Members of the sweep text; -1 (and a message) on a bad line */
+static int
+parse_sweep(char *text, sweepType *sweep) {
+    char *line, *save;
+    int number = 0;
+
+    for (line = strtok_r(text, "\n", &save); line; line = strtok_r(0, "\n", &save)) {
+        char copy[LINE_MAX_LEN];
+        char *keys[MAX_KEYS], *values[MAX_KEYS];
+        char *token, *save2;
+        nbodyParams p;
+        int n = 0, steps = 1000;
+
+        ++number;
+        if (strlen(line) >= sizeof(copy)) {
+            fprintf(stderr, "Sweep line %d too long\n", number);
+            return -1;
+        }
+        strcpy(copy, line);
+        if (strchr(copy, '#')) {
+            *strchr(copy, '#') = 0;
+        }
+        for (token = strtok_r(copy, " \t", &save2); token; token = strtok_r(0, " \t", &save2)) {
+            char *eq = strchr(token, '=');
+
+            if (n == MAX_KEYS) {
+                fprintf(stderr, "Sweep line %d: more than %d keys\n", number, MAX_KEYS);
+                return -1;
+            }
+            if (eq == 0) {
+                fprintf(stderr, "Sweep line %d: '%s' is not key=value\n", number, token);
+                return -1;
+            }
+            *eq = 0;
+            keys[n] = token;
+            values[n++] = eq + 1;
+        }
+        if (n == 0) {
+            continue;
+        }
+        nbody_defaults(&p);
+        p.bodyCt = 1000;
+        p.xdim = 1024;
+        p.ydim = 768;
+        p.diagOut = 0;
+        p.threads = 1;          /* the members share the cores */
+        if (expand(sweep, keys, values, 0, n, p, steps) < 0) {
+            fprintf(stderr, "Sweep line %d: bad key or value\n", number);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*  Longest members first, each to the least loaded process */
+static void
+assign(sweepType *sweep, int procs) {
+    double *load = calloc(procs, sizeof(double));
+    char *done = calloc(sweep->count, 1);
+    int i, j, q;
+
+    for (i = 0; i < sweep->count; ++i) {
+        int longest = -1;
+        double cost = -1;
+
+        for (j = 0; j < sweep->count; ++j) {
+            memberType *m = &sweep->members[j];
+            double c = (double) m->params.bodyCt * m->params.bodyCt * m->steps;
+
+            if (!done[j] && c > cost) {
+                cost = c;
+                longest = j;
+            }
+        }
+        for (j = 0, q = 1; q < procs; ++q) {
+            if (load[q] < load[j]) {
+                j = q;
+            }
+        }
+        sweep->members[longest].owner = j;
+        load[j] += cost;
+        done[longest] = 1;
+    }
+    free(load);
+    free(done);
+}
+
+/*  Seconds on a monotonic clock: the pool threads make no MPI calls
+    (MPI_Init() only guarantees them to the main thread)
+*/
+static double
+now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+}
+
+static void
+run_member(memberType *m, pthread_mutex_t *lock) {
+    nbodySim *sim;
+    FILE *out;
+    double start = now();
+
+    /* the rand() stream is the process's */
+    if (m->params.init == INIT_RANDOM) {
+        pthread_mutex_lock(lock);
+    }
+    sim = nbody_create(&m->params);
+    if (m->params.init == INIT_RANDOM) {
+        pthread_mutex_unlock(lock);
+    }
+    if (sim == 0) {
+        return;
+    }
+    /* no result: the member failed */
+    if (nbody_step(sim, m->steps) == 0 && (out = open_memstream(&m->result, &m->resultLen)) != 0) {
+        nbody_print(sim, out);
+        fclose(out);
+    }
+    nbody_destroy(sim);
+    m->seconds = now() - start;
+}
+
+static void
+run_task(void *arg, int id, int count) {
+    runType *run = arg;
+
+    for (;;) {
+        int i;
+
+        pthread_mutex_lock(&run->lock);
+        i = run->next++;
+        pthread_mutex_unlock(&run->lock);
+        if (i >= run->mineCt) {
+            break;
+        }
+        run_member(&run->sweep->members[run->mine[i]], &run->lock);
+    }
+}
+
+/*  The whole sweep file, read by the master and sent to all */
+static char *
+read_sweep(const char *name, int myid) {
+    char *text = 0;
+    long size = 0;
+    FILE *in;
+
+    if (myid == 0) {
+        if ((in = fopen(name, "r")) == 0) {
+            perror(name);
+            size = -1;
+        } else {
+            fseek(in, 0, SEEK_END);
+            size = ftell(in);
+            rewind(in);
+            if ((text = malloc(size + 1)) == 0 || fread(text, 1, size, in) != (size_t) size) {
+                size = -1;
+            }
+            fclose(in);
+        }
+    }
+    MPI_Bcast(&size, 1, MPI_LONG, 0, MPI_COMM_WORLD);
+    if (size < 0) {
+        free(text);
+        return 0;
+    }
+    if (myid != 0) {
+        text = malloc(size + 1);
+    }
+    MPI_Bcast(text, size, MPI_CHAR, 0, MPI_COMM_WORLD);
+    text[size] = 0;
+    return text;
+}
+
+/*  The members in order, each after a header line, then the index:
+    member, offset and length of every member, and a last line with
+    the offset of the index
+*/
+static int
+write_output(const char *name, sweepType *sweep) {
+    FILE *out = fopen(name, "w");
+    long *offset = malloc(sizeof(long) * sweep->count);
+    long index;
+    int i;
+
+    if (out == 0 || offset == 0) {
+        perror(name);
+        free(offset);
+        return -1;
+    }
+    for (i = 0; i < sweep->count; ++i) {
+        memberType *m = &sweep->members[i];
+
+        offset[i] = ftell(out);
+        fprintf(out, "# member %d bodies %d steps %d seed %lu gravity %g friction %g dt %g init %s forces %s seconds %.3f\n",
+                i, m->params.bodyCt, m->steps, m->params.seed, m->params.gravity, m->params.friction,
+                m->params.dt > 0 ? m->params.dt : DELTA_T, init_name(m->params.init),
+                m->params.forces ? m->params.forces->name : nbody_direct.name, m->seconds);
+        fwrite(m->result, 1, m->resultLen, out);
+    }
+    index = ftell(out);
+    fprintf(out, "# index of %d members\n", sweep->count);
+    for (i = 0; i < sweep->count; ++i) {
+        fprintf(out, "%d %ld %ld\n", i, offset[i], (i + 1 < sweep->count ? offset[i + 1] : index) - offset[i]);
+    }
+    fprintf(out, "# index at %ld\n", index);
+    free(offset);
+    return fclose(out) == 0 ? 0 : -1;
+}
+
+static void
+usage(char *prog) {
+    fprintf(stderr,
+            "Usage: %s [--threads=T] sweep_file output_file\n"
+            "  --threads=T         members run at once per process (default: one per core)\n",
+            prog);
+}
+
+int
+main(int argc, char **argv) {
+    static const struct option options[] = {
+        { "threads",    required_argument, 0, 't' },
+        { 0, 0, 0, 0 }
+    };
+    sweepType sweep = { 0 };
+    runType run;
+    threadPool *pool;
+    char *text;
+    int myid, procs, threads = 0, opt, ok, i;
+    double start, summed = 0;
+
+    MPI_Init(&argc, &argv);
+    MPI_Comm_rank(MPI_COMM_WORLD, &myid);
+    MPI_Comm_size(MPI_COMM_WORLD, &procs);
+    while ((opt = getopt_long(argc, argv, "", options, 0)) != -1) {
+        if (opt != 't') {
+            usage(argv[0]);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        threads = atoi(optarg);
+    }
+    if (argc - optind != 2) {
+        if (myid == 0) {
+            usage(argv[0]);
+        }
+        MPI_Finalize();
+        return 1;
+    }
+
+    text = read_sweep(argv[optind], myid);
+    ok = (text != 0 && parse_sweep(text, &sweep) == 0 && sweep.count > 0);
+    if (!ok) {
+        if (myid == 0 && text) {
+            fprintf(stderr, "No members in %s\n", argv[optind]);
+        }
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    assign(&sweep, procs);
+
+    start = MPI_Wtime();
+    memset(&run, 0, sizeof(run));
+    run.sweep = &sweep;
+    run.mine = malloc(sizeof(int) * sweep.count);
+    for (i = 0; i < sweep.count; ++i) {
+        if (sweep.members[i].owner == myid) {
+            run.mine[run.mineCt++] = i;
+        }
+    }
+    pthread_mutex_init(&run.lock, 0);
+    if ((pool = pool_create(threads)) == 0) {
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    pool_run(pool, run_task, &run);
+    pool_destroy(pool);
+    pthread_mutex_destroy(&run.lock);
+
+    /* every member to the master, in order */
+    for (i = 0; i < sweep.count; ++i) {
+        memberType *m = &sweep.members[i];
+        long len = m->result ? (long) m->resultLen : -1;
+
+        if (m->owner == myid && myid != 0) {
+            MPI_Send(&len, 1, MPI_LONG, 0, 0, MPI_COMM_WORLD);
+            MPI_Send(&m->seconds, 1, MPI_DOUBLE, 0, 0, MPI_COMM_WORLD);
+            MPI_Send(m->result, len > 0 ? (int) len : 0, MPI_CHAR, 0, 0, MPI_COMM_WORLD);
+        } else if (m->owner != myid && myid == 0) {
+            MPI_Recv(&len, 1, MPI_LONG, m->owner, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            MPI_Recv(&m->seconds, 1, MPI_DOUBLE, m->owner, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            m->result = malloc(len > 0 ? len : 1);
+            MPI_Recv(m->result, len > 0 ? (int) len : 0, MPI_CHAR, m->owner, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            m->resultLen = len > 0 ? len : 0;
+            if (len < 0) {
+                free(m->result);
+                m->result = 0;
+            }
+        }
+    }
+
+    ok = 1;
+    if (myid == 0) {
+        for (i = 0; i < sweep.count; ++i) {
+            if (sweep.members[i].result == 0) {
+                fprintf(stderr, "Member %d failed\n", i);
+                ok = 0;
+            }
+            summed += sweep.members[i].seconds;
+        }
+        if (ok && write_output(argv[optind + 1], &sweep) < 0) {
+            ok = 0;
+        }
+        fprintf(stderr, "Ensemble of %d members on %d processes took %10.3f seconds (members summed: %.3f)\n",
+                sweep.count, procs, MPI_Wtime() - start, summed);
+    }
+    for (i = 0; i < sweep.count; ++i) {
+        free(sweep.members[i].result);
+    }
+    free(sweep.members);
+    free(run.mine);
+    free(text);
+    MPI_Finalize();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,413 @@
+/*
+    N-Body initial conditions.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include "nbody-init.h"
+
+#define PI          3.14159265358979323846
+#define MAX_TRIES   16      /* redraws before a body is clamped into space */
+
+/*  Every body owns an independent sequence of draw blocks; a block
+    yields four uniforms. Blocks are numbered by purpose and attempt,
+    so rejection sampling never shifts the draws of another body.
+*/
+#define DRAW_POS        0
+#define DRAW_DIR        1
+#define DRAW_VEL        2
+#define DRAW_JITTER     3
+#define BLOCK(purpose, attempt)     ((unsigned) (attempt) * 4 + (purpose))
+
+static const char *names[] = {
+    "random", "uniform", "plummer", "galaxies", "disk", "lattice", "file"
+};
+
+
+/*  Philox4x32-10 counter-based generator (Salmon et al., SC'11) */
+static void
+philox4x32(uint32_t ctr[4], uint32_t k0, uint32_t k1) {
+    int i;
+
+    for (i = 0; i < 10; ++i) {
+        uint64_t p0 = (uint64_t) 0xD2511F53 * ctr[0];
+        uint64_t p1 = (uint64_t) 0xCD9E8D57 * ctr[2];
+        uint32_t c1 = ctr[1];
+        uint32_t c3 = ctr[3];
+
+        ctr[0] = ((uint32_t) (p1 >> 32)) ^ c1 ^ k0;
+        ctr[1] = (uint32_t) p1;
+        ctr[2] = ((uint32_t) (p0 >> 32)) ^ c3 ^ k1;
+        ctr[3] = (uint32_t) p0;
+        k0 += 0x9E3779B9;
+        k1 += 0xBB67AE85;
+    }
+}
+
+/*  Four uniforms in (0, 1) for block 'block' of body b */
+static void
+draw(const initParams *p, int b, unsigned block, double u[4]) {
+    uint32_t ctr[4];
+    uint64_t seed = p->seed;
+    int i;
+
+    ctr[0] = (uint32_t) b;
+    ctr[1] = block;
+    ctr[2] = 0;
+    ctr[3] = 0;
+    philox4x32(ctr, (uint32_t) seed, (uint32_t) (seed >> 32));
+    for (i = 0; i < 4; ++i) {
+        u[i] = (ctr[i] + 0.5) / 4294967296.0;
+    }
+}
+
+static int
+inside(const initParams *p, double x, double y) {
+    return x >= 0 && x < p->xdim && y >= 0 && y < p->ydim;
+}
+
+/*  Same wall handling as compute_positions() */
+static void
+clamp(const initParams *p, initBodyType *o) {
+    if (o->x < 0) {
+        o->x = 0;
+    } else if (o->x >= p->xdim) {
+        o->x = p->xdim - 1;
+    }
+    if (o->y < 0) {
+        o->y = 0;
+    } else if (o->y >= p->ydim) {
+        o->y = p->ydim - 1;
+    }
+}
+
+/*  Isotropic 3D vector of length len, projected on the plane */
+static void
+isotropic(double u0, double u1, double len, double *x, double *y) {
+    double cost = 2 * u0 - 1;
+    double sint = sqrt(1 - cost * cost);
+    double phi = 2 * PI * u1;
+
+    *x = len * sint * cos(phi);
+    *y = len * sint * sin(phi);
+}
+
+static void
+set_mass(initBodyType *o, double mass) {
+    o->mass = mass;
+    o->radius = cbrt(mass);
+}
+
+static double
+scale(const initParams *p) {
+    return p->xdim < p->ydim ? p->xdim : p->ydim;
+}
+
+
+/*  The original workload: uniform placement, radius growing with b^2.
+    rand() is a serial stream: consecutive ranges continue it, any
+    other range has to replay it from the start.
+*/
+static void
+gen_random(initParams *p, int lo, int hi, initBodyType *out) {
+    double diag = sqrt(1.0 * ((p->xdim * p->xdim) + (p->ydim * p->ydim)));
+    int b;
+
+    if (lo < p->next) {
+        srand(p->seed);
+        p->next = 0;
+    }
+    for (b = p->next; b < hi; ++b) {
+        double x = (rand() % p->xdim);
+        double y = (rand() % p->ydim);
+        double xv = ((rand() % 20000) - 10000) / 2000.0;
+        double yv = ((rand() % 20000) - 10000) / 2000.0;
+        initBodyType *o;
+
+        if (b < lo) continue;
+        o = &out[b - lo];
+        o->x = x;
+        o->y = y;
+        o->radius = 1 + (((double) b * b + 1.0) * diag) /
+                    (25.0 * ((double) p->bodyCt * p->bodyCt + 1.0));
+        o->mass = o->radius * o->radius * o->radius;
+        o->xv = xv;
+        o->yv = yv;
+    }
+    p->next = hi;
+}
+
+/*  Same distribution as gen_random(), drawn per body */
+static void
+gen_uniform(const initParams *p, int b, initBodyType *o) {
+    double diag = sqrt(1.0 * ((p->xdim * p->xdim) + (p->ydim * p->ydim)));
+    double u[4];
+
+    draw(p, b, BLOCK(DRAW_POS, 0), u);
+    o->x = (int) (u[0] * p->xdim);
+    o->y = (int) (u[1] * p->ydim);
+    o->radius = 1 + (((double) b * b + 1.0) * diag) /
+                (25.0 * ((double) p->bodyCt * p->bodyCt + 1.0));
+    o->mass = o->radius * o->radius * o->radius;
+    o->xv = ((int) (u[2] * 20000) - 10000) / 2000.0;
+    o->yv = ((int) (u[3] * 20000) - 10000) / 2000.0;
+}
+
+/*  Plummer sphere of unit-mass bodies (Aarseth, Henon & Wielen 1974),
+    positions and velocities projected on the plane.
+*/
+static void
+gen_plummer(const initParams *p, int b, initBodyType *o) {
+    double a = scale(p) / 16;
+    double total = p->bodyCt;
+    double u[4];
+    double r = 0, q, ve;
+    int n;
+
+    set_mass(o, 1.0);
+    for (n = 0; n < MAX_TRIES; ++n) {
+        draw(p, b, BLOCK(DRAW_POS, n), u);
+        /* cut the mass distribution at 99.9% to avoid runaway radii */
+        r = a / sqrt(pow(u[0] * 0.999, -2.0 / 3.0) - 1);
+        isotropic(u[1], u[2], r, &o->x, &o->y);
+        o->x += p->xdim / 2.0;
+        o->y += p->ydim / 2.0;
+        if (inside(p, o->x, o->y)) break;
+    }
+    clamp(p, o);
+
+    /* von Neumann rejection for q = v / v_escape */
+    for (n = 0; ; ++n) {
+        draw(p, b, BLOCK(DRAW_VEL, n), u);
+        q = u[0];
+        if (0.1 * u[1] < q * q * pow(1 - q * q, 3.5)) break;
+    }
+    ve = sqrt(2 * p->gravity * total) * pow(r * r + a * a, -0.25);
+    draw(p, b, BLOCK(DRAW_DIR, 0), u);
+    isotropic(u[0], u[1], q * ve, &o->xv, &o->yv);
+}
+
+/*  Exponential disk of bodies [first, first + count) around a heavy
+    central body 'first', on circular orbits with 10% dispersion.
+*/
+static void
+gen_disk_body(const initParams *p, int b, int first, int count,
+              double cx, double cy, double h, double spin,
+              initBodyType *o) {
+    double central = count / 4.0 + 1;
+    double disk = count - 1;
+    double u[4];
+    double r = 0, phi = 0, enclosed, mindist, vc;
+    int n;
+
+    if (b == first) {
+        o->x = cx;
+        o->y = cy;
+        o->xv = 0;
+        o->yv = 0;
+        set_mass(o, central);
+        clamp(p, o);
+        return;
+    }
+
+    set_mass(o, 1.0);
+    for (n = 0; n < MAX_TRIES; ++n) {
+        draw(p, b, BLOCK(DRAW_POS, n), u);
+        /* surface density exp(-r/h) => r ~ Gamma(2, h) */
+        r = -h * log(u[0] * u[1]);
+        phi = 2 * PI * u[2];
+        o->x = cx + r * cos(phi);
+        o->y = cy + r * sin(phi);
+        if (inside(p, o->x, o->y)) break;
+    }
+    clamp(p, o);
+
+    /* circular speed under the same close-range clamp as compute_forces() */
+    enclosed = central + disk * (1 - (1 + r / h) * exp(-r / h));
+    mindist = cbrt(central) + o->radius;
+    vc = sqrt(p->gravity * enclosed * r / (r > mindist ? r * r : mindist * mindist));
+
+    draw(p, b, BLOCK(DRAW_VEL, 0), u);
+    o->xv = -spin * vc * sin(phi) + 0.2 * vc * (u[0] - 0.5);
+    o->yv = spin * vc * cos(phi) + 0.2 * vc * (u[1] - 0.5);
+}
+
+static void
+gen_disk(const initParams *p, int b, initBodyType *o) {
+    gen_disk_body(p, b, 0, p->bodyCt, p->xdim / 2.0, p->ydim / 2.0,
+                  scale(p) / 10, 1.0, o);
+}
+
+/*  Two counter-rotating disks, bodies [0, N/2) and [N/2, N),
+    approaching each other on a grazing trajectory.
+*/
+static void
+gen_galaxies(const initParams *p, int b, initBodyType *o) {
+    int half = p->bodyCt / 2;
+    double d = scale(p) / 5;
+    double vb = 0.5 * sqrt(p->gravity * p->bodyCt / (4 * d));
+
+    if (b < half) {
+        gen_disk_body(p, b, 0, half, p->xdim / 2.0 - d, p->ydim / 2.0 - d / 2,
+                      scale(p) / 20, 1.0, o);
+        o->xv += vb;
+    } else {
+        gen_disk_body(p, b, half, p->bodyCt - half,
+                      p->xdim / 2.0 + d, p->ydim / 2.0 + d / 2,
+                      scale(p) / 20, -1.0, o);
+        o->xv -= vb;
+    }
+}
+
+/*  Body 0 is a central mass as heavy as all the others together,
+    the rest sit at rest on a slightly jittered lattice.
+*/
+static void
+gen_lattice(const initParams *p, int b, initBodyType *o) {
+    int k = (int) ceil(sqrt(p->bodyCt - 1.0));
+    int rows = (p->bodyCt - 1 + k - 1) / k;
+    double sx = p->xdim / (k + 1.0);
+    double sy = p->ydim / (rows + 1.0);
+    double u[4];
+
+    o->xv = 0;
+    o->yv = 0;
+    if (b == 0) {
+        o->x = p->xdim / 2.0;
+        o->y = p->ydim / 2.0;
+        set_mass(o, p->bodyCt - 1.0);
+        return;
+    }
+    set_mass(o, 1.0);
+    draw(p, b, BLOCK(DRAW_JITTER, 0), u);
+    o->x = ((b - 1) % k + 1 + 0.2 * (u[0] - 0.5)) * sx;
+    o->y = ((b - 1) / k + 1 + 0.2 * (u[1] - 0.5)) * sy;
+    clamp(p, o);
+}
+
+static int
+read_bodies(initParams *p, int lo, int hi, initBodyType *out) {
+    char *buf = (char *) out;
+    size_t left = (size_t) (hi - lo) * sizeof(initBodyType);
+    off_t off = 16 + (off_t) lo * sizeof(initBodyType);
+
+    while (left > 0) {
+        ssize_t n = pread(p->fd, buf, left, off);
+
+        if (n <= 0) {
+            fprintf(stderr, "%s: short read\n", p->file);
+            return -1;
+        }
+        buf += n;
+        off += n;
+        left -= n;
+    }
+    return 0;
+}
+
+
+int
+init_parse(const char *name, initKind *kind) {
+    int i;
+
+    for (i = 0; i < (int) (sizeof(names) / sizeof(names[0])); ++i) {
+        if (strcmp(name, names[i]) == 0) {
+            *kind = (initKind) i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *
+init_name(initKind kind) {
+    return names[kind];
+}
+
+int
+init_open(initParams *p) {
+    char magic[8];
+    uint64_t count;
+
+    p->fd = -1;
+    p->next = 0;
+    srand(p->seed);
+    if (p->xdim <= 0 || p->ydim <= 0) {
+        fprintf(stderr, "no space to place bodies in (%dx%d)\n", p->xdim, p->ydim);
+        return -1;
+    }
+    if (p->kind != INIT_FILE) {
+        return 0;
+    }
+
+    if ((p->fd = open(p->file, O_RDONLY)) < 0) {
+        perror(p->file);
+        return -1;
+    }
+    if (pread(p->fd, magic, 8, 0) != 8 ||
+            pread(p->fd, &count, 8, 8) != 8 ||
+            memcmp(magic, INIT_FILE_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s: not an N-body state file\n", p->file);
+        init_close(p);
+        return -1;
+    }
+    if (count < (uint64_t) p->bodyCt) {
+        fprintf(stderr, "%s: holds only %llu bodies\n", p->file,
+                (unsigned long long) count);
+        init_close(p);
+        return -1;
+    }
+    return 0;
+}
+
+/*  Generate bodies [lo, hi) into out[0 .. hi-lo) */
+int
+init_bodies(initParams *p, int lo, int hi, initBodyType *out) {
+    int b;
+
+    switch (p->kind) {
+    case INIT_RANDOM:
+        gen_random(p, lo, hi, out);
+        return 0;
+    case INIT_FILE:
+        return read_bodies(p, lo, hi, out);
+    default:
+        break;
+    }
+
+    for (b = lo; b < hi; ++b) {
+        initBodyType *o = &out[b - lo];
+
+        switch (p->kind) {
+        case INIT_UNIFORM:
+            gen_uniform(p, b, o);
+            break;
+        case INIT_PLUMMER:
+            gen_plummer(p, b, o);
+            break;
+        case INIT_GALAXIES:
+            gen_galaxies(p, b, o);
+            break;
+        case INIT_DISK:
+            gen_disk(p, b, o);
+            break;
+        default:
+            gen_lattice(p, b, o);
+            break;
+        }
+    }
+    return 0;
+}
+
+void
+init_close(initParams *p) {
+    if (p->fd >= 0) {
+        close(p->fd);
+        p->fd = -1;
+    }
+}
@@ -0,0 +1,58 @@
+/*
+    N-Body initial conditions.
+
+    Every generator except INIT_RANDOM is a pure function of
+    (seed, body index): draws come from a counter-based generator
+    instead of the serial rand() stream, so any range of bodies can
+    be produced independently and in any order.
+*/
+
+#ifndef NBODY_INIT_H
+#define NBODY_INIT_H
+
+typedef struct {
+    double x;           /* X-axis coordinate */
+    double y;           /* Y-axis coordinate */
+    double xv;          /* velocity along X-axis */
+    double yv;          /* velocity along Y-axis */
+    double mass;        /* Mass of the body */
+    double radius;      /* width (derived from mass) */
+} initBodyType;
+
+typedef enum {
+    INIT_RANDOM = 0,    /* uniform placement from srand(seed)/rand() */
+    INIT_UNIFORM,       /* same distribution, counter-based */
+    INIT_PLUMMER,       /* Plummer sphere, projected on the plane */
+    INIT_GALAXIES,      /* two exponential disks on a collision course */
+    INIT_DISK,          /* single rotating exponential disk */
+    INIT_LATTICE,       /* jittered lattice around a heavy central mass */
+    INIT_FILE           /* binary state file, see below */
+} initKind;
+
+typedef struct {
+    initKind kind;
+    unsigned long seed;
+    int bodyCt;
+    int xdim;
+    int ydim;
+    double gravity;     /* used to put disks and spheres in equilibrium */
+    const char *file;   /* state file for INIT_FILE */
+    int fd;             /* (private) open state file */
+    int next;           /* (private) next body of the rand() stream */
+} initParams;
+
+/*  Binary state file: INIT_FILE_MAGIC, a 64-bit body count and then
+    one initBodyType record per body, all in native byte order.
+*/
+#define INIT_FILE_MAGIC     "NBODYBIN"
+
+/*  Bodies generated per call when filling large arrays */
+#define INIT_CHUNK          4096
+
+int init_parse(const char *name, initKind *kind);
+const char *init_name(initKind kind);
+int init_open(initParams *p);
+int init_bodies(initParams *p, int lo, int hi, initBodyType *out);
+void init_close(initParams *p);
+
+#endif
@@ -0,0 +1,87 @@
+/*
+    Pair interaction shared by the direct force backends (internal).
+*/
+
+#ifndef NBODY_KERNEL_H
+#define NBODY_KERNEL_H
+
+#include <math.h>
+#include "nbody.h"
+
+/*  Force of a body at distance (dx, dy) with its radius added in
+    mindist and its mass multiplied in mm, as components (*xf, *yf);
+    the potential of the pair if 'energy' (else 0). Every backend goes
+    through here so that the same pairs give the same bits.
+*/
+static inline double
+pair_force(double dx, double dy, double mm, double mindist, double gravity,
+           double *xf, double *yf, const int energy) {
+    double angle = atan2(dy, dx);
+    double dsqr = dx * dx + dy * dy;
+    double mindsqr = mindist * mindist;
+    double forced = ((dsqr < mindsqr) ? mindsqr : dsqr);
+    double force = mm * gravity / forced;
+
+    *xf = force * cos(angle);
+    *yf = force * sin(angle);
+
+    if (energy) {
+        /* -G m m / d, linear inside the clamping distance */
+        double d = sqrt(dsqr);
+
+        return force * ((dsqr < mindsqr) ? (2 * mindist - d) : d);
+    }
+    return 0;
+}
+
+/*  Add the force between bodies b and c to 'forces' and, if 'energy',
+    their potential to *potential
+*/
+static inline void
+direct_pair(nbodySim *sim, forceType *forces, int b, int c,
+            const int energy, double *potential) {
+    double xf, yf;
+    double pot = pair_force(X(c) - X(b), Y(c) - Y(b), M(b) * M(c), R(b) + R(c),
+                            sim->gravity, &xf, &yf, energy);
+
+    /* Slightly sneaky...
+       force of b on c is negative of c on b;
+    */
+    forces[b].xf += xf;
+    forces[b].yf += yf;
+    forces[c].xf -= xf;
+    forces[c].yf -= yf;
+
+    if (energy) {
+        *potential -= pot;
+    }
+}
+
+/*  Add the force of c on b only, the same bits as direct_pair():
+    the pair is evaluated from its lower index, as there, and taken
+    negated on the higher end; owner-computes backends see every pair
+    from both ends, so the potential gets half of it
+*/
+static inline void
+direct_force(nbodySim *sim, forceType *forces, int b, int c,
+             const int energy, double *potential) {
+    double xf, yf, pot;
+
+    if (b < c) {
+        pot = pair_force(X(c) - X(b), Y(c) - Y(b), M(b) * M(c), R(b) + R(c),
+                         sim->gravity, &xf, &yf, energy);
+        forces[b].xf += xf;
+        forces[b].yf += yf;
+    } else {
+        pot = pair_force(X(b) - X(c), Y(b) - Y(c), M(c) * M(b), R(c) + R(b),
+                         sim->gravity, &xf, &yf, energy);
+        forces[b].xf -= xf;
+        forces[b].yf -= yf;
+    }
+
+    if (energy) {
+        *potential -= pot / 2;
+    }
+}
+
+#endif
@@ -0,0 +1,334 @@
+/*
+    LogGP microbenchmark of the MPI path of nbody-par.
+
+    The method of the LogP benchmark of the IPL: process 0 and a
+    partner, on another node if there is one, time small messages
+    (round trip, send overhead, receive overhead of an already
+    arrived message, gap of back-to-back sends) and streams of long
+    ones for the gap per byte; process 0 also times the pair force of
+    the direct backend. The parameters are appended to the file of
+    nbody-model.h, which nbody-par --predict reads, and the optimal
+    process counts they predict are printed.
+
+    Usage: mpirun -np P nbody-logp [--count=N] [--repeat=R] [--no-save]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <mpi.h>
+#include "nbody.h"
+#include "nbody-model.h"
+
+#define LOGP_COUNT      10000   /* small messages per measurement */
+#define LOGP_REPEAT     5       /* measurements, the median kept */
+#define STREAM_BYTES    (1 << 24)       /* bytes per long message size */
+#define PAIR_BODIES     2000    /* bodies of the pair force timing */
+#define PAIR_STEPS      3
+
+static const int sizes[] = { 1 << 16, 1 << 18, 1 << 20, 1 << 22, 0 };
+static const char *const modelled[] = { "allreduce", "owner", "rma", "queue", 0 };
+static const int bodyCts[] = { 1000, 2000, 5000, 10000, 20000, 50000, 100000, 0 };
+
+typedef struct {
+    double rtt, os, or, g;
+} smallRepeat;
+
+static void
+usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --count=N           small messages per measurement (default %d)\n"
+            "  --repeat=R          measurements, the median of them kept (default %d)\n"
+            "  --no-save           do not append the parameters to $NBODY_LOGP\n",
+            prog, LOGP_COUNT, LOGP_REPEAT);
+}
+
+/*  The lowest process off the node of process 0, else 1; *remote
+    tells which
+*/
+static int
+pick_partner(int myid, int procs, int *remote) {
+    MPI_Comm node;
+    int leader = myid, partner;
+
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, myid, MPI_INFO_NULL, &node);
+    MPI_Allreduce(MPI_IN_PLACE, &leader, 1, MPI_INT, MPI_MIN, node);
+    MPI_Comm_free(&node);
+    partner = (leader != 0) ? myid : procs;
+    MPI_Allreduce(MPI_IN_PLACE, &partner, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+    *remote = (partner < procs);
+    return *remote ? partner : 1;
+}
+
+static void
+spin(double secs) {
+    double until = MPI_Wtime() + secs;
+
+    while (MPI_Wtime() < until)
+        ;
+}
+
+/*  Seconds of one MPI_Wtime() reading */
+static double
+clock_overhead(void) {
+    double start = MPI_Wtime();
+    int i;
+
+    for (i = 0; i < 100000; ++i) {
+        MPI_Wtime();
+        MPI_Wtime();
+    }
+    return (MPI_Wtime() - start) / 100000 / 2;
+}
+
+static int
+compare_rtt(const void *a, const void *b) {
+    double x = ((const smallRepeat *) a)->rtt, y = ((const smallRepeat *) b)->rtt;
+
+    return (x > y) - (x < y);
+}
+
+/*  Process 0's side of the small messages: the parameters of the
+    measurement with the median round trip of 'repeat', the latency
+    what its round trip leaves of its overheads; -1 if that is
+    negative
+*/
+static int
+measure_small(int partner, int count, int repeat, logpParams *lp) {
+    double tick = clock_overhead();
+    smallRepeat *m = malloc(sizeof(smallRepeat) * repeat);
+    char buf[1];
+    int r, i;
+
+    for (r = 0; r < repeat; ++r) {
+        double start, t, rtt, os, or, g, sendTotal = 0, recvTotal = 0;
+
+        /* round trips, timing the sends */
+        start = MPI_Wtime();
+        for (i = 0; i < count; ++i) {
+            t = MPI_Wtime();
+            MPI_Send(buf, 1, MPI_BYTE, partner, 0, MPI_COMM_WORLD);
+            sendTotal += MPI_Wtime() - t;
+            MPI_Recv(buf, 1, MPI_BYTE, partner, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        }
+        rtt = (MPI_Wtime() - start) / count - tick;
+        os = sendTotal / count - tick;
+
+        /* back-to-back sends, acknowledged once */
+        start = MPI_Wtime();
+        for (i = 0; i < count; ++i) {
+            MPI_Send(buf, 1, MPI_BYTE, partner, 0, MPI_COMM_WORLD);
+        }
+        MPI_Recv(buf, 1, MPI_BYTE, partner, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        g = (MPI_Wtime() - start) / count;
+
+        /* receives of replies that should have arrived by then */
+        for (i = 0; i < count; ++i) {
+            MPI_Send(buf, 1, MPI_BYTE, partner, 0, MPI_COMM_WORLD);
+            spin(2 * rtt);
+            t = MPI_Wtime();
+            MPI_Recv(buf, 1, MPI_BYTE, partner, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            recvTotal += MPI_Wtime() - t;
+        }
+        or = recvTotal / count - tick;
+
+        if (m) {
+            m[r].rtt = rtt;
+            m[r].os = os;
+            m[r].or = or;
+            m[r].g = g;
+        }
+    }
+    if (m == 0) {
+        return -1;
+    }
+    qsort(m, repeat, sizeof(smallRepeat), compare_rtt);
+    r = repeat / 2;
+    lp->sendOverhead = m[r].os;
+    lp->recvOverhead = m[r].or;
+    lp->gap = m[r].g;
+    lp->latency = m[r].rtt / 2 - m[r].os - m[r].or;
+    if (lp->latency < 0) {
+        fprintf(stderr, "Half the round trip (%.3g s) is less than the overheads (%.3g s + %.3g s)\n",
+                m[r].rtt / 2, m[r].os, m[r].or);
+    }
+    free(m);
+    return lp->latency < 0 ? -1 : 0;
+}
+
+/*  The partner's side of measure_small() */
+static void
+echo_small(int count, int repeat) {
+    char buf[1];
+    int r, i;
+
+    for (r = 0; r < repeat; ++r) {
+        for (i = 0; i < count; ++i) {
+            MPI_Recv(buf, 1, MPI_BYTE, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            MPI_Send(buf, 1, MPI_BYTE, 0, 0, MPI_COMM_WORLD);
+        }
+        for (i = 0; i < count; ++i) {
+            MPI_Recv(buf, 1, MPI_BYTE, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        }
+        MPI_Send(buf, 1, MPI_BYTE, 0, 0, MPI_COMM_WORLD);
+        for (i = 0; i < count; ++i) {
+            MPI_Recv(buf, 1, MPI_BYTE, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            MPI_Send(buf, 1, MPI_BYTE, 0, 0, MPI_COMM_WORLD);
+        }
+    }
+}
+
+/*  Streams of long messages, each size acknowledged once; process 0
+    fits the gap per byte to the time per message
+*/
+static double
+stream(int myid, int partner, char *buf) {
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    int n = 0, s, i;
+
+    for (s = 0; sizes[s]; ++s) {
+        int k = STREAM_BYTES / sizes[s];
+        double start = MPI_Wtime(), per;
+
+        for (i = 0; i < k; ++i) {
+            if (myid == 0) {
+                MPI_Send(buf, sizes[s], MPI_BYTE, partner, 0, MPI_COMM_WORLD);
+            } else {
+                MPI_Recv(buf, sizes[s], MPI_BYTE, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            }
+        }
+        if (myid == 0) {
+            MPI_Recv(buf, 1, MPI_BYTE, partner, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        } else {
+            MPI_Send(buf, 1, MPI_BYTE, 0, 0, MPI_COMM_WORLD);
+        }
+        per = (MPI_Wtime() - start) / k;
+        sx += sizes[s];
+        sy += per;
+        sxx += (double) sizes[s] * sizes[s];
+        sxy += sizes[s] * per;
+        ++n;
+    }
+    return (n * sxy - sx * sy) / (n * sxx - sx * sx);
+}
+
+/*  Seconds per pair force of the direct backend on this core */
+static double
+pair_time(void) {
+    nbodyParams p;
+    nbodySim *sim;
+    double start, secs;
+    int ok;
+
+    nbody_defaults(&p);
+    p.bodyCt = PAIR_BODIES;
+    p.xdim = 1024;
+    p.ydim = 768;
+    p.forces = &nbody_direct;
+    if ((sim = nbody_create(&p)) == 0) {
+        return -1;
+    }
+    nbody_step(sim, 1);
+    start = MPI_Wtime();
+    ok = (nbody_step(sim, PAIR_STEPS) == 0);
+    secs = MPI_Wtime() - start;
+    nbody_destroy(sim);
+    return ok ? secs / PAIR_STEPS / nbody_pair_count(PAIR_BODIES) : -1;
+}
+
+/*  The optimal process counts of the model for a range of N */
+static void
+predictions(const logpParams *lp, FILE *out) {
+    int i, e;
+
+    fprintf(out, "Predicted optimal processes (step time in ms):\n%8s", "bodies");
+    for (e = 0; modelled[e]; ++e) {
+        fprintf(out, " %18s", modelled[e]);
+    }
+    fprintf(out, "\n");
+    for (i = 0; bodyCts[i]; ++i) {
+        fprintf(out, "%8d", bodyCts[i]);
+        for (e = 0; modelled[e]; ++e) {
+            modelCost cost;
+            int ranks = model_best_ranks(lp, bodyCts[i], MODEL_MAXRANKS, modelled[e], &cost);
+
+            fprintf(out, "   %4d (%9.3f)", ranks, cost.total * 1e3);
+        }
+        fprintf(out, "\n");
+    }
+}
+
+int
+main(int argc, char **argv) {
+    static const struct option options[] = {
+        { "count",      required_argument, 0, 'c' },
+        { "repeat",     required_argument, 0, 'r' },
+        { "no-save",    no_argument,       0, 'n' },
+        { 0, 0, 0, 0 }
+    };
+    int count = LOGP_COUNT, repeat = LOGP_REPEAT, save = 1, ok = 1;
+    int myid, procs, partner, remote, opt, namelen;
+    char name[MPI_MAX_PROCESSOR_NAME];
+    logpParams lp;
+    char *buf;
+
+    MPI_Init(&argc, &argv);
+    MPI_Comm_rank(MPI_COMM_WORLD, &myid);
+    MPI_Comm_size(MPI_COMM_WORLD, &procs);
+    while ((opt = getopt_long(argc, argv, "", options, 0)) != -1) {
+        if (opt == 'c' && (count = atoi(optarg)) > 0) {
+            continue;
+        } else if (opt == 'r' && (repeat = atoi(optarg)) > 0) {
+            continue;
+        } else if (opt == 'n') {
+            save = 0;
+            continue;
+        }
+        if (myid == 0) {
+            usage(argv[0]);
+        }
+        MPI_Finalize();
+        return 1;
+    }
+    if (procs < 2 || argc != optind) {
+        if (myid == 0) {
+            usage(argv[0]);
+            fprintf(stderr, "(on two processes at least)\n");
+        }
+        MPI_Finalize();
+        return 1;
+    }
+
+    partner = pick_partner(myid, procs, &remote);
+    buf = calloc(sizes[sizeof(sizes) / sizeof(sizes[0]) - 2], 1);
+    if (myid == 0) {
+        fprintf(stderr, "LogGP between processes 0 and %d (%s node): %d messages, %d times\n",
+                partner, remote ? "another" : "the same", count, repeat);
+        ok = (measure_small(partner, count, repeat, &lp) == 0);
+        lp.byteGap = stream(myid, partner, buf);
+    } else if (myid == partner) {
+        echo_small(count, repeat);
+        stream(myid, partner, buf);
+    }
+    free(buf);
+    MPI_Barrier(MPI_COMM_WORLD);
+
+    if (myid == 0 && ok && (lp.pair = pair_time()) < 0) {
+        fprintf(stderr, "Could not time the pair force\n");
+        ok = 0;
+    }
+    if (myid == 0 && !ok) {
+        fprintf(stderr, "LogGP measurement failed, nothing saved\n");
+    } else if (myid == 0) {
+        MPI_Get_processor_name(name, &namelen);
+        snprintf(lp.host, sizeof(lp.host), "%.63s", name);
+        logp_describe(&lp, stdout);
+        predictions(&lp, stdout);
+        if (save && logp_store(&lp) < 0) {
+            fprintf(stderr, "Could not save the parameters\n");
+        }
+    }
+    MPI_Finalize();
+    return ok ? 0 : 1;
+}
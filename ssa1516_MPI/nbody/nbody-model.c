@@ -0,0 +1,183 @@
+/*
+    LogGP cost model of nbody-par.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "nbody.h"
+#include "nbody-model.h"
+
+#define MAXLINE         512
+#define QUEUE_CLAIMS    9       /* fetch-and-ops of a process per step: its default 8 blocks and the failed one */
+
+static int
+logp_path(char *path, size_t size) {
+    const char *env = getenv("NBODY_LOGP");
+    const char *home = getenv("HOME");
+
+    if (env && *env) {
+        snprintf(path, size, "%s", env);
+    } else if (home && *home) {
+        snprintf(path, size, "%s/.nbody-logp", home);
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/*  The last measurement: 0, or -1 if there is none */
+int
+logp_load(logpParams *lp) {
+    char path[MAXLINE], line[MAXLINE];
+    logpParams p;
+    int found = 0;
+    FILE *in;
+
+    if (logp_path(path, sizeof(path)) < 0 || (in = fopen(path, "r")) == 0) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), in)) {
+        if (line[0] != '#' &&
+                sscanf(line, "%63s %lf %lf %lf %lf %lf %lf", p.host, &p.latency, &p.sendOverhead,
+                       &p.recvOverhead, &p.gap, &p.byteGap, &p.pair) == 7) {
+            *lp = p;
+            found = 1;
+        }
+    }
+    fclose(in);
+    return found ? 0 : -1;
+}
+
+/*  Append a measurement, which later loads then use */
+int
+logp_store(const logpParams *lp) {
+    char path[MAXLINE];
+    FILE *out;
+    int header;
+
+    if (logp_path(path, sizeof(path)) < 0) {
+        return -1;
+    }
+    header = (access(path, F_OK) != 0);
+    if ((out = fopen(path, "a")) == 0) {
+        perror(path);
+        return -1;
+    }
+    if (header) {
+        fprintf(out, "# host L os or g G pair\n");
+    }
+    fprintf(out, "%s %.6e %.6e %.6e %.6e %.6e %.6e\n", lp->host, lp->latency, lp->sendOverhead,
+            lp->recvOverhead, lp->gap, lp->byteGap, lp->pair);
+    if (fclose(out) != 0) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+void
+logp_describe(const logpParams *lp, FILE *out) {
+    fprintf(out, "LogGP (%s): L %.3f us, os %.3f us, or %.3f us, g %.3f us, G %.4f ns/byte (%.2f GB/s), pair force %.2f ns\n",
+            lp->host, lp->latency * 1e6, lp->sendOverhead * 1e6, lp->recvOverhead * 1e6, lp->gap * 1e6,
+            lp->byteGap * 1e9, lp->byteGap > 0 ? 1e-9 / lp->byteGap : 0.0, lp->pair * 1e9);
+}
+
+/*  Rounds of a recursive doubling over 'ranks' processes */
+static int
+rounds(int ranks) {
+    int k = 0;
+
+    while ((1 << k) < ranks) {
+        ++k;
+    }
+    return k;
+}
+
+/*  A small message from send to receive: os + L + or */
+static double
+hop(const logpParams *lp) {
+    return lp->sendOverhead + lp->latency + lp->recvOverhead;
+}
+
+/*  Allgather of 'bytes' in all, an equal share from every process:
+    log P rounds of doubling messages
+*/
+static double
+allgather(const logpParams *lp, double bytes, int ranks) {
+    return rounds(ranks) * hop(lp) + bytes * (ranks - 1) / ranks * lp->byteGap;
+}
+
+/*  Allreduce of 'bytes': recursive doubling of the whole vector, or
+    reduce-scatter and allgather of its pieces, whichever is faster
+*/
+static double
+allreduce(const logpParams *lp, double bytes, int ranks) {
+    int k = rounds(ranks);
+    double doubling = k * (hop(lp) + bytes * lp->byteGap);
+    double halving = 2 * k * hop(lp) + 2 * bytes * (ranks - 1) / ranks * lp->byteGap;
+
+    return doubling < halving ? doubling : halving;
+}
+
+/*  Predicted step of bodyCt bodies on 'ranks' processes of the
+    exchange (0: allreduce); -1 if that layer is not modelled
+*/
+int
+model_step(const logpParams *lp, int bodyCt, int ranks, const char *exchange, modelCost *cost) {
+    double pairs = (double) bodyCt * (bodyCt - 1) / 2;
+    double positions = (double) sizeof(bodyPositionType) * bodyCt;
+    double forces = (double) sizeof(forceType) * bodyCt;
+    double fences;
+
+    if (exchange == 0 || strcmp(exchange, "allreduce") == 0) {
+        cost->compute = pairs / ranks * lp->pair;
+        cost->comm = allreduce(lp, forces, ranks) + allgather(lp, positions, ranks);
+    } else if (strcmp(exchange, "owner") == 0) {
+        /* every pair from both ends */
+        cost->compute = 2 * pairs / ranks * lp->pair;
+        cost->comm = allgather(lp, positions, ranks);
+    } else if (strcmp(exchange, "rma") == 0) {
+        /* the forces of the others, one accumulate per owner */
+        fences = 2 * rounds(ranks) * hop(lp);
+        cost->compute = pairs / ranks * lp->pair;
+        cost->comm = fences + allgather(lp, positions, ranks);
+        if (ranks > 1) {
+            cost->comm += (ranks - 1) * (lp->gap > lp->sendOverhead ? lp->gap : lp->sendOverhead) +
+                          forces * (ranks - 1) / ranks * lp->byteGap + lp->latency + lp->recvOverhead;
+        }
+    } else if (strcmp(exchange, "queue") == 0) {
+        /* as allreduce, plus the remote fetch-and-ops of the blocks */
+        cost->compute = pairs / ranks * lp->pair;
+        cost->comm = allreduce(lp, forces, ranks) + allgather(lp, positions, ranks);
+        if (ranks > 1) {
+            cost->comm += QUEUE_CLAIMS * (hop(lp) + lp->latency);
+        }
+    } else {
+        return -1;
+    }
+    cost->total = cost->compute + cost->comm;
+    return 0;
+}
+
+/*  The process count in [1, maxRanks] of the fastest predicted step
+    (the fewest of equal ones, and no more than the bodies), with its
+    cost; -1 if not modelled
+*/
+int
+model_best_ranks(const logpParams *lp, int bodyCt, int maxRanks, const char *exchange, modelCost *cost) {
+    modelCost c;
+    int best = -1, ranks;
+
+    for (ranks = 1; ranks <= maxRanks && ranks <= bodyCt; ++ranks) {
+        if (model_step(lp, bodyCt, ranks, exchange, &c) < 0) {
+            return -1;
+        }
+        if (best < 0 || c.total < cost->total) {
+            *cost = c;
+            best = ranks;
+        }
+    }
+    return best;
+}
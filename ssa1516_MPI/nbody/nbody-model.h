@@ -0,0 +1,49 @@
+/*
+    LogGP cost model of nbody-par.
+
+    nbody-logp measures the parameters on the actual machines:
+    latency L, send and receive overheads os and or and gap g of
+    small messages, gap per byte G of long ones (LogGP), and the time
+    of one pair force of the direct backend on one core. They are
+    kept in $NBODY_LOGP (default ~/.nbody-logp), the last line of:
+
+        host L os or g G pair
+
+    (seconds; G in seconds per byte). A step of the replicating
+    layers is then predicted as its share of the pairs plus the
+    collectives of its exchange, costed as the algorithms MPI usually
+    picks for them (recursive doubling for small payloads, reduce-
+    scatter/allgather rings for large ones). The layers that depend
+    on the node layout or distribute the bodies are not modelled.
+*/
+
+#ifndef NBODY_MODEL_H
+#define NBODY_MODEL_H
+
+#include <stdio.h>
+
+#define MODEL_MAXRANKS  1024    /* largest process count considered */
+
+typedef struct {
+    char host[64];              /* where it was measured */
+    double latency;             /* L */
+    double sendOverhead;        /* os */
+    double recvOverhead;        /* or */
+    double gap;                 /* g */
+    double byteGap;             /* G */
+    double pair;                /* seconds per pair force */
+} logpParams;
+
+typedef struct {
+    double compute;             /* seconds per step */
+    double comm;
+    double total;
+} modelCost;
+
+int logp_load(logpParams *lp);
+int logp_store(const logpParams *lp);
+void logp_describe(const logpParams *lp, FILE *out);
+int model_step(const logpParams *lp, int bodyCt, int ranks, const char *exchange, modelCost *cost);
+int model_best_ranks(const logpParams *lp, int bodyCt, int maxRanks, const char *exchange, modelCost *cost);
+
+#endif
@@ -0,0 +1,1075 @@
+/*
+    MPI decomposition of the N-Body simulation.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include "nbody-mpi.h"
+#include "nbody-orb.h"
+#include "nbody-node.h"
+#include "nbody-threads.h"
+#include "nbody-dump.h"
+
+typedef struct {
+    MPI_Comm comm;
+    int myid;                   /*MPI process ID*/
+    int numprocs;               /*number of MPI processes involeved in the computation*/
+    int *bodies_per_proc;       /*list of the number of bodies assigned per processor*/
+    int *displs_bodies;         /*list of the starting indexes of bodies assigned per processor*/
+    long long *forces_per_proc; /*list of the number of forces assigned per processor*/
+    long long *displs_forces;   /*list of the starting indexes of forces assigned per processor*/
+    MPI_Datatype mpi_force_type;
+    MPI_Datatype mpi_position_type;
+    MPI_Datatype mpi_body_type;
+    MPI_Op mpi_sum;
+    MPI_Win forceWin;           /*forces accumulated into the own bodies (rma), else MPI_WIN_NULL*/
+    forceType *accumulated;     /*its memory*/
+    char *packed;               /*new coordinates of all the processes (--pack), else 0*/
+    int *packBytes;             /*bytes of every process in packed this step*/
+    int *packDispls;            /*room for doubles: 16 bytes per body*/
+    long long wireBytes;        /*position bytes received here so far*/
+    long wireSteps;
+    long fullSteps;             /*steps some process sent doubles despite the tolerance*/
+    MPI_Comm node;              /*processes of this node (hier), else MPI_COMM_NULL*/
+    MPI_Comm leaders;           /*rank 0 of every node (MPI_COMM_NULL on the others)*/
+    int nodes;
+    int *node_bodies;           /*bodies of every node, on the leaders*/
+    int *displs_node;
+    long long interBytes;       /*payload of the leaders' collectives so far*/
+    MPI_Win queueWin;           /*counter of claimed pair blocks, on rank 0 (queue), else MPI_WIN_NULL*/
+    long *queueNext;
+    long queueBase;             /*the counter at the start of this step*/
+    int blocks;                 /*pair blocks per step*/
+    long claimed;               /*blocks computed here so far*/
+    double *stepTimes;          /*seconds of every step, between position exchanges (queue, --stats)*/
+    long stepCt;
+    long stepCap;
+    double lastStep;
+} mpiState;
+
+#define RMA_BLOCK   64          /*bodies per touched block of the rma exchange*/
+#define QUEUE_BLOCKS 8          /*pair blocks per process of the queue exchange*/
+#define SHRINK_STEPS 2          /*steps timed by nbody_mpi_shrink()*/
+#define SHRINK_REPS 5           /*collectives timed per candidate process count*/
+
+#define STATE(sim)  ((mpiState *) (sim)->exchangeState)
+
+
+/**
+     * Function called for the MPI reduce operation
+     *
+     * @param in
+     *            array of forces to sum
+     * @param inout
+     *            array of forces to which sum the 'in' array
+     * @param dtype
+     *            datatype
+*/
+static void
+sumForces(forceType *in, forceType *inout, int *len, MPI_Datatype *dtype) {
+    int i;
+    for (i = 0; i < *len; ++i) {
+        inout->xf += in->xf;
+        inout->yf += in->yf;
+        in++;
+        inout++;
+    }
+}
+
+/*Reduce all the forces calculated by each process*/
+static void
+exchange_forces(nbodySim *sim) {
+    mpiState *st = STATE(sim);
+
+    MPI_Allreduce(MPI_IN_PLACE, sim->forces, sim->bodyCt, st->mpi_force_type, st->mpi_sum, st->comm);
+}
+
+/*Record the time since the last position exchange: every process
+  waits there for the slowest one, so this is the length of the step*/
+static void
+step_time(mpiState *st) {
+    double now = MPI_Wtime();
+
+    if (st->lastStep > 0) {
+        if (st->stepCt == st->stepCap) {
+            double *more = realloc(st->stepTimes, sizeof(double) * (st->stepCap ? 2 * st->stepCap : 1024));
+
+            if (more == 0) {
+                return;
+            }
+            st->stepTimes = more;
+            st->stepCap = st->stepCap ? 2 * st->stepCap : 1024;
+        }
+        st->stepTimes[st->stepCt++] = now - st->lastStep;
+    }
+    st->lastStep = now;
+}
+
+/*Pack the new coordinates of the own bodies into out, as float
+  deltas from the old ones if every one of them comes within the
+  tolerance, else as doubles. With deltas the new coordinates kept
+  here become the ones rebuilt from them, as on the other processes,
+  so that the copies stay the same and the error does not add up.
+  Returns the bytes packed.*/
+static int
+pack_positions(nbodySim *sim, char *out) {
+    double tolerance = sim->p.packTolerance;
+    float *f = (float *) out;
+    double *d = (double *) out;
+    int n = sim->last - sim->first;
+    int b, i;
+
+    if (tolerance > 0) {
+        for (b = sim->first, i = 0; b < sim->last; ++b, i += 2) {
+            f[i] = (float) (XN(b) - X(b));
+            f[i + 1] = (float) (YN(b) - Y(b));
+            if (!(fabs(X(b) + f[i] - XN(b)) <= tolerance && fabs(Y(b) + f[i + 1] - YN(b)) <= tolerance)) {
+                break;
+            }
+        }
+        if (b == sim->last) {
+            for (b = sim->first, i = 0; b < sim->last; ++b, i += 2) {
+                XN(b) = X(b) + f[i];
+                YN(b) = Y(b) + f[i + 1];
+            }
+            return sizeof(float) * 2 * n;
+        }
+    }
+    for (b = sim->first, i = 0; b < sim->last; ++b, i += 2) {
+        d[i] = XN(b);
+        d[i + 1] = YN(b);
+    }
+    return sizeof(double) * 2 * n;
+}
+
+/*Rebuild the new coordinates of the bodies [lo, hi) from their
+  packed bytes*/
+static void
+unpack_positions(nbodySim *sim, const char *in, int bytes, int lo, int hi) {
+    const float *f = (const float *) in;
+    const double *d = (const double *) in;
+    int b, i;
+
+    if (bytes == (int) sizeof(float) * 2 * (hi - lo)) {
+        for (b = lo, i = 0; b < hi; ++b, i += 2) {
+            XN(b) = X(b) + f[i];
+            YN(b) = Y(b) + f[i + 1];
+        }
+    } else {
+        for (b = lo, i = 0; b < hi; ++b, i += 2) {
+            XN(b) = d[i];
+            YN(b) = d[i + 1];
+        }
+    }
+}
+
+/*--pack: only the new coordinates go round, the old ones are the
+  same everywhere already; with a tolerance every process first
+  tells how many bytes it sends*/
+static void
+exchange_packed(nbodySim *sim) {
+    mpiState *st = STATE(sim);
+    int q, full = 0;
+
+    st->packBytes[st->myid] = pack_positions(sim, st->packed + st->packDispls[st->myid]);
+    if (sim->p.packTolerance > 0) {
+        MPI_Allgather(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, st->packBytes, 1, MPI_INT, st->comm);
+        st->wireBytes += sizeof(int) * (st->numprocs - 1);
+    }
+    MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, st->packed, st->packBytes, st->packDispls, MPI_BYTE, st->comm);
+    for (q = 0; q < st->numprocs; ++q) {
+        full |= (st->bodies_per_proc[q] > 0 &&
+                 st->packBytes[q] == (int) sizeof(double) * 2 * st->bodies_per_proc[q]);
+        if (q != st->myid) {
+            unpack_positions(sim, st->packed + st->packDispls[q], st->packBytes[q],
+                             st->displs_bodies[q], st->displs_bodies[q] + st->bodies_per_proc[q]);
+            st->wireBytes += st->packBytes[q];
+        }
+    }
+    st->fullSteps += full;
+}
+
+/*gather the updated positions from all the nodes to all the nodes */
+static void
+exchange_positions(nbodySim *sim) {
+    mpiState *st = STATE(sim);
+
+    ++st->wireSteps;
+    if (st->packed) {
+        exchange_packed(sim);
+    } else {
+        MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, sim->positions, st->bodies_per_proc, st->displs_bodies, st->mpi_position_type, st->comm);
+        st->wireBytes += (long long) sizeof(bodyPositionType) * (sim->bodyCt - st->bodies_per_proc[st->myid]);
+    }
+    if (st->queueWin != MPI_WIN_NULL || sim->p.stats) {
+        step_time(st);
+    }
+}
+
+static void
+exchange_reduce(nbodySim *sim, double *v, int n) {
+    mpiState *st = STATE(sim);
+
+    MPI_Reduce(st->myid == 0 ? MPI_IN_PLACE : v, v, n, MPI_DOUBLE, MPI_SUM, 0, st->comm);
+}
+
+static void
+exchange_free(nbodySim *sim) {
+    mpiState *st = STATE(sim);
+
+    MPI_Type_free(&st->mpi_force_type);
+    MPI_Type_free(&st->mpi_position_type);
+    MPI_Type_free(&st->mpi_body_type);
+    MPI_Op_free(&st->mpi_sum);
+    if (st->forceWin != MPI_WIN_NULL) {
+        MPI_Win_free(&st->forceWin);
+    }
+    if (st->queueWin != MPI_WIN_NULL) {
+        MPI_Win_unlock_all(st->queueWin);
+        MPI_Win_free(&st->queueWin);
+    }
+    if (st->node != MPI_COMM_NULL) {
+        if (st->leaders != MPI_COMM_NULL) {
+            MPI_Comm_free(&st->leaders);
+        }
+        MPI_Comm_free(&st->node);
+        /*the node-ordered copy of the caller's communicator*/
+        MPI_Comm_free(&st->comm);
+    }
+    free(st->bodies_per_proc);
+    free(st->displs_bodies);
+    free(st->forces_per_proc);
+    free(st->displs_forces);
+    free(st->packed);
+    free(st->packBytes);
+    free(st->packDispls);
+    free(st->node_bodies);
+    free(st->displs_node);
+    free(st->stepTimes);
+    free(st);
+}
+
+static int
+compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+/*Step time percentiles (queue, --stats) and position bytes received
+  by this process (--pack, --stats)*/
+static void
+exchange_report(nbodySim *sim, FILE *out) {
+    mpiState *st = STATE(sim);
+    int remote = sim->bodyCt - st->bodies_per_proc[st->myid];
+
+    if (st->stepCt > 0) {
+        qsort(st->stepTimes, st->stepCt, sizeof(double), compare_doubles);
+        fprintf(out, "Step time: median %.3f ms, p99 %.3f ms, max %.3f ms\n",
+                1e3 * st->stepTimes[st->stepCt / 2], 1e3 * st->stepTimes[st->stepCt * 99 / 100],
+                1e3 * st->stepTimes[st->stepCt - 1]);
+    }
+    if (st->queueWin != MPI_WIN_NULL && sim->step > 0) {
+        fprintf(out, "Work queue: %d blocks per step, %.2f computed by process %d\n",
+                st->blocks, (double) st->claimed / sim->step, st->myid);
+    }
+    if (st->wireSteps == 0 || remote == 0 || !(st->packed || sim->p.stats)) {
+        return;
+    }
+    fprintf(out, "Position exchange: %.0f bytes per step into process %d, %.2f per remote body\n",
+            (double) st->wireBytes / st->wireSteps, st->myid,
+            (double) st->wireBytes / st->wireSteps / remote);
+    if (st->packed && sim->p.packTolerance > 0) {
+        fprintf(out, "Position exchange: float deltas within %g pixels, doubles in %ld of %ld steps\n",
+                sim->p.packTolerance, st->fullSteps, st->wireSteps);
+    }
+}
+
+/*gather the bodies of all the nodes to all the nodes */
+static void
+exchange_bodies(nbodySim *sim) {
+    mpiState *st = STATE(sim);
+
+    MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, sim->bodies, st->bodies_per_proc, st->displs_bodies, st->mpi_body_type, st->comm);
+}
+
+static void
+exchange_alltoall(nbodySim *sim, const void *send, const int *sendBytes,
+                  void *recv, const int *recvBytes) {
+    mpiState *st = STATE(sim);
+    int *sdispls = malloc(sizeof(int) * st->numprocs);
+    int *rdispls = malloc(sizeof(int) * st->numprocs);
+    int i;
+
+    sdispls[0] = rdispls[0] = 0;
+    for (i = 1; i < st->numprocs; ++i) {
+        sdispls[i] = sdispls[i - 1] + sendBytes[i - 1];
+        rdispls[i] = rdispls[i - 1] + recvBytes[i - 1];
+    }
+    MPI_Alltoallv(send, sendBytes, sdispls, MPI_BYTE, recv, recvBytes, rdispls, MPI_BYTE, st->comm);
+    free(sdispls);
+    free(rdispls);
+}
+
+static const nbodyExchange mpi_exchange = {
+    "allreduce", exchange_forces, exchange_positions, exchange_reduce, exchange_free, exchange_bodies,
+    0, 0, exchange_alltoall, exchange_report
+};
+
+/*Add the partial forces of bodies [lo, hi) to the window of their owner q*/
+static void
+accumulate(nbodySim *sim, int q, int lo, int hi) {
+    mpiState *st = STATE(sim);
+
+    MPI_Accumulate(sim->forces + lo, 2 * (hi - lo), MPI_DOUBLE, q, 2 * (lo - st->displs_bodies[q]),
+                   2 * (hi - lo), MPI_DOUBLE, MPI_SUM, st->forceWin);
+}
+
+/*Accumulate the partial forces of every block of bodies touched
+  here into the force window of the owner of the block, then add up
+  what was accumulated into the own bodies*/
+static void
+exchange_accumulate(nbodySim *sim) {
+    mpiState *st = STATE(sim);
+    int q, b, c;
+
+    MPI_Win_fence(MPI_MODE_NOPRECEDE, st->forceWin);
+    for (q = 0; q < st->numprocs; ++q) {
+        int lo = st->displs_bodies[q];
+        int hi = lo + st->bodies_per_proc[q];
+        int run = -1;
+
+        if (q == st->myid) {
+            continue;
+        }
+        /*one accumulate for every run of touched blocks*/
+        for (b = lo; b < hi; b += RMA_BLOCK) {
+            int end = (b + RMA_BLOCK < hi) ? b + RMA_BLOCK : hi;
+            int touched = 0;
+
+            for (c = b; c < end && !touched; ++c) {
+                touched = (XF(c) != 0 || YF(c) != 0);
+            }
+            if (touched && run < 0) {
+                run = b;
+            } else if (!touched && run >= 0) {
+                accumulate(sim, q, run, b);
+                run = -1;
+            }
+        }
+        if (run >= 0) {
+            accumulate(sim, q, run, hi);
+        }
+    }
+    MPI_Win_fence(MPI_MODE_NOSUCCEED, st->forceWin);
+
+    for (b = sim->first; b < sim->last; ++b) {
+        XF(b) += st->accumulated[b - sim->first].xf;
+        YF(b) += st->accumulated[b - sim->first].yf;
+    }
+    memset(st->accumulated, 0, sizeof(forceType) * (sim->last - sim->first));
+}
+
+/*  One-sided: the partial forces go only to the owners of the bodies
+    they touch, with MPI_Accumulate
+*/
+static const nbodyExchange rma_exchange = {
+    "rma", exchange_accumulate, exchange_positions, exchange_reduce, exchange_free, exchange_bodies,
+    0, 0, 0, exchange_report
+};
+
+/*Claim pair blocks of this step from the counter on rank 0 until
+  there are none left, computing each as it comes. Every process
+  makes one claim too many per step, so the counter of the next
+  step starts blocks + numprocs further on*/
+static int
+queue_schedule(nbodySim *sim) {
+    mpiState *st = STATE(sim);
+    long long pairs = nbody_pair_count(sim->bodyCt);
+    long one = 1, claim, block;
+    int ok = 1;
+
+    for (;;) {
+        MPI_Fetch_and_op(&one, &claim, MPI_LONG, 0, 0, MPI_SUM, st->queueWin);
+        MPI_Win_flush(0, st->queueWin);
+        block = claim - st->queueBase;
+        if (block >= st->blocks) {
+            break;
+        }
+        nbody_set_pairs(sim, pairs * block / st->blocks, pairs * (block + 1) / st->blocks);
+        /* claim on after a failure, the counter is shared */
+        ok = (sim->forcer->compute(sim) == 0) && ok;
+        ++st->claimed;
+    }
+    st->queueBase += st->blocks + st->numprocs;
+    return ok ? 0 : -1;
+}
+
+/*  Work queue: the pair triangle over-decomposed into blocks that
+    the processes claim as they get done, then reduced as allreduce
+*/
+static const nbodyExchange queue_exchange = {
+    "queue", exchange_forces, exchange_positions, exchange_reduce, exchange_free, exchange_bodies,
+    0, 0, exchange_alltoall, exchange_report, queue_schedule
+};
+
+/*  Owner-computes: every process computes the whole force on its
+    bodies, twice the pair work for no force reduction
+*/
+static const nbodyExchange owner_exchange = {
+    "owner", 0, exchange_positions, exchange_reduce, exchange_free, exchange_bodies,
+    0, 0, 0, exchange_report
+};
+
+/*Sum the forces in the node, then between the node leaders, and
+  broadcast the sum back in the node*/
+static void
+hier_forces(nbodySim *sim) {
+    mpiState *st = STATE(sim);
+    int leader = (st->leaders != MPI_COMM_NULL);
+
+    MPI_Reduce(leader ? MPI_IN_PLACE : sim->forces, sim->forces, 2 * sim->bodyCt, MPI_DOUBLE, MPI_SUM, 0, st->node);
+    if (leader) {
+        MPI_Allreduce(MPI_IN_PLACE, sim->forces, 2 * sim->bodyCt, MPI_DOUBLE, MPI_SUM, st->leaders);
+        st->interBytes += (st->nodes > 1) ? sizeof(forceType) * sim->bodyCt : 0;
+    }
+    MPI_Bcast(sim->forces, 2 * sim->bodyCt, MPI_DOUBLE, 0, st->node);
+}
+
+/*Gather the new positions of the node on its leader, exchange the
+  node blocks between the leaders and broadcast them all in the node*/
+static void
+hier_positions(nbodySim *sim) {
+    mpiState *st = STATE(sim);
+    int k, first;
+
+    /*the processes of the node are consecutive in st->comm*/
+    MPI_Comm_rank(st->node, &k);
+    first = st->myid - k;
+    MPI_Gatherv(k == 0 ? MPI_IN_PLACE : sim->positions + sim->first, sim->last - sim->first, st->mpi_position_type,
+                sim->positions, st->bodies_per_proc + first, st->displs_bodies + first, st->mpi_position_type,
+                0, st->node);
+    if (k == 0) {
+        MPI_Comm_rank(st->leaders, &k);
+        MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, sim->positions, st->node_bodies, st->displs_node,
+                       st->mpi_position_type, st->leaders);
+        st->interBytes += (long long) sizeof(bodyPositionType) * (sim->bodyCt - st->node_bodies[k]);
+    }
+    MPI_Bcast(sim->positions, sim->bodyCt, st->mpi_position_type, 0, st->node);
+}
+
+/*Inter-node payload of the leader of node 0, and that of the flat
+  collectives from the processes of the node*/
+static void
+hier_report(nbodySim *sim, FILE *out) {
+    mpiState *st = STATE(sim);
+    int size, q;
+    double flat = 0;
+
+    if (sim->step == 0) {
+        return;
+    }
+    MPI_Comm_size(st->node, &size);
+    for (q = 0; q < size; ++q) {
+        flat += sizeof(forceType) * (double) sim->bodyCt +
+                sizeof(bodyPositionType) * (double) (sim->bodyCt - st->bodies_per_proc[q]);
+    }
+    fprintf(out, "Inter-node payload: %.0f bytes per step from node 0 of %d (flat collectives: %.0f)\n",
+            (double) st->interBytes / sim->step, st->nodes, flat);
+}
+
+/*  Hierarchical: the collectives of allreduce in two levels, within
+    the nodes (MPI_Comm_split_type) and between one leader per node
+*/
+static const nbodyExchange hier_exchange = {
+    "hier", hier_forces, hier_positions, exchange_reduce, exchange_free, exchange_bodies,
+    0, 0, exchange_alltoall, hier_report
+};
+
+static const nbodyExchange *exchanges[] = {
+    &mpi_exchange, &owner_exchange, &rma_exchange, &queue_exchange, &hier_exchange, &node_exchange, &orb_exchange, 0
+};
+
+static const nbodyExchange *
+find_exchange(const char *name) {
+    int i;
+
+    for (i = 0; exchanges[i]; ++i) {
+        if (name == 0 || strcmp(exchanges[i]->name, name) == 0) {
+            return exchanges[i];
+        }
+    }
+    return 0;
+}
+
+/*  Names of the parallel layers for any force backend (the
+    distributed ones need a tree or cell backend), 0-terminated
+*/
+const char *const *
+nbody_mpi_exchanges(void) {
+    static const char *names[sizeof(exchanges) / sizeof(exchanges[0])];
+    int i, n = 0;
+
+    for (i = 0; exchanges[i]; ++i) {
+        if (exchanges[i]->essential == 0) {
+            names[n++] = exchanges[i]->name;
+        }
+    }
+    return names;
+}
+
+/*  Whether every process holds all the positions after a step */
+int
+nbody_mpi_replicated(const nbodySim *sim) {
+    return sim->exchange->essential == 0;
+}
+
+
+static void
+create_types(mpiState *st) {
+    /*custom MPI dataType for the Forces distribution*/
+    int blocklengths[2] = {1, 1};
+    MPI_Datatype types[2] = {MPI_DOUBLE, MPI_DOUBLE};
+    MPI_Aint     offsets[2];
+
+    offsets[0] = offsetof(forceType, xf);
+    offsets[1] = offsetof(forceType, yf);
+
+    MPI_Type_create_struct(2, blocklengths, offsets, types, &st->mpi_force_type);
+    MPI_Type_commit(&st->mpi_force_type);
+
+    /*custom MPI dataType for the Positions distribution*/
+    int blocklengths2[2] = {2, 2};
+    MPI_Datatype types2[2] = {MPI_DOUBLE, MPI_DOUBLE};
+    MPI_Aint     offsets2[2];
+
+    offsets2[0] = offsetof(bodyPositionType, x);
+    offsets2[1] = offsetof(bodyPositionType, y);
+
+    MPI_Type_create_struct(2, blocklengths2, offsets2, types2, &st->mpi_position_type);
+    MPI_Type_commit(&st->mpi_position_type);
+
+    /*custom MPI dataType for the Bodies distribution*/
+    int blocklengths3[4] = {1, 1, 1, 1};
+    MPI_Datatype types3[4] = {MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE,};
+    MPI_Aint     offsets3[4];
+
+    offsets3[0] = offsetof(bodyType, xv);
+    offsets3[1] = offsetof(bodyType, yv);
+    offsets3[2] = offsetof(bodyType, mass);
+    offsets3[3] = offsetof(bodyType, radius);
+
+    MPI_Type_create_struct(4, blocklengths3, offsets3, types3, &st->mpi_body_type);
+    MPI_Type_commit(&st->mpi_body_type);
+
+    /*custom MPI reduce operation*/
+    MPI_Op_create((MPI_User_function *) sumForces, 1, &st->mpi_sum);
+}
+
+/*Find the nodes, and renumber the processes of comm node by node
+  into st->comm: node 0 first, which holds rank 0 of comm*/
+static void
+node_order(mpiState *st, MPI_Comm comm) {
+    MPI_Comm node;
+    int myid, numprocs, nodeRank, k = 0;
+
+    MPI_Comm_rank(comm, &myid);
+    MPI_Comm_size(comm, &numprocs);
+    MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, myid, MPI_INFO_NULL, &node);
+    MPI_Comm_rank(node, &nodeRank);
+    MPI_Comm_split(comm, nodeRank == 0 ? 0 : MPI_UNDEFINED, myid, &st->leaders);
+    if (st->leaders != MPI_COMM_NULL) {
+        MPI_Comm_rank(st->leaders, &k);
+        MPI_Comm_size(st->leaders, &st->nodes);
+    }
+    MPI_Bcast(&k, 1, MPI_INT, 0, node);
+    MPI_Bcast(&st->nodes, 1, MPI_INT, 0, node);
+    MPI_Comm_free(&node);
+
+    MPI_Comm_split(comm, 0, k * numprocs + nodeRank, &st->comm);
+    MPI_Comm_split_type(st->comm, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &st->node);
+}
+
+/*Bodies of every node, for the leaders*/
+static void
+node_partition(mpiState *st) {
+    int size, k = 0, q;
+
+    st->node_bodies = malloc(sizeof(int) * st->nodes);
+    st->displs_node = malloc(sizeof(int) * st->nodes);
+    if (st->leaders == MPI_COMM_NULL) {
+        return;
+    }
+    MPI_Comm_size(st->node, &size);
+    for (q = st->myid; q < st->myid + size; ++q) {
+        k += st->bodies_per_proc[q];
+    }
+    MPI_Allgather(&k, 1, MPI_INT, st->node_bodies, 1, MPI_INT, st->leaders);
+    for (k = 0, q = 0; q < st->nodes; ++q) {
+        st->displs_node[q] = k;
+        k += st->node_bodies[q];
+    }
+}
+
+static void
+partition(mpiState *st, int bodyCt) {
+    int i;
+
+    /*calculate the forces to assign to each process and the displacements*/
+    long long forceCt = nbody_pair_count(bodyCt);
+    long long avarage_forces_per_proc = forceCt / st->numprocs;
+    long long rem = forceCt % st->numprocs;
+    long long sum = 0;
+
+    for (i = 0; i < st->numprocs; i++) {
+        st->forces_per_proc[i] = avarage_forces_per_proc;
+        if (rem > 0) {
+            st->forces_per_proc[i]++;
+            rem--;
+        }
+        st->displs_forces[i] = sum;
+        sum += st->forces_per_proc[i];
+    }
+
+    /*calculate the bodies to assign to each process and the displacements*/
+    int avarage_bodies_per_proc = bodyCt / st->numprocs;
+    rem = bodyCt % st->numprocs;
+    sum = 0;
+
+    for (i = 0; i < st->numprocs; i++) {
+        st->bodies_per_proc[i] = avarage_bodies_per_proc;
+        if (rem > 0) {
+            st->bodies_per_proc[i]++;
+            rem--;
+        }
+        st->displs_bodies[i] = sum;
+        sum += st->bodies_per_proc[i];
+    }
+}
+
+/*  Create the share of a simulation of this process; collective
+    over comm. Returns 0 on every process if any of them failed.
+*/
+nbodySim *
+nbody_mpi_create(const nbodyParams *p, MPI_Comm comm) {
+    const nbodyExchange *exchange = find_exchange(p->exchange);
+    const nbodyForces *forcer = p->forces ? p->forces : &nbody_direct;
+    nbodySim *sim;
+    mpiState *st;
+    int ok;
+
+    if (exchange == 0 || p->stateFile || (exchange == &owner_exchange && !forcer->owner) ||
+        (exchange == &queue_exchange && forcer->approximate)) {
+        /* the same on every process */
+        MPI_Comm_rank(comm, &ok);
+        if (ok == 0 && exchange == 0) {
+            fprintf(stderr, "Unknown exchange '%s'\n", p->exchange);
+        } else if (ok == 0 && p->stateFile) {
+            fprintf(stderr, "Out-of-core state is for single-process runs\n");
+        } else if (ok == 0 && exchange == &queue_exchange) {
+            fprintf(stderr, "The %s backend does not split the pairs\n", forcer->name);
+        } else if (ok == 0) {
+            fprintf(stderr, "The %s backend cannot compute whole forces per owner\n", forcer->name);
+        }
+        return 0;
+    }
+    if (p->pack && (exchange == &hier_exchange || exchange == &orb_exchange || exchange == &node_exchange)) {
+        MPI_Comm_rank(comm, &ok);
+        if (ok == 0) {
+            fprintf(stderr, "--pack is for the allreduce, owner and rma exchanges\n");
+        }
+        return 0;
+    }
+    if (exchange == &orb_exchange) {
+        return orb_create(p, comm);
+    }
+    if (exchange == &node_exchange) {
+        return node_create(p, comm);
+    }
+    sim = nbody_alloc(p);
+    st = calloc(1, sizeof(mpiState));
+    ok = (sim != 0 && st != 0);
+
+    MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_MIN, comm);
+    if (!ok) {
+        nbody_destroy(sim);
+        free(st);
+        return 0;
+    }
+
+    st->comm = comm;
+    st->node = st->leaders = MPI_COMM_NULL;
+    if (exchange == &hier_exchange) {
+        node_order(st, comm);
+        comm = st->comm;
+    }
+    MPI_Comm_size(comm, &st->numprocs);
+    MPI_Comm_rank(comm, &st->myid);
+    st->bodies_per_proc = malloc(sizeof(int) * st->numprocs);
+    st->displs_bodies = malloc(sizeof(int) * st->numprocs);
+    st->forces_per_proc = malloc(sizeof(long long) * st->numprocs);
+    st->displs_forces = malloc(sizeof(long long) * st->numprocs);
+    create_types(st);
+    partition(st, sim->bodyCt);
+    if (st->node != MPI_COMM_NULL) {
+        node_partition(st);
+    }
+
+    sim->exchange = exchange;
+    sim->exchangeState = st;
+    sim->rank = st->myid;
+    sim->ranks = st->numprocs;
+    sim->owner = (exchange == &owner_exchange);
+    st->forceWin = st->queueWin = MPI_WIN_NULL;
+    if (exchange == &rma_exchange) {
+        MPI_Win_allocate(sizeof(forceType) * st->bodies_per_proc[st->myid], sizeof(double), MPI_INFO_NULL,
+                         comm, &st->accumulated, &st->forceWin);
+        memset(st->accumulated, 0, sizeof(forceType) * st->bodies_per_proc[st->myid]);
+    }
+    if (exchange == &queue_exchange) {
+        st->blocks = (p->queueBlocks > 0 ? p->queueBlocks : QUEUE_BLOCKS) * st->numprocs;
+        MPI_Win_allocate(st->myid == 0 ? sizeof(long) : 0, sizeof(long), MPI_INFO_NULL, comm,
+                         &st->queueNext, &st->queueWin);
+        if (st->myid == 0) {
+            *st->queueNext = 0;
+        }
+        MPI_Win_lock_all(0, st->queueWin);
+        MPI_Win_sync(st->queueWin);
+        MPI_Barrier(comm);
+    }
+    if (p->pack) {
+        int q;
+
+        st->packed = malloc(sizeof(double) * 2 * sim->bodyCt);
+        st->packBytes = malloc(sizeof(int) * st->numprocs);
+        st->packDispls = malloc(sizeof(int) * st->numprocs);
+        for (q = 0; q < st->numprocs; ++q) {
+            st->packBytes[q] = sizeof(double) * 2 * st->bodies_per_proc[q];
+            st->packDispls[q] = sizeof(double) * 2 * st->displs_bodies[q];
+        }
+    }
+    sim->first = st->displs_bodies[st->myid];
+    sim->last = sim->first + st->bodies_per_proc[st->myid];
+    nbody_set_pairs(sim, st->displs_forces[st->myid],
+                    st->displs_forces[st->myid] + st->forces_per_proc[st->myid]);
+
+    /* Initialize simulation data */
+    if (p->init == INIT_RANDOM) {
+        /*rand() is a serial stream: the master generates all the bodies*/
+        if (st->myid == 0) {
+            ok = (nbody_init_range(sim, 0, sim->bodyCt) == 0);
+        }
+        MPI_Bcast(&ok, 1, MPI_INT, 0, comm);
+        if (ok) {
+            /*broadcast the bodies and the positions to all the processes*/
+            MPI_Bcast(sim->bodies, sim->bodyCt, st->mpi_body_type, 0, comm);
+            MPI_Bcast(sim->positions, sim->bodyCt, st->mpi_position_type, 0, comm);
+        }
+    } else if (p->init != INIT_FILE) {
+        /*counter-based generators: every process produces all the
+          bodies itself, without any traffic*/
+        ok = (nbody_init_range(sim, 0, sim->bodyCt) == 0);
+        MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_MIN, comm);
+    } else {
+        /*state files: every process reads its own chunk of bodies,
+          then they are exchanged as after a step*/
+        ok = (nbody_init_range(sim, sim->first, sim->last) == 0);
+        MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_MIN, comm);
+        if (ok) {
+            MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, sim->bodies, st->bodies_per_proc, st->displs_bodies, st->mpi_body_type, comm);
+            MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, sim->positions, st->bodies_per_proc, st->displs_bodies, st->mpi_position_type, comm);
+        }
+    }
+    if (!ok) {
+        nbody_destroy(sim);
+        return 0;
+    }
+    return sim;
+}
+
+/*gather the updated bodies (and forces, unless allreduced) from all the nodes to the master */
+void
+nbody_mpi_gather(nbodySim *sim) {
+    mpiState *st = STATE(sim);
+
+    if (sim->exchange == &orb_exchange) {
+        orb_gather(sim);
+        return;
+    }
+    if (sim->exchange == &node_exchange) {
+        node_gather(sim);
+        return;
+    }
+    MPI_Gatherv(st->myid == 0 ? MPI_IN_PLACE : sim->bodies + sim->first, st->bodies_per_proc[st->myid], st->mpi_body_type, sim->bodies, st->bodies_per_proc, st->displs_bodies, st->mpi_body_type, 0, st->comm);
+    if (sim->exchange == &owner_exchange || sim->exchange == &rma_exchange) {
+        /*the forces were only summed on their owners*/
+        MPI_Gatherv(st->myid == 0 ? MPI_IN_PLACE : sim->forces + sim->first, st->bodies_per_proc[st->myid], st->mpi_force_type, sim->forces, st->bodies_per_proc, st->displs_bodies, st->mpi_force_type, 0, st->comm);
+    }
+}
+
+/*  nbody_mpi_dump() through the master */
+static int
+dump_master(nbodySim *sim, const char *path, int binary) {
+    nbody_mpi_gather(sim);
+    return (sim->rank == 0) ? dump_write(sim, path, binary) : 0;
+}
+
+/*  Write the bodies to path as nbody_print() (binary: a state file
+    of nbody-init.h); collective. Every process formats its own slice
+    and writes it with one collective MPI-IO call, through a file view
+    of the runs of consecutive original indices; the distributed
+    layers, and text whose values overflow their columns, go through
+    the master. 0, or -1 on failure (only on the master when it wrote
+    the file alone).
+*/
+int
+nbody_mpi_dump(nbodySim *sim, const char *path, int binary) {
+    mpiState *st;
+    int record = binary ? (int) sizeof(initBodyType) : DUMP_LINE;
+    MPI_Offset header = binary ? DUMP_HEADER : 0;
+    int *slot, *lengths;
+    MPI_Aint *offsets;
+    MPI_Datatype view;
+    MPI_File fh;
+    char *buf;
+    int lo, hi, i, k = 0, runs = 0, ok, written;
+
+    if (sim->exchange == &orb_exchange || sim->exchange == &node_exchange) {
+        return dump_master(sim, path, binary);
+    }
+    st = STATE(sim);
+    lo = st->displs_bodies[st->myid];
+    hi = lo + st->bodies_per_proc[st->myid];
+    slot = dump_slots(sim);
+    /* a line that overflows its columns ends the text, so only the last one can be longer */
+    buf = malloc((size_t) (hi - lo) * record + (binary ? 0 : DUMP_LINE_MAX - DUMP_LINE));
+    lengths = malloc(sizeof(int) * (hi - lo + 1));
+    offsets = malloc(sizeof(MPI_Aint) * (hi - lo + 1));
+    ok = (buf && lengths && offsets && (sim->ids == 0 || slot) &&
+          (long long) (hi - lo) * record <= 0x7fffffff);
+
+    /* the own bodies by original index, each run of them one block */
+    for (i = 0; ok && i < sim->bodyCt; ++i) {
+        int b = slot ? slot[i] : i;
+
+        if (b < lo || b >= hi) {
+            continue;
+        }
+        if (binary) {
+            dump_body(sim, b, (initBodyType *) (buf + (size_t) k * record));
+        } else if (dump_line(sim, b, buf + (size_t) k * record) != DUMP_LINE) {
+            ok = 0;
+        }
+        if (runs > 0 && offsets[runs - 1] + lengths[runs - 1] == header + (MPI_Offset) i * record) {
+            lengths[runs - 1] += record;
+        } else {
+            offsets[runs] = header + (MPI_Aint) i * record;
+            lengths[runs++] = record;
+        }
+        ++k;
+    }
+    free(slot);
+    MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_MIN, st->comm);
+    if (!ok) {
+        free(buf);
+        free(lengths);
+        free(offsets);
+        return dump_master(sim, path, binary);
+    }
+
+    ok = (MPI_File_open(st->comm, (char *) path, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                        MPI_INFO_NULL, &fh) == MPI_SUCCESS);
+    if (ok) {
+        MPI_Type_create_hindexed(runs, lengths, offsets, MPI_BYTE, &view);
+        MPI_Type_commit(&view);
+        ok = (MPI_File_set_size(fh, header + (MPI_Offset) sim->bodyCt * record) == MPI_SUCCESS);
+        if (binary && st->myid == 0) {
+            unsigned long long count = sim->bodyCt;
+            char head[DUMP_HEADER];
+
+            memcpy(head, INIT_FILE_MAGIC, 8);
+            memcpy(head + 8, &count, 8);
+            ok = ok && MPI_File_write_at(fh, 0, head, DUMP_HEADER, MPI_BYTE, MPI_STATUS_IGNORE) == MPI_SUCCESS;
+        }
+        written = (MPI_File_set_view(fh, 0, MPI_BYTE, view, "native", MPI_INFO_NULL) == MPI_SUCCESS &&
+                   MPI_File_write_all(fh, buf, k * record, MPI_BYTE, MPI_STATUS_IGNORE) == MPI_SUCCESS);
+        ok = (MPI_File_close(&fh) == MPI_SUCCESS) && written && ok;
+        MPI_Type_free(&view);
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_MIN, st->comm);
+    free(buf);
+    free(lengths);
+    free(offsets);
+    return ok ? 0 : -1;
+}
+
+/*  Calibration timer of nbody_mpi_tune() */
+static double
+time_mpi(const nbodyParams *p, int steps, void *arg) {
+    MPI_Comm comm = *(MPI_Comm *) arg;
+    nbodySim *sim = nbody_mpi_create(p, comm);
+    double start, secs;
+    int ok;
+
+    if (sim == 0) {
+        return -1;
+    }
+    ok = (nbody_step(sim, 1) == 0);
+    MPI_Barrier(comm);
+    start = MPI_Wtime();
+    ok = (nbody_step(sim, steps) == 0) && ok;
+    secs = MPI_Wtime() - start;
+    MPI_Allreduce(MPI_IN_PLACE, &secs, 1, MPI_DOUBLE, MPI_MAX, comm);
+    MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_MIN, comm);
+    nbody_destroy(sim);
+    return ok ? secs : -1;
+}
+
+/*  Tune p for a run over comm; collective. The master owns the cache
+    and the log. 1 if choice was applied to p, 0 if p was left alone,
+    -1 on failure.
+*/
+int
+nbody_mpi_tune(nbodyParams *p, MPI_Comm comm, tuneMode mode,
+               tuneChoice *choice, FILE *log) {
+    MPI_Comm node;
+    tuneKey key;
+    int myid, found = 0;
+
+    if (mode == TUNE_OFF || (mode == TUNE_AUTO && tune_fixed(p))) {
+        return 0;
+    }
+    MPI_Comm_rank(comm, &myid);
+    MPI_Comm_size(comm, &key.ranks);
+    MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node);
+    MPI_Comm_size(node, &key.ranksPerNode);
+    MPI_Comm_free(&node);
+    MPI_Allreduce(MPI_IN_PLACE, &key.ranksPerNode, 1, MPI_INT, MPI_MAX, comm);
+    key.program = "par";
+    key.bodyCt = p->bodyCt;
+    key.cores = nbody_cores();
+    MPI_Bcast(&key.cores, 1, MPI_INT, 0, comm);
+
+    if (mode == TUNE_AUTO) {
+        if (myid == 0) {
+            found = (tune_lookup(&key, choice) == 0);
+        }
+        MPI_Bcast(&found, 1, MPI_INT, 0, comm);
+        if (!found) {
+            return 0;
+        }
+        MPI_Bcast(choice, sizeof(tuneChoice), MPI_BYTE, 0, comm);
+        if (myid == 0) {
+            fprintf(log, "Tuned settings from cache: ");
+        }
+    } else {
+        if (tune_run(&key, p, nbody_mpi_exchanges(), time_mpi, &comm,
+                     choice, myid == 0 ? log : 0) < 0) {
+            return -1;
+        }
+        if (myid == 0 && !tune_fixed(p)) {
+            tune_store(&key, choice);
+        }
+        if (myid == 0) {
+            fprintf(log, "Tuned settings: ");
+        }
+    }
+    if (myid == 0) {
+        tune_describe(choice, log);
+    }
+    tune_apply(choice, p);
+    return 1;
+}
+
+/*  Seconds of the collectives of one step over the first 'ranks'
+    processes of comm: the force reduction (none for owner) and the
+    position exchange of bodyCt bodies; collective over comm, the
+    result on its process 0
+*/
+static double
+time_collectives(const nbodyParams *p, MPI_Comm comm, int ranks) {
+    int owner = (p->exchange && strcmp(p->exchange, "owner") == 0);
+    int myid, share, i;
+    double *forces, start, secs = 0;
+    char *positions;
+    MPI_Comm sub;
+
+    MPI_Comm_rank(comm, &myid);
+    MPI_Comm_split(comm, myid < ranks ? 0 : MPI_UNDEFINED, myid, &sub);
+    if (sub == MPI_COMM_NULL) {
+        return 0;
+    }
+    share = sizeof(bodyPositionType) * ((p->bodyCt + ranks - 1) / ranks);
+    forces = calloc(p->bodyCt, sizeof(forceType));
+    positions = calloc(ranks, share);
+    MPI_Barrier(sub);
+    start = MPI_Wtime();
+    for (i = 0; i < SHRINK_REPS; ++i) {
+        if (!owner) {
+            MPI_Allreduce(MPI_IN_PLACE, forces, p->bodyCt * sizeof(forceType) / sizeof(double),
+                          MPI_DOUBLE, MPI_SUM, sub);
+        }
+        MPI_Allgather(MPI_IN_PLACE, share, MPI_BYTE, positions, share, MPI_BYTE, sub);
+    }
+    secs = (MPI_Wtime() - start) / SHRINK_REPS;
+    MPI_Allreduce(MPI_IN_PLACE, &secs, 1, MPI_DOUBLE, MPI_MAX, sub);
+    MPI_Comm_free(&sub);
+    free(forces);
+    free(positions);
+    return secs;
+}
+
+/*  Process counts tried by nbody_mpi_shrink(): 1, 2, 4, ... and all */
+static int
+next_count(int ranks, int procs) {
+    return (ranks < procs && 2 * ranks > procs) ? procs : 2 * ranks;
+}
+
+/*  The communicator of the first processes of comm that should run
+    p fastest, MPI_COMM_NULL on the others; collective over comm. The
+    force work of a step, timed over all the processes less their
+    collectives, is divided among 1, 2, 4, ... and all of them, and
+    the collectives of each count are timed on it; the master logs
+    the estimates and the choice.
+*/
+MPI_Comm
+nbody_mpi_shrink(const nbodyParams *p, MPI_Comm comm, FILE *log) {
+    double step, work, best = 0, *estimates;
+    int myid, procs, ranks, chosen = 0;
+    MPI_Comm shrunk;
+
+    MPI_Comm_rank(comm, &myid);
+    MPI_Comm_size(comm, &procs);
+    estimates = calloc(procs + 1, sizeof(double));
+    step = time_mpi(p, SHRINK_STEPS, &comm) / SHRINK_STEPS;
+    for (ranks = 1; ranks <= procs; ranks = next_count(ranks, procs)) {
+        estimates[ranks] = ranks > 1 ? time_collectives(p, comm, ranks) : 0;
+    }
+    if (myid == 0) {
+        if (step < 0) {
+            chosen = procs;
+        } else {
+            /* the force work of a step is what the collectives leave */
+            work = (step - estimates[procs]) * procs;
+            work = work > 0 ? work : 0;
+            fprintf(log, "Step estimates:");
+            for (ranks = 1; ranks <= procs; ranks = next_count(ranks, procs)) {
+                estimates[ranks] += work / ranks;
+                fprintf(log, " %d: %.3f ms", ranks, estimates[ranks] * 1e3);
+                if (chosen == 0 || estimates[ranks] < best) {
+                    best = estimates[ranks];
+                    chosen = ranks;
+                }
+            }
+            fprintf(log, "\n");
+        }
+        fprintf(log, "Running on %d of %d processes\n", chosen, procs);
+    }
+    free(estimates);
+    MPI_Bcast(&chosen, 1, MPI_INT, 0, comm);
+    MPI_Comm_split(comm, myid < chosen ? 0 : MPI_UNDEFINED, myid, &shrunk);
+    return shrunk;
+}
@@ -0,0 +1,29 @@
+/*
+    MPI decomposition of the N-Body simulation.
+
+    Every process holds all positions, masses and radii; it computes
+    an equal share of the body pairs and integrates an equal slice of
+    the bodies. Partial forces are summed with MPI_Allreduce and the
+    new positions shared with MPI_Allgatherv. nbodyParams.exchange
+    names the parallel layer (nbody_mpi_exchanges()); "orb" instead
+    distributes the bodies by domain for the tree backend, see
+    nbody-orb.h.
+*/
+
+#ifndef NBODY_MPI_H
+#define NBODY_MPI_H
+
+#include <mpi.h>
+#include "nbody.h"
+#include "nbody-tune.h"
+
+nbodySim *nbody_mpi_create(const nbodyParams *p, MPI_Comm comm);
+void nbody_mpi_gather(nbodySim *sim);
+int nbody_mpi_dump(nbodySim *sim, const char *path, int binary);
+int nbody_mpi_replicated(const nbodySim *sim);
+const char *const *nbody_mpi_exchanges(void);
+MPI_Comm nbody_mpi_shrink(const nbodyParams *p, MPI_Comm comm, FILE *log);
+int nbody_mpi_tune(nbodyParams *p, MPI_Comm comm, tuneMode mode,
+                   tuneChoice *choice, FILE *log);
+
+#endif
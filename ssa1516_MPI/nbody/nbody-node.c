@@ -0,0 +1,325 @@
+/*
+    Node-shared layer of nbody-par (--exchange=shared).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nbody-node.h"
+
+typedef struct {
+    MPI_Comm comm;
+    MPI_Comm node;              /* the processes of this node */
+    MPI_Comm leaders;           /* rank 0 of every node (MPI_COMM_NULL on the others) */
+    int myid;
+    int nodeRank;
+    int nodeSize;
+    int nodes;
+    int nodeIndex;              /* of this node among the leaders */
+    int *counts;                /* bodies of every node, on the leaders */
+    int *displs;
+    MPI_Win positionWin;
+    MPI_Win bodyWin;
+    MPI_Win forceWin;
+    MPI_Win partialWin;
+    forceType *nodeForces;      /* summed forces, shared by the node */
+    forceType **partial;        /* partial forces of every process of the node */
+    MPI_Datatype mpi_position_type;
+    MPI_Datatype mpi_body_type;
+} nodeState;
+
+#define STATE(sim)  ((nodeState *) (sim)->exchangeState)
+
+
+/*  Make the writes of every process of the node to the windows
+    visible to the others
+*/
+static void
+node_sync(nodeState *st) {
+    MPI_Win_sync(st->positionWin);
+    MPI_Win_sync(st->bodyWin);
+    MPI_Win_sync(st->forceWin);
+    MPI_Win_sync(st->partialWin);
+    MPI_Barrier(st->node);
+    MPI_Win_sync(st->positionWin);
+    MPI_Win_sync(st->bodyWin);
+    MPI_Win_sync(st->forceWin);
+    MPI_Win_sync(st->partialWin);
+}
+
+/*  Window of 'bytes' allocated by the node leader; its base on every process */
+static void *
+shared(nodeState *st, size_t bytes, int unit, MPI_Win *win) {
+    MPI_Aint size;
+    void *base;
+
+    MPI_Win_allocate_shared(st->nodeRank == 0 ? bytes : 0, unit, MPI_INFO_NULL, st->node, &base, win);
+    MPI_Win_shared_query(*win, 0, &size, &unit, &base);
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, *win);
+    return base;
+}
+
+/*  Sum the partial forces in the node, every process one block of
+    the bodies over the windows of all of them in rank order, then
+    between the leaders, and take the own slice of the sum
+*/
+static void
+node_forces(nbodySim *sim) {
+    nodeState *st = STATE(sim);
+    int lo = (int) ((long long) sim->bodyCt * st->nodeRank / st->nodeSize);
+    int hi = (int) ((long long) sim->bodyCt * (st->nodeRank + 1) / st->nodeSize);
+    int b, r;
+
+    node_sync(st);
+    memcpy(st->nodeForces + lo, st->partial[0] + lo, sizeof(forceType) * (hi - lo));
+    for (r = 1; r < st->nodeSize; ++r) {
+        const forceType *part = st->partial[r];
+
+        for (b = lo; b < hi; ++b) {
+            st->nodeForces[b].xf += part[b].xf;
+            st->nodeForces[b].yf += part[b].yf;
+        }
+    }
+    if (st->nodes > 1) {
+        node_sync(st);
+        if (st->leaders != MPI_COMM_NULL) {
+            MPI_Allreduce(MPI_IN_PLACE, st->nodeForces, 2 * sim->bodyCt, MPI_DOUBLE, MPI_SUM, st->leaders);
+        }
+    }
+    node_sync(st);
+    memcpy(sim->forces + sim->first, st->nodeForces + sim->first, sizeof(forceType) * (sim->last - sim->first));
+}
+
+/*  The node blocks of positions written in place, exchanged by the leaders */
+static void
+node_positions(nbodySim *sim) {
+    nodeState *st = STATE(sim);
+
+    node_sync(st);
+    if (st->leaders != MPI_COMM_NULL) {
+        MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, sim->positions, st->counts, st->displs,
+                       st->mpi_position_type, st->leaders);
+    }
+    node_sync(st);
+}
+
+static void
+node_reduce(nbodySim *sim, double *v, int n) {
+    nodeState *st = STATE(sim);
+
+    MPI_Reduce(st->myid == 0 ? MPI_IN_PLACE : v, v, n, MPI_DOUBLE, MPI_SUM, 0, st->comm);
+}
+
+static void
+node_free(nbodySim *sim) {
+    nodeState *st = STATE(sim);
+
+    MPI_Win_unlock_all(st->positionWin);
+    MPI_Win_unlock_all(st->bodyWin);
+    MPI_Win_unlock_all(st->forceWin);
+    MPI_Win_unlock_all(st->partialWin);
+    MPI_Win_free(&st->positionWin);
+    MPI_Win_free(&st->bodyWin);
+    MPI_Win_free(&st->forceWin);
+    MPI_Win_free(&st->partialWin);
+    /* not for nbody_destroy() to free */
+    sim->positions = 0;
+    sim->bodies = 0;
+    sim->forces = 0;
+
+    MPI_Type_free(&st->mpi_position_type);
+    MPI_Type_free(&st->mpi_body_type);
+    if (st->leaders != MPI_COMM_NULL) {
+        MPI_Comm_free(&st->leaders);
+    }
+    MPI_Comm_free(&st->node);
+    free(st->counts);
+    free(st->displs);
+    free(st->partial);
+    free(st);
+}
+
+const nbodyExchange node_exchange = {
+    "shared", node_forces, node_positions, node_reduce, node_free
+};
+
+
+static MPI_Datatype
+bytes(size_t size) {
+    MPI_Datatype type;
+
+    MPI_Type_contiguous(size, MPI_BYTE, &type);
+    MPI_Type_commit(&type);
+    return type;
+}
+
+/*  One window of 'bytes' per process of the node; the bases of all of
+    them in st->partial
+*/
+static forceType *
+per_process(nodeState *st, size_t bytes, MPI_Win *win) {
+    MPI_Aint size;
+    int unit, r;
+    void *base;
+
+    MPI_Win_allocate_shared(bytes, sizeof(forceType), MPI_INFO_NULL, st->node, &base, win);
+    for (r = 0; r < st->nodeSize; ++r) {
+        MPI_Win_shared_query(*win, r, &size, &unit, &st->partial[r]);
+    }
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, *win);
+    return base;
+}
+
+/*  Slices in node order: node k gets the bodies of the processes
+    before it, every process an equal share
+*/
+static void
+partition(nbodySim *sim, nodeState *st, int numprocs) {
+    int nodeSize, nodes = 0, before = 0, k = 0;
+    int *sizes = 0;
+    long long pairs = nbody_pair_count(sim->bodyCt);
+    int slice;
+
+    MPI_Comm_size(st->node, &nodeSize);
+    if (st->leaders != MPI_COMM_NULL) {
+        MPI_Comm_size(st->leaders, &nodes);
+    }
+    MPI_Bcast(&nodes, 1, MPI_INT, 0, st->node);
+    st->nodes = nodes;
+    sizes = malloc(sizeof(int) * nodes);
+    st->counts = malloc(sizeof(int) * nodes);
+    st->displs = malloc(sizeof(int) * nodes);
+    if (st->leaders != MPI_COMM_NULL) {
+        MPI_Allgather(&nodeSize, 1, MPI_INT, sizes, 1, MPI_INT, st->leaders);
+        MPI_Comm_rank(st->leaders, &k);
+    }
+    MPI_Bcast(&k, 1, MPI_INT, 0, st->node);
+    st->nodeIndex = k;
+    MPI_Bcast(sizes, nodes, MPI_INT, 0, st->node);
+
+    for (before = 0, slice = 0; slice < nodes; ++slice) {
+        int lo = (int) ((long long) sim->bodyCt * before / numprocs);
+
+        before += sizes[slice];
+        st->displs[slice] = lo;
+        st->counts[slice] = (int) ((long long) sim->bodyCt * before / numprocs) - lo;
+    }
+    for (before = 0, slice = 0; slice < k; ++slice) {
+        before += sizes[slice];
+    }
+    slice = before + st->nodeRank;
+    sim->first = (int) ((long long) sim->bodyCt * slice / numprocs);
+    sim->last = (int) ((long long) sim->bodyCt * (slice + 1) / numprocs);
+    nbody_set_pairs(sim, pairs * slice / numprocs, pairs * (slice + 1) / numprocs);
+    free(sizes);
+}
+
+/*  Collective over comm; returns 0 on every process if any failed */
+nbodySim *
+node_create(const nbodyParams *p, MPI_Comm comm) {
+    nbodySim *sim;
+    nodeState *st;
+    int ok, numprocs;
+
+    MPI_Comm_size(comm, &numprocs);
+    if (p->reorderEvery > 0) {
+        MPI_Comm_rank(comm, &ok);
+        if (ok == 0) {
+            fprintf(stderr, "--exchange=shared keeps the bodies in place, not with --reorder\n");
+        }
+        return 0;
+    }
+    sim = nbody_alloc(p);
+    st = calloc(1, sizeof(nodeState));
+    ok = (sim != 0 && st != 0);
+    MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_MIN, comm);
+    if (!ok) {
+        nbody_destroy(sim);
+        free(st);
+        return 0;
+    }
+
+    st->comm = comm;
+    MPI_Comm_rank(comm, &st->myid);
+    MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, st->myid, MPI_INFO_NULL, &st->node);
+    MPI_Comm_rank(st->node, &st->nodeRank);
+    MPI_Comm_size(st->node, &st->nodeSize);
+    MPI_Comm_split(comm, st->nodeRank == 0 ? 0 : MPI_UNDEFINED, st->myid, &st->leaders);
+    st->mpi_position_type = bytes(sizeof(bodyPositionType));
+    st->mpi_body_type = bytes(sizeof(bodyType));
+
+    /* the private arrays are untouched so far */
+    mem_free(sim->positions, sizeof(bodyPositionType) * sim->bodyCt, sim->p.huge);
+    mem_free(sim->bodies, sizeof(bodyType) * sim->bodyCt, sim->p.huge);
+    mem_free(sim->forces, sizeof(forceType) * sim->bodyCt, sim->p.huge);
+    sim->positions = shared(st, sizeof(bodyPositionType) * sim->bodyCt, sizeof(bodyPositionType), &st->positionWin);
+    sim->bodies = shared(st, sizeof(bodyType) * sim->bodyCt, sizeof(bodyType), &st->bodyWin);
+    st->nodeForces = shared(st, sizeof(forceType) * sim->bodyCt, sizeof(forceType), &st->forceWin);
+    /* the pair split leaves partial forces of all the bodies on every process */
+    st->partial = malloc(sizeof(forceType *) * st->nodeSize);
+    sim->forces = per_process(st, sizeof(forceType) * sim->bodyCt, &st->partialWin);
+
+    sim->exchange = &node_exchange;
+    sim->exchangeState = st;
+    sim->rank = st->myid;
+    sim->ranks = numprocs;
+    partition(sim, st, numprocs);
+
+    if (p->init == INIT_RANDOM) {
+        /* rand() is a serial stream: the master generates all the bodies */
+        if (st->myid == 0) {
+            ok = (nbody_init_range(sim, 0, sim->bodyCt) == 0);
+        }
+        MPI_Bcast(&ok, 1, MPI_INT, 0, comm);
+        node_sync(st);
+        if (ok && st->leaders != MPI_COMM_NULL) {
+            MPI_Bcast(sim->bodies, sim->bodyCt, st->mpi_body_type, 0, st->leaders);
+            MPI_Bcast(sim->positions, sim->bodyCt, st->mpi_position_type, 0, st->leaders);
+        }
+    } else if (p->init != INIT_FILE) {
+        /* counter-based generators: every process writes its slice in
+           place, the leader the bodies of the other nodes */
+        int lo = st->displs[st->nodeIndex], hi = lo + st->counts[st->nodeIndex];
+
+        ok = (nbody_init_range(sim, sim->first, sim->last) == 0);
+        if (ok && st->leaders != MPI_COMM_NULL) {
+            ok = (nbody_init_range(sim, 0, lo) == 0 && nbody_init_range(sim, hi, sim->bodyCt) == 0);
+        }
+        MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_MIN, comm);
+    } else {
+        ok = (nbody_init_range(sim, sim->first, sim->last) == 0);
+        MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_MIN, comm);
+        node_sync(st);
+        if (ok && st->leaders != MPI_COMM_NULL) {
+            MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, sim->bodies, st->counts, st->displs,
+                           st->mpi_body_type, st->leaders);
+            MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, sim->positions, st->counts, st->displs,
+                           st->mpi_position_type, st->leaders);
+        }
+    }
+    node_sync(st);
+    if (!ok) {
+        nbody_destroy(sim);
+        return 0;
+    }
+    return sim;
+}
+
+/*  Velocities are only written in place: collect them on the master,
+    with the summed forces
+*/
+void
+node_gather(nbodySim *sim) {
+    nodeState *st = STATE(sim);
+    int k;
+
+    node_sync(st);
+    if (st->leaders != MPI_COMM_NULL) {
+        MPI_Comm_rank(st->leaders, &k);
+        MPI_Gatherv(k == 0 ? MPI_IN_PLACE : sim->bodies + st->displs[k], st->counts[k], st->mpi_body_type,
+                    sim->bodies, st->counts, st->displs, st->mpi_body_type, 0, st->leaders);
+    }
+    if (st->myid == 0) {
+        memcpy(sim->forces, st->nodeForces, sizeof(forceType) * sim->bodyCt);
+    }
+}
@@ -0,0 +1,22 @@
+/*
+    Node-shared layer of nbody-par (--exchange=shared).
+
+    The processes of a node (MPI_Comm_split_type) share one copy of
+    the positions and bodies, and one of the summed forces, in MPI-3
+    shared-memory windows. Every process writes its slice of the new
+    positions in place, so there is no copy within a node; only one
+    leader per node takes part in the exchanges between nodes.
+*/
+
+#ifndef NBODY_NODE_H
+#define NBODY_NODE_H
+
+#include <mpi.h>
+#include "nbody.h"
+
+extern const nbodyExchange node_exchange;
+
+nbodySim *node_create(const nbodyParams *p, MPI_Comm comm);
+void node_gather(nbodySim *sim);
+
+#endif
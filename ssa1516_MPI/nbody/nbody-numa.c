@@ -0,0 +1,245 @@
+/*
+    Placement of the body arrays in memory.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "nbody-numa.h"
+
+#define MAXNODES    64
+#define SAMPLES     4096        /* pages looked up per array by mem_report() */
+
+static const char *places[] = { "first-touch", "interleave" };
+static const char *huges[] = { "none", "thp", "explicit" };
+
+static int
+lookup(const char *name, const char **names, int count) {
+    int i;
+
+    for (i = 0; i < count; ++i) {
+        if (strcmp(name, names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int
+mem_parse_place(const char *name, placePolicy *place) {
+    int i = lookup(name, places, sizeof(places) / sizeof(places[0]));
+
+    if (i < 0) {
+        return -1;
+    }
+    *place = i;
+    return 0;
+}
+
+int
+mem_parse_huge(const char *name, hugePolicy *huge) {
+    int i = lookup(name, huges, sizeof(huges) / sizeof(huges[0]));
+
+    if (i < 0) {
+        return -1;
+    }
+    *huge = i;
+    return 0;
+}
+
+/*  Nodes with memory, as a bit mask; their count is returned */
+static int
+memory_nodes(unsigned long *mask) {
+    FILE *in = fopen("/sys/devices/system/node/has_memory", "r");
+    int lo, hi, count = 0;
+    char sep;
+
+    *mask = 0;
+    if (in == 0) {
+        *mask = 1;
+        return 1;
+    }
+    /* a list like "0-1,3" */
+    while (fscanf(in, "%d", &lo) == 1) {
+        hi = lo;
+        sep = fgetc(in);
+        if (sep == '-' && fscanf(in, "%d", &hi) == 1) {
+            sep = fgetc(in);
+        }
+        for (; lo <= hi && lo < MAXNODES; ++lo) {
+            *mask |= 1UL << lo;
+            ++count;
+        }
+        if (sep != ',') {
+            break;
+        }
+    }
+    fclose(in);
+    if (count == 0) {
+        *mask = 1;
+        count = 1;
+    }
+    return count;
+}
+
+int
+mem_nodes(void) {
+    unsigned long mask;
+
+    return memory_nodes(&mask);
+}
+
+static size_t
+round_up(size_t bytes, size_t unit) {
+    return (bytes + unit - 1) / unit * unit;
+}
+
+/*  Zeroed memory that no page has been touched of yet */
+void *
+mem_alloc(size_t bytes, placePolicy place, hugePolicy huge) {
+    size_t size;
+    char *p = MAP_FAILED;
+
+    if (bytes == 0) {
+        bytes = 1;
+    }
+    if (huge == HUGE_EXPLICIT) {
+        size = round_up(bytes, HUGE_PAGE);
+        p = mmap(0, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p == MAP_FAILED) {
+            fprintf(stderr, "No explicit huge pages for %zu bytes, trying transparent ones\n", size);
+        }
+    }
+    if (p == MAP_FAILED && huge != HUGE_NONE) {
+        /* 2 MB aligned, so that every page of it can be huge */
+        char *raw;
+
+        size = round_up(bytes, HUGE_PAGE);
+        raw = mmap(0, size + HUGE_PAGE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED) {
+            return 0;
+        }
+        p = (char *) round_up((size_t) raw, HUGE_PAGE);
+        if (p > raw) {
+            munmap(raw, p - raw);
+        }
+        munmap(p + size, raw + HUGE_PAGE - p);
+        madvise(p, size, MADV_HUGEPAGE);
+    }
+    if (p == MAP_FAILED) {
+        size = bytes;
+        p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            return 0;
+        }
+    }
+
+    if (place == PLACE_INTERLEAVE) {
+        unsigned long mask;
+
+        memory_nodes(&mask);
+        if (syscall(SYS_mbind, p, size, MPOL_INTERLEAVE, &mask, MAXNODES + 1, 0) != 0) {
+            perror("mbind");
+        }
+    }
+    return p;
+}
+
+void
+mem_free(void *ptr, size_t bytes, hugePolicy huge) {
+    if (ptr == 0) {
+        return;
+    }
+    if (bytes == 0) {
+        bytes = 1;
+    }
+    munmap(ptr, huge != HUGE_NONE ? round_up(bytes, HUGE_PAGE) : bytes);
+}
+
+/*  Give back the whole pages of [ptr, ptr + bytes): they read as
+    zeros again and are placed anew by their next first touch
+*/
+void
+mem_release(void *ptr, size_t bytes) {
+    long page = sysconf(_SC_PAGESIZE);
+    size_t lo = round_up((size_t) ptr, page);
+    size_t hi = ((size_t) ptr + bytes) / page * page;
+
+    if (hi > lo) {
+        madvise((void *) lo, hi - lo, MADV_DONTNEED);
+    }
+}
+
+/*  Huge page kB, transparent or explicit, of the mapping holding ptr */
+static long
+huge_kb(const void *ptr) {
+    FILE *in = fopen("/proc/self/smaps", "r");
+    char line[256];
+    unsigned long start = (unsigned long) ptr;
+    unsigned long lo, hi;
+    long kb, total = 0;
+    int inside = 0;
+
+    if (in == 0) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), in)) {
+        if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2) {
+            if (inside) {
+                break;
+            }
+            inside = (start >= lo && start < hi);
+        } else if (inside && (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1 ||
+                              sscanf(line, "Private_Hugetlb: %ld kB", &kb) == 1 ||
+                              sscanf(line, "Shared_Hugetlb: %ld kB", &kb) == 1)) {
+            total += kb;
+        }
+    }
+    fclose(in);
+    return total;
+}
+
+/*  Share of the pages of [ptr, ptr + bytes) on every node, by
+    sampling up to SAMPLES pages, and its huge pages
+*/
+void
+mem_report(const char *name, const void *ptr, size_t bytes, FILE *out) {
+    long page = sysconf(_SC_PAGESIZE);
+    size_t pages = (bytes + page - 1) / page;
+    size_t step = pages > SAMPLES ? pages / SAMPLES : 1;
+    void *addr[SAMPLES];
+    int status[SAMPLES];
+    int count[MAXNODES] = { 0 };
+    int n = 0, absent = 0, i;
+
+    for (i = 0; i < SAMPLES && (size_t) i * step < pages; ++i) {
+        addr[n++] = (char *) ptr + (size_t) i * step * page;
+    }
+    fprintf(out, "  %-10s %10zu kB:", name, bytes / 1024);
+    if (syscall(SYS_move_pages, 0, n, addr, 0, status, 0) != 0) {
+        fprintf(out, " placement unknown");
+    } else {
+        for (i = 0; i < n; ++i) {
+            if (status[i] >= 0 && status[i] < MAXNODES) {
+                count[status[i]]++;
+            } else {
+                absent++;
+            }
+        }
+        for (i = 0; i < MAXNODES; ++i) {
+            if (count[i]) {
+                fprintf(out, " node%d %5.1f%%", i, 100.0 * count[i] / n);
+            }
+        }
+        if (absent) {
+            fprintf(out, " untouched %5.1f%%", 100.0 * absent / n);
+        }
+    }
+    fprintf(out, ", huge pages %ld kB\n", huge_kb(ptr));
+}
@@ -0,0 +1,42 @@
+/*
+    Placement of the body arrays in memory.
+
+    The arrays are anonymous mappings that nothing touches until the
+    simulation initializes them, so the default Linux policy puts each
+    page on the NUMA node of the thread that first writes it: threaded
+    backends write their own slices first. PLACE_INTERLEAVE spreads
+    the pages round-robin over the nodes instead, for arrays that all
+    threads read. The huge page options back the arrays with 2 MB
+    pages, transparent (madvise) or explicit (MAP_HUGETLB, from the
+    pool reserved in /proc/sys/vm/nr_hugepages, falling back to
+    transparent ones).
+*/
+
+#ifndef NBODY_NUMA_H
+#define NBODY_NUMA_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+typedef enum {
+    PLACE_FIRST_TOUCH = 0,
+    PLACE_INTERLEAVE
+} placePolicy;
+
+typedef enum {
+    HUGE_NONE = 0,
+    HUGE_TRANSPARENT,
+    HUGE_EXPLICIT
+} hugePolicy;
+
+#define HUGE_PAGE   (2UL << 20)
+
+int mem_parse_place(const char *name, placePolicy *place);
+int mem_parse_huge(const char *name, hugePolicy *huge);
+void *mem_alloc(size_t bytes, placePolicy place, hugePolicy huge);
+void mem_free(void *ptr, size_t bytes, hugePolicy huge);
+void mem_release(void *ptr, size_t bytes);
+int mem_nodes(void);
+void mem_report(const char *name, const void *ptr, size_t bytes, FILE *out);
+
+#endif
@@ -0,0 +1,331 @@
+/*
+    Out-of-core body state.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include "nbody-ooc.h"
+#include "nbody-kernel.h"
+
+/*  Bytes per body over the three arrays */
+#define BODY_BYTES  (sizeof(bodyPositionType) + sizeof(bodyType) + sizeof(forceType))
+
+typedef struct {
+    int tile;                   /* bodies per tile */
+    long page;
+    long tilePairs;             /* tile pairs visited */
+    double io;                  /* seconds waiting for tiles to page in */
+    double compute;             /* seconds in the pair loops */
+} oocType;
+
+static size_t
+page_round(size_t bytes, long page) {
+    return (bytes + page - 1) / page * page;
+}
+
+/*  Place the arrays of sim in sim->p.stateFile */
+int
+ooc_map(nbodySim *sim) {
+    long page = sysconf(_SC_PAGESIZE);
+    size_t posBytes = page_round(sizeof(bodyPositionType) * (size_t) sim->bodyCt, page);
+    size_t bodyBytes = page_round(sizeof(bodyType) * (size_t) sim->bodyCt, page);
+    size_t forceBytes = page_round(sizeof(forceType) * (size_t) sim->bodyCt, page);
+    size_t size = posBytes + bodyBytes + forceBytes;
+    const char *file = sim->p.stateFile;
+    char *map;
+    int fd;
+
+    if ((fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+        perror(file);
+        return -1;
+    }
+    /* a fresh file reads as zeros, like calloc() */
+    if (ftruncate(fd, size) < 0) {
+        perror(file);
+        close(fd);
+        return -1;
+    }
+    map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(file);
+        return -1;
+    }
+
+    sim->stateMap = map;
+    sim->stateSize = size;
+    sim->positions = (bodyPositionType *) map;
+    sim->bodies = (bodyType *) (map + posBytes);
+    sim->forces = (forceType *) (map + posBytes + bodyBytes);
+    return 0;
+}
+
+void
+ooc_unmap(nbodySim *sim) {
+    munmap(sim->stateMap, sim->stateSize);
+    sim->stateMap = 0;
+}
+
+/*  Largest tile of which two fit in half of the physical memory */
+int
+ooc_default_tile(int bodyCt) {
+    double memory = (double) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+    double tile = memory / 4 / BODY_BYTES;
+
+    if (tile < 1024) {
+        tile = 1024;
+    }
+    return tile < bodyCt ? (int) tile : bodyCt;
+}
+
+
+static double
+now(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + (tv.tv_usec / 1000000.0);
+}
+
+/*  madvise() the pages of the three arrays of bodies [lo, hi) */
+static void
+advise(nbodySim *sim, int lo, int hi, int advice, long page) {
+    struct {
+        char *base;
+        size_t size;
+    } span[3];
+    int i;
+
+    if (sim->stateMap == 0 || lo >= hi) {
+        return;
+    }
+    span[0].base = (char *) (sim->positions + lo);
+    span[0].size = sizeof(bodyPositionType) * (size_t) (hi - lo);
+    span[1].base = (char *) (sim->bodies + lo);
+    span[1].size = sizeof(bodyType) * (size_t) (hi - lo);
+    span[2].base = (char *) (sim->forces + lo);
+    span[2].size = sizeof(forceType) * (size_t) (hi - lo);
+    for (i = 0; i < 3; ++i) {
+        char *start = (char *) ((unsigned long) span[i].base / page * page);
+
+        madvise(start, span[i].base + span[i].size - start, advice);
+    }
+}
+
+/*  Fault in the pages of bodies [lo, hi), so that waiting for the
+    disk is not counted as compute time
+*/
+static void
+touch(nbodySim *sim, int lo, int hi, long page) {
+    const volatile char *spans[3];
+    size_t sizes[3];
+    size_t off;
+    int i;
+
+    if (sim->stateMap == 0 || lo >= hi) {
+        return;
+    }
+    spans[0] = (const char *) (sim->positions + lo);
+    sizes[0] = sizeof(bodyPositionType) * (size_t) (hi - lo);
+    spans[1] = (const char *) (sim->bodies + lo);
+    sizes[1] = sizeof(bodyType) * (size_t) (hi - lo);
+    spans[2] = (const char *) (sim->forces + lo);
+    sizes[2] = sizeof(forceType) * (size_t) (hi - lo);
+    for (i = 0; i < 3; ++i) {
+        for (off = 0; off < sizes[i]; off += page) {
+            (void) spans[i][off];
+        }
+        (void) spans[i][sizes[i] - 1];
+    }
+}
+
+static int
+ooc_init(nbodySim *sim) {
+    oocType *ooc = calloc(1, sizeof(oocType));
+
+    if (ooc == 0) {
+        return -1;
+    }
+    ooc->tile = sim->p.tile > 0 ? sim->p.tile : ooc_default_tile(sim->bodyCt);
+    ooc->page = sysconf(_SC_PAGESIZE);
+    sim->forceState = ooc;
+    return 0;
+}
+
+/*  Pairs (b, c), b < c, of rows [rowLo, rowHi) x columns [colLo, colHi)
+    that fall in [pairLo, pairHi), whose ends are (startB, startC) and
+    (endB, endC)
+*/
+static inline double
+ooc_block(nbodySim *sim, int rowLo, int rowHi, int colLo, int colHi,
+          int endB, int endC, const int energy) {
+    double potential = 0;
+    int b, c;
+
+    for (b = rowLo; b < rowHi; ++b) {
+        int lo = (b == sim->startB) ? sim->startC : b + 1;
+        int hi = (b == endB) ? endC : sim->bodyCt;
+
+        if (lo < colLo) {
+            lo = colLo;
+        }
+        if (hi > colHi) {
+            hi = colHi;
+        }
+        for (c = lo; c < hi; ++c) {
+            direct_pair(sim, sim->forces, b, c, energy, &potential);
+        }
+    }
+    return potential;
+}
+
+/*  Force of columns [colLo, colHi) on rows [rowLo, rowHi) */
+static inline double
+ooc_owner_block(nbodySim *sim, int rowLo, int rowHi, int colLo, int colHi, const int energy) {
+    double potential = 0;
+    int b, c;
+
+    for (b = rowLo; b < rowHi; ++b) {
+        for (c = colLo; c < colHi; ++c) {
+            if (c != b) {
+                direct_force(sim, sim->forces, b, c, energy, &potential);
+            }
+        }
+    }
+    return potential;
+}
+
+/*  Owner-computes: the rows of [first, last) against all the column
+    tiles, streamed as below
+*/
+static void
+ooc_owner(nbodySim *sim) {
+    oocType *ooc = sim->forceState;
+    int tile = ooc->tile;
+    int tiles = (sim->bodyCt + tile - 1) / tile;
+    int I, J;
+    double t;
+
+    for (I = sim->first / tile; I * tile < sim->last; ++I) {
+        int rowLo = (I * tile > sim->first) ? I * tile : sim->first;
+        int rowHi = ((I + 1) * tile < sim->last) ? (I + 1) * tile : sim->last;
+
+        for (J = 0; J < tiles; ++J) {
+            int colLo = J * tile;
+            int colHi = (colLo + tile < sim->bodyCt) ? colLo + tile : sim->bodyCt;
+
+            if (J + 1 < tiles) {
+                advise(sim, colHi, (colHi + tile < sim->bodyCt) ? colHi + tile : sim->bodyCt,
+                       MADV_WILLNEED, ooc->page);
+            }
+            t = now();
+            touch(sim, rowLo, rowHi, ooc->page);
+            touch(sim, colLo, colHi, ooc->page);
+            ooc->io += now() - t;
+
+            t = now();
+            if (sim->diagStep) {
+                sim->potential += ooc_owner_block(sim, rowLo, rowHi, colLo, colHi, 1);
+            } else {
+                ooc_owner_block(sim, rowLo, rowHi, colLo, colHi, 0);
+            }
+            ooc->compute += now() - t;
+            ooc->tilePairs++;
+
+#ifdef MADV_COLD
+            if (J != I) {
+                advise(sim, colLo, colHi, MADV_COLD, ooc->page);
+            }
+#endif
+        }
+    }
+}
+
+/*  Tile rows I in order, and within a row the column tiles J >= I in
+    order: tile I stays resident over its row while the J stream
+    through, the next one read ahead and the finished one marked for
+    reclaim first (a cyclic scan defeats LRU).
+*/
+static int
+ooc_forces(nbodySim *sim) {
+    oocType *ooc = sim->forceState;
+    int tile = ooc->tile;
+    int tiles = (sim->bodyCt + tile - 1) / tile;
+    int endB, endC, I, J;
+    double t;
+
+    if (sim->owner) {
+        ooc_owner(sim);
+        return 0;
+    }
+    if (sim->pairLo >= sim->pairHi) {
+        return 0;
+    }
+    nbody_pair_start(sim->bodyCt, sim->pairHi, &endB, &endC);
+    for (I = sim->startB / tile; I <= endB / tile && I < tiles; ++I) {
+        int rowLo = I * tile;
+        int rowHi = (rowLo + tile < sim->bodyCt) ? rowLo + tile : sim->bodyCt;
+
+        if (rowLo < sim->startB) {
+            rowLo = sim->startB;
+        }
+        if (rowHi > endB + 1) {
+            rowHi = endB + 1;
+        }
+        for (J = I; J < tiles; ++J) {
+            int colLo = J * tile;
+            int colHi = (colLo + tile < sim->bodyCt) ? colLo + tile : sim->bodyCt;
+            int next = (J + 1 < tiles) ? J + 1 : I + 1;
+
+            if (next < tiles) {
+                advise(sim, next * tile, (next + 1) * tile < sim->bodyCt ? (next + 1) * tile : sim->bodyCt,
+                       MADV_WILLNEED, ooc->page);
+            }
+            t = now();
+            touch(sim, rowLo, rowHi, ooc->page);
+            touch(sim, colLo, colHi, ooc->page);
+            ooc->io += now() - t;
+
+            t = now();
+            if (sim->diagStep) {
+                sim->potential += ooc_block(sim, rowLo, rowHi, colLo, colHi, endB, endC, 1);
+            } else {
+                ooc_block(sim, rowLo, rowHi, colLo, colHi, endB, endC, 0);
+            }
+            ooc->compute += now() - t;
+            ooc->tilePairs++;
+
+#ifdef MADV_COLD
+            if (J != I) {
+                advise(sim, colLo, colHi, MADV_COLD, ooc->page);
+            }
+#endif
+        }
+#ifdef MADV_COLD
+        advise(sim, rowLo, rowHi, MADV_COLD, ooc->page);
+#endif
+    }
+    return 0;
+}
+
+static void
+ooc_report(nbodySim *sim, FILE *out) {
+    oocType *ooc = sim->forceState;
+
+    fprintf(out, "Out-of-core forces: tiles of %d bodies, %ld tile pairs, I/O %10.3f seconds, compute %10.3f seconds\n",
+            ooc->tile, ooc->tilePairs, ooc->io, ooc->compute);
+}
+
+static void
+ooc_free(nbodySim *sim) {
+    free(sim->forceState);
+}
+
+const nbodyForces nbody_direct_ooc = {
+    "direct-ooc", ooc_init, ooc_forces, ooc_free, 0, 0, ooc_report, 0, 1
+};
@@ -0,0 +1,22 @@
+/*
+    Out-of-core body state.
+
+    With nbodyParams.stateFile set, the position, body and force
+    arrays live in that file (created or truncated, each array
+    starting on a page boundary) mapped with MAP_SHARED, so N is
+    bounded by the disk instead of the memory. The direct-ooc force
+    backend visits the pairs tile by tile to keep a working set of
+    two tiles resident; every body still sums its partners in index
+    order, so the forces are bitwise those of the direct backend.
+*/
+
+#ifndef NBODY_OOC_H
+#define NBODY_OOC_H
+
+#include "nbody.h"
+
+int ooc_map(nbodySim *sim);
+void ooc_unmap(nbodySim *sim);
+int ooc_default_tile(int bodyCt);
+
+#endif
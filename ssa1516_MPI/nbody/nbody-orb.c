@@ -0,0 +1,486 @@
+/*
+    Distributed layer of nbody-par (--exchange=orb) for the tree and
+    cell backends.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nbody-orb.h"
+#include "nbody-tree.h"
+
+typedef struct {
+    MPI_Comm comm;
+    int myid;
+    int numprocs;
+    int *counts;                /* bodies held by every process */
+    int *displs;                /* and their first slot */
+    double *boxes;              /* bounding box {xlo, xhi, ylo, yhi} of the bodies of every process */
+    MPI_Datatype mpi_position_type;
+    MPI_Datatype mpi_body_type;
+    MPI_Datatype mpi_force_type;
+    MPI_Datatype mpi_point_type;
+    MPI_Datatype mpi_record_type;
+} orbState;
+
+/*  A migrating body */
+typedef struct {
+    bodyPositionType position;
+    bodyType body;
+    int id;
+    float work;
+} orbRecord;
+
+/*  Processes [lo, hi) and the part of space they share */
+typedef struct {
+    int lo;
+    int hi;
+    double box[4];
+} orbGroup;
+
+#define STATE(sim)  ((orbState *) (sim)->exchangeState)
+
+
+static void
+set_slots(nbodySim *sim, int held) {
+    orbState *st = STATE(sim);
+    int i, sum = 0;
+
+    MPI_Allgather(&held, 1, MPI_INT, st->counts, 1, MPI_INT, st->comm);
+    for (i = 0; i < st->numprocs; ++i) {
+        st->displs[i] = sum;
+        sum += st->counts[i];
+    }
+    sim->first = st->displs[st->myid];
+    sim->last = sim->first + held;
+}
+
+/*  Coordinate dim (0: x, 1: y) of body b */
+static double
+coordinate(nbodySim *sim, int b, int dim) {
+    return dim ? Y(b) : X(b);
+}
+
+/*  Process of every own body by recursive bisection of the weights */
+static void
+bisect(nbodySim *sim, int *dest) {
+    orbState *st = STATE(sim);
+    int held = sim->last - sim->first;
+    orbGroup *groups = malloc(sizeof(orbGroup) * 2 * st->numprocs);
+    int *label = calloc(held ? held : 1, sizeof(int));
+    double *lo = malloc(sizeof(double) * 2 * st->numprocs);
+    double *hi = malloc(sizeof(double) * 2 * st->numprocs);
+    int *dim = malloc(sizeof(int) * 2 * st->numprocs);
+    double *sums = malloc(sizeof(double) * 4 * st->numprocs);
+    int groupCt = 1, g, i, iter, split;
+
+    groups[0].lo = 0;
+    groups[0].hi = st->numprocs;
+    groups[0].box[0] = 0;
+    groups[0].box[1] = sim->xdim;
+    groups[0].box[2] = 0;
+    groups[0].box[3] = sim->ydim;
+
+    do {
+        /* cut every group of several processes across its longer side */
+        split = 0;
+        for (g = 0; g < groupCt; ++g) {
+            double *box = groups[g].box;
+
+            dim[g] = (box[1] - box[0] >= box[3] - box[2]) ? 0 : 1;
+            lo[g] = box[2 * dim[g]];
+            hi[g] = box[2 * dim[g] + 1];
+            split |= (groups[g].hi - groups[g].lo > 1);
+        }
+        if (!split) {
+            break;
+        }
+        for (iter = 0; iter < ORB_ITERS; ++iter) {
+            memset(sums, 0, sizeof(double) * 2 * groupCt);
+            for (i = 0; i < held; ++i) {
+                int b = sim->first + i;
+                double w = 1 + (sim->work ? sim->work[b] : 0);
+
+                g = label[i];
+                sums[2 * g + 1] += w;
+                if (coordinate(sim, b, dim[g]) < (lo[g] + hi[g]) / 2) {
+                    sums[2 * g] += w;
+                }
+            }
+            MPI_Allreduce(MPI_IN_PLACE, sums, 2 * groupCt, MPI_DOUBLE, MPI_SUM, st->comm);
+            for (g = 0; g < groupCt; ++g) {
+                int n = groups[g].hi - groups[g].lo;
+                double share = (double) (n / 2) / n;
+
+                if (sums[2 * g] < share * sums[2 * g + 1]) {
+                    lo[g] = (lo[g] + hi[g]) / 2;
+                } else {
+                    hi[g] = (lo[g] + hi[g]) / 2;
+                }
+            }
+        }
+
+        /* the lower half of group g keeps its index, the upper half is new */
+        for (i = 0; i < held; ++i) {
+            int b = sim->first + i;
+
+            g = label[i];
+            if (groups[g].hi - groups[g].lo > 1 &&
+                    coordinate(sim, b, dim[g]) >= (lo[g] + hi[g]) / 2) {
+                label[i] = groupCt + g;
+            }
+        }
+        for (g = groupCt - 1; g >= 0; --g) {
+            int n = groups[g].hi - groups[g].lo;
+            double cut = (lo[g] + hi[g]) / 2;
+
+            groups[groupCt + g] = groups[g];
+            if (n > 1) {
+                groups[g].hi = groups[g].lo + n / 2;
+                groups[g].box[2 * dim[g] + 1] = cut;
+                groups[groupCt + g].lo = groups[g].hi;
+                groups[groupCt + g].box[2 * dim[g]] = cut;
+            } else {
+                /* nothing moves to the copy */
+                groups[groupCt + g].lo = groups[groupCt + g].hi;
+            }
+        }
+        groupCt *= 2;
+    } while (groupCt < 2 * st->numprocs);
+
+    for (i = 0; i < held; ++i) {
+        dest[i] = groups[label[i]].lo;
+    }
+    free(groups);
+    free(label);
+    free(lo);
+    free(hi);
+    free(dim);
+    free(sums);
+}
+
+/*  Release the pages of slots [lo, hi) of every array */
+static void
+release(nbodySim *sim, int lo, int hi) {
+    if (lo >= hi) {
+        return;
+    }
+    mem_release(sim->positions + lo, sizeof(bodyPositionType) * (hi - lo));
+    mem_release(sim->bodies + lo, sizeof(bodyType) * (hi - lo));
+    mem_release(sim->forces + lo, sizeof(forceType) * (hi - lo));
+    mem_release(sim->ids + lo, sizeof(int) * (hi - lo));
+    if (sim->work) {
+        mem_release(sim->work + lo, sizeof(float) * (hi - lo));
+    }
+}
+
+/*  Recompute the domains and move the bodies to their new owners */
+static void
+orb_balance(nbodySim *sim) {
+    orbState *st = STATE(sim);
+    int held = sim->last - sim->first;
+    int every = sim->p.balanceEvery > 0 ? sim->p.balanceEvery : ORB_BALANCE;
+    int *dest, *sendcounts, *recvcounts, *sdispls, *rdispls, *fill;
+    orbRecord *send, *recv;
+    int oldFirst = sim->first, oldLast = sim->last;
+    int i, r, count;
+
+    if (st->numprocs == 1 || sim->step % every != 0) {
+        return;
+    }
+    dest = malloc(sizeof(int) * (held ? held : 1));
+    sendcounts = calloc(st->numprocs, sizeof(int));
+    recvcounts = malloc(sizeof(int) * st->numprocs);
+    sdispls = malloc(sizeof(int) * st->numprocs);
+    rdispls = malloc(sizeof(int) * st->numprocs);
+    fill = malloc(sizeof(int) * st->numprocs);
+    send = malloc(sizeof(orbRecord) * (held ? held : 1));
+    bisect(sim, dest);
+
+    for (i = 0; i < held; ++i) {
+        sendcounts[dest[i]]++;
+    }
+    for (r = 0, count = 0; r < st->numprocs; ++r) {
+        sdispls[r] = fill[r] = count;
+        count += sendcounts[r];
+    }
+    for (i = 0; i < held; ++i) {
+        int b = sim->first + i;
+        orbRecord *o = &send[fill[dest[i]]++];
+
+        o->position = sim->positions[b];
+        o->body = sim->bodies[b];
+        o->id = sim->ids[b];
+        o->work = sim->work ? sim->work[b] : 0;
+    }
+    MPI_Alltoall(sendcounts, 1, MPI_INT, recvcounts, 1, MPI_INT, st->comm);
+    for (r = 0, count = 0; r < st->numprocs; ++r) {
+        rdispls[r] = count;
+        count += recvcounts[r];
+    }
+    recv = malloc(sizeof(orbRecord) * (count ? count : 1));
+    MPI_Alltoallv(send, sendcounts, sdispls, st->mpi_record_type,
+                  recv, recvcounts, rdispls, st->mpi_record_type, st->comm);
+
+    set_slots(sim, count);
+    release(sim, oldFirst, oldLast < sim->first ? oldLast : sim->first);
+    release(sim, oldFirst > sim->last ? oldFirst : sim->last, oldLast);
+    for (i = 0; i < count; ++i) {
+        int b = sim->first + i;
+
+        sim->positions[b] = recv[i].position;
+        sim->bodies[b] = recv[i].body;
+        sim->ids[b] = recv[i].id;
+        if (sim->work) {
+            sim->work[b] = recv[i].work;
+        }
+    }
+
+    free(dest);
+    free(sendcounts);
+    free(recvcounts);
+    free(sdispls);
+    free(rdispls);
+    free(fill);
+    free(send);
+    free(recv);
+}
+
+/*  The bounding box of the bodies of every process into st->boxes */
+static void
+share_boxes(nbodySim *sim) {
+    orbState *st = STATE(sim);
+    double box[4] = { 1, 0, 1, 0 };     /* empty */
+    int b;
+
+    for (b = sim->first; b < sim->last; ++b) {
+        if (b == sim->first || X(b) < box[0]) box[0] = X(b);
+        if (b == sim->first || X(b) > box[1]) box[1] = X(b);
+        if (b == sim->first || Y(b) < box[2]) box[2] = Y(b);
+        if (b == sim->first || Y(b) > box[3]) box[3] = Y(b);
+    }
+    MPI_Allgather(box, 4, MPI_DOUBLE, st->boxes, 4, MPI_DOUBLE, st->comm);
+}
+
+/*  Send every process its points of send, sendcounts[r] of them each
+    in rank order; returns the received ones (malloc()ed) in *remote,
+    and their count
+*/
+static int
+exchange_points(orbState *st, const treePoint *send, int *sendcounts, treePoint **remote) {
+    int *recvcounts = malloc(sizeof(int) * st->numprocs);
+    int *sdispls = malloc(sizeof(int) * st->numprocs);
+    int *rdispls = malloc(sizeof(int) * st->numprocs);
+    int count, r;
+
+    MPI_Alltoall(sendcounts, 1, MPI_INT, recvcounts, 1, MPI_INT, st->comm);
+    for (r = 0, count = 0; r < st->numprocs; ++r) {
+        sdispls[r] = count;
+        count += sendcounts[r];
+    }
+    for (r = 0, count = 0; r < st->numprocs; ++r) {
+        rdispls[r] = count;
+        count += recvcounts[r];
+    }
+    *remote = malloc(sizeof(treePoint) * (count ? count : 1));
+    MPI_Alltoallv((void *) send, sendcounts, sdispls, st->mpi_point_type,
+                  *remote, recvcounts, rdispls, st->mpi_point_type, st->comm);
+
+    free(recvcounts);
+    free(sdispls);
+    free(rdispls);
+    return count;
+}
+
+/*  Send every process the essential part of the local tree for the
+    bounding box of its bodies (nothing without one), and receive ours
+*/
+static int
+orb_essential(nbodySim *sim, const quadTree *local, treePoint **remote) {
+    orbState *st = STATE(sim);
+    int *sendcounts = malloc(sizeof(int) * st->numprocs);
+    treePoint *send = 0;
+    int count = 0, cap = 0;
+    int r;
+
+    share_boxes(sim);
+    for (r = 0; r < st->numprocs; ++r) {
+        double *other = &st->boxes[4 * r];
+        int before = count;
+
+        if (local && r != st->myid && other[0] <= other[1]) {
+            tree_essential(local, other, sim->p.theta, &send, &count, &cap);
+        }
+        sendcounts[r] = count - before;
+    }
+    count = exchange_points(st, send, sendcounts, remote);
+
+    free(send);
+    free(sendcounts);
+    return count;
+}
+
+/*  Send every process the own bodies within reach of the bounding
+    box of its bodies (its halo), and receive ours
+*/
+static int
+orb_halo(nbodySim *sim, double reach, treePoint **remote) {
+    orbState *st = STATE(sim);
+    int *sendcounts = malloc(sizeof(int) * st->numprocs);
+    treePoint *send = 0;
+    int count = 0, cap = 0;
+    int b, r;
+
+    share_boxes(sim);
+    for (r = 0; r < st->numprocs; ++r) {
+        double *other = &st->boxes[4 * r];
+
+        sendcounts[r] = 0;
+        if (r == st->myid || other[0] > other[1]) {
+            continue;
+        }
+        for (b = sim->first; b < sim->last; ++b) {
+            double dx = (X(b) < other[0]) ? other[0] - X(b) : (X(b) > other[1] ? X(b) - other[1] : 0);
+            double dy = (Y(b) < other[2]) ? other[2] - Y(b) : (Y(b) > other[3] ? Y(b) - other[3] : 0);
+            treePoint *p;
+
+            if (dx * dx + dy * dy >= reach * reach) {
+                continue;
+            }
+            if (count == cap) {
+                treePoint *more = realloc(send, sizeof(treePoint) * (cap ? 2 * cap : 1024));
+
+                if (more == 0) {
+                    break;
+                }
+                send = more;
+                cap = cap ? 2 * cap : 1024;
+            }
+            p = &send[count++];
+            p->x = X(b);
+            p->y = Y(b);
+            p->mass = M(b);
+            p->radius = R(b);
+            p->id = sim->ids[b];
+            sendcounts[r]++;
+        }
+    }
+    count = exchange_points(st, send, sendcounts, remote);
+
+    free(send);
+    free(sendcounts);
+    return count;
+}
+
+static void
+orb_reduce(nbodySim *sim, double *v, int n) {
+    orbState *st = STATE(sim);
+
+    MPI_Reduce(st->myid == 0 ? MPI_IN_PLACE : v, v, n, MPI_DOUBLE, MPI_SUM, 0, st->comm);
+}
+
+static void
+orb_free(nbodySim *sim) {
+    orbState *st = STATE(sim);
+
+    MPI_Type_free(&st->mpi_position_type);
+    MPI_Type_free(&st->mpi_body_type);
+    MPI_Type_free(&st->mpi_force_type);
+    MPI_Type_free(&st->mpi_point_type);
+    MPI_Type_free(&st->mpi_record_type);
+    free(st->counts);
+    free(st->displs);
+    free(st->boxes);
+    free(st);
+}
+
+const nbodyExchange orb_exchange = {
+    "orb", 0, 0, orb_reduce, orb_free, 0, orb_balance, orb_essential, 0, 0, 0, orb_halo
+};
+
+
+static MPI_Datatype
+bytes(size_t size) {
+    MPI_Datatype type;
+
+    MPI_Type_contiguous(size, MPI_BYTE, &type);
+    MPI_Type_commit(&type);
+    return type;
+}
+
+/*  Collective over comm; returns 0 on every process if any failed */
+nbodySim *
+orb_create(const nbodyParams *p, MPI_Comm comm) {
+    nbodyParams q = *p;
+    nbodySim *sim;
+    orbState *st;
+    int ok, myid, b;
+
+    MPI_Comm_rank(comm, &myid);
+    if (q.forces == 0) {
+        q.forces = &nbody_tree;
+    }
+    if ((q.forces != &nbody_tree && q.forces != &nbody_cell) || q.reorderEvery > 0) {
+        if (myid == 0) {
+            fprintf(stderr, "--exchange=orb needs --forces=tree or cell and orders the bodies itself\n");
+        }
+        return 0;
+    }
+
+    sim = nbody_alloc(&q);
+    st = calloc(1, sizeof(orbState));
+    ok = (sim != 0 && st != 0 && (sim->ids || (sim->ids = malloc(sizeof(int) * sim->bodyCt))));
+    MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_MIN, comm);
+    if (!ok) {
+        nbody_destroy(sim);
+        free(st);
+        return 0;
+    }
+
+    st->comm = comm;
+    st->myid = myid;
+    MPI_Comm_size(comm, &st->numprocs);
+    st->counts = malloc(sizeof(int) * st->numprocs);
+    st->displs = malloc(sizeof(int) * st->numprocs);
+    st->boxes = malloc(sizeof(double) * 4 * st->numprocs);
+    st->mpi_position_type = bytes(sizeof(bodyPositionType));
+    st->mpi_body_type = bytes(sizeof(bodyType));
+    st->mpi_force_type = bytes(sizeof(forceType));
+    st->mpi_point_type = bytes(sizeof(treePoint));
+    st->mpi_record_type = bytes(sizeof(orbRecord));
+    sim->exchange = &orb_exchange;
+    sim->exchangeState = st;
+    sim->rank = myid;
+    sim->ranks = st->numprocs;
+
+    /* blocks of indices until the first balancing */
+    set_slots(sim, sim->bodyCt / st->numprocs + (myid < sim->bodyCt % st->numprocs));
+    ok = (nbody_init_range(sim, sim->first, sim->last) == 0);
+    for (b = sim->first; b < sim->last; ++b) {
+        sim->ids[b] = b;
+        sim->work[b] = 0;
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_MIN, comm);
+    if (!ok) {
+        nbody_destroy(sim);
+        return 0;
+    }
+    return sim;
+}
+
+/*  Collect all the bodies on the master, for output */
+void
+orb_gather(nbodySim *sim) {
+    orbState *st = STATE(sim);
+    int held = sim->last - sim->first;
+    int root = (st->myid == 0);
+
+    MPI_Gatherv(root ? MPI_IN_PLACE : sim->positions + sim->first, held, st->mpi_position_type,
+                sim->positions, st->counts, st->displs, st->mpi_position_type, 0, st->comm);
+    MPI_Gatherv(root ? MPI_IN_PLACE : sim->bodies + sim->first, held, st->mpi_body_type,
+                sim->bodies, st->counts, st->displs, st->mpi_body_type, 0, st->comm);
+    MPI_Gatherv(root ? MPI_IN_PLACE : sim->forces + sim->first, held, st->mpi_force_type,
+                sim->forces, st->counts, st->displs, st->mpi_force_type, 0, st->comm);
+    MPI_Gatherv(root ? MPI_IN_PLACE : sim->ids + sim->first, held, MPI_INT,
+                sim->ids, st->counts, st->displs, MPI_INT, 0, st->comm);
+}
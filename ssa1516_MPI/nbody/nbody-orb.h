@@ -0,0 +1,31 @@
+/*
+    Distributed layer of nbody-par (--exchange=orb) for the tree and
+    cell backends.
+
+    Every process holds only the bodies of its domain, in its own
+    range of slots [first, last) (the pages of the others stay
+    untouched). Every balanceEvery steps the domains are recomputed by
+    orthogonal recursive bisection of space, weighted by the
+    interactions of every body in the last force pass, and the bodies
+    migrate. Every step, the processes exchange the locally essential
+    trees: what of its quadtree the bodies in the bounding box of
+    another process need; for the cell backend, their bodies within
+    the cutoff of its bounding box instead (its halo). Forces are then
+    computed for the own bodies only, without any reduction.
+*/
+
+#ifndef NBODY_ORB_H
+#define NBODY_ORB_H
+
+#include <mpi.h>
+#include "nbody.h"
+
+#define ORB_ITERS       48      /* bisection steps per cut */
+#define ORB_BALANCE     10      /* default steps between rebalancing */
+
+extern const nbodyExchange orb_exchange;
+
+nbodySim *orb_create(const nbodyParams *p, MPI_Comm comm);
+void orb_gather(nbodySim *sim);
+
+#endif
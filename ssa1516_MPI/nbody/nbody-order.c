@@ -0,0 +1,145 @@
+/*
+    Space-filling-curve ordering of the bodies.
+
+    Sorting the body arrays along a Morton (Z) or Hilbert curve over
+    the space puts bodies that are close in space close in memory, for
+    the benefit of tiled and locality-sensitive kernels. sim->ids
+    remembers the original index of every slot, so that output stays
+    in the original order.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "nbody.h"
+
+#define CURVE_BITS  16          /* per axis */
+
+static const char *curves[] = { "morton", "hilbert" };
+
+int
+nbody_parse_curve(const char *name, orderCurve *curve) {
+    int i;
+
+    for (i = 0; i < (int) (sizeof(curves) / sizeof(curves[0])); ++i) {
+        if (strcmp(name, curves[i]) == 0) {
+            *curve = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*  Interleave the bits of x and y */
+static unsigned long
+morton_key(unsigned x, unsigned y) {
+    unsigned long key = 0;
+    int i;
+
+    for (i = CURVE_BITS - 1; i >= 0; --i) {
+        key = (key << 2) | (((y >> i) & 1) << 1) | ((x >> i) & 1);
+    }
+    return key;
+}
+
+/*  Distance along the Hilbert curve filling a 2^CURVE_BITS square */
+static unsigned long
+hilbert_key(unsigned x, unsigned y) {
+    unsigned n = 1u << CURVE_BITS;
+    unsigned long key = 0;
+    unsigned s;
+
+    for (s = n / 2; s > 0; s /= 2) {
+        unsigned rx = (x & s) > 0;
+        unsigned ry = (y & s) > 0;
+
+        key += (unsigned long) s * s * ((3 * rx) ^ ry);
+
+        /* rotate the quadrant */
+        if (ry == 0) {
+            unsigned t;
+
+            if (rx == 1) {
+                x = n - 1 - x;
+                y = n - 1 - y;
+            }
+            t = x;
+            x = y;
+            y = t;
+        }
+    }
+    return key;
+}
+
+static unsigned
+quantize(double v, int dim) {
+    double q = v / dim * (1u << CURVE_BITS);
+
+    if (q < 0) {
+        return 0;
+    }
+    return q >= (1u << CURVE_BITS) ? (1u << CURVE_BITS) - 1 : (unsigned) q;
+}
+
+static int
+compare_keys(const void *a, const void *b) {
+    unsigned long long ka = *(const unsigned long long *) a;
+    unsigned long long kb = *(const unsigned long long *) b;
+
+    return (ka > kb) - (ka < kb);
+}
+
+/*  Sort the bodies along sim->p.curve; collective in parallel runs,
+    as every process must hold all the bodies first
+*/
+int
+nbody_reorder(nbodySim *sim) {
+    unsigned long long *keys = malloc(sizeof(unsigned long long) * sim->bodyCt);
+    bodyPositionType *positions = malloc(sizeof(bodyPositionType) * sim->bodyCt);
+    bodyType *bodies = malloc(sizeof(bodyType) * sim->bodyCt);
+    int *ids = malloc(sizeof(int) * sim->bodyCt);
+    int b;
+
+    if (sim->exchange && sim->exchange->bodies) {
+        sim->exchange->bodies(sim);
+    }
+    if (keys == 0 || positions == 0 || bodies == 0 || ids == 0 || sim->ids == 0) {
+        free(keys);
+        free(positions);
+        free(bodies);
+        free(ids);
+        return -1;
+    }
+
+    /* key in the high half, slot in the low half: ties keep their order */
+    for (b = 0; b < sim->bodyCt; ++b) {
+        unsigned x = quantize(X(b), sim->xdim);
+        unsigned y = quantize(Y(b), sim->ydim);
+        unsigned long key = (sim->p.curve == CURVE_HILBERT) ? hilbert_key(x, y) : morton_key(x, y);
+
+        keys[b] = ((unsigned long long) key << 32) | (unsigned) b;
+    }
+    qsort(keys, sim->bodyCt, sizeof(unsigned long long), compare_keys);
+
+    for (b = 0; b < sim->bodyCt; ++b) {
+        int from = (int) (keys[b] & 0xffffffffu);
+
+        positions[b] = sim->positions[from];
+        bodies[b] = sim->bodies[from];
+        ids[b] = sim->ids[from];
+    }
+    memcpy(sim->positions, positions, sizeof(bodyPositionType) * sim->bodyCt);
+    memcpy(sim->bodies, bodies, sizeof(bodyType) * sim->bodyCt);
+    memcpy(sim->ids, ids, sizeof(int) * sim->bodyCt);
+
+    free(keys);
+    free(positions);
+    free(bodies);
+    free(ids);
+    return 0;
+}
+
+/*  Original index of every slot, 0 while the bodies were never reordered */
+const int *
+nbody_ids(const nbodySim *sim) {
+    return sim->ids;
+}
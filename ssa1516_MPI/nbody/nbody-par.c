@@ -4,634 +4,377 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <unistd.h>
-#include <math.h>
+#include <string.h>
 #include <time.h>
 #include <sys/time.h>
 #include <mpi.h>
-
-extern double   sqrt(double);
-extern double   atan2(double, double);
-
-#define GRAVITY     1.1
-#define FRICTION    0.01
-#define MAXBODIES  10000
-#define DELTA_T     (0.025/5000)
-#define BOUNCE      -0.9
-#define SEED        27102015
-
-typedef struct {
-    double xv;          /* velocity along X-axis */
-    double yv;          /* velocity along Y-axis */
-    double mass;        /* Mass of the body */
-    double radius;      /* width (derived from mass) */
-} bodyType;
-
-typedef struct {
-    double x[2];        /* Old and new X-axis coordinates */
-    double y[2];        /* Old and new Y-axis coordinates */
-} bodyPositionType;
-
-typedef struct {
-    double xf;          /* force along X-axis */
-    double yf;          /* force along Y-axis */
-} forceType;
-
-int globalStartB;
-int globalStartC;
-
-bodyType *bodies;			/*list of bodies*/
-bodyPositionType *positions;/*list of bodies position*/
-forceType *forces;			/*list of forces per body*/
-forceType *new_forces;		/*ausiliar list of forces (MPI reduce)*/
-int bodyCt;					/*number of bodies*/
-int old = 0;    			/* Flips between 0 and 1 */
-bodyType *rec_bodies;		/*assigned portion of bodies*/
-bodyPositionType *rec_positions;	/*assigned portion of positions*/
-int *displs_forces;			/*list of the starting indexes of forces assigned per processor*/
-int *displs_bodies;			/*list of the starting indexes of bodies assigned per processor*/
-int *bodies_per_proc;		/*list of the number of bodies assigned per processor*/
-int *forces_per_proc;		/*list of the number of forces assigned per processor*/
-int myid;					/*MPI process ID*/
-int printed = 0;
-int numprocs;				/*number of MPI processes involeved in the computation*/
-MPI_Op mpi_sum;
-
-/*  Macros to hide memory layout
-*/
-#define X(B)        positions[B].x[old]
-#define XN(B)       positions[B].x[old^1]
-#define Y(B)        positions[B].y[old]
-#define YN(B)       positions[B].y[old^1]
-#define XF(B)       forces[B].xf
-#define YF(B)       forces[B].yf
-#define XV(B)       bodies[B].xv
-#define YV(B)       bodies[B].yv
-#define R(B)        bodies[B].radius
-#define M(B)        bodies[B].mass
-
-
-
-/*  Dimensions of space (very finite, ain't it?)
-*/
-int     xdim = 0;
-int     ydim = 0;
-
-
-void
-clear_forces(void) {
-    int b;
-
-    /* Clear force accumulation variables */
-    for (b = 0; b < bodyCt; ++b) {
-        YF(b) = (XF(b) = 0);
-    }
-}
-
-void
-compute_forces(void) {
-    int b, c;
-    int count = 0;
-    /* Incrementally accumulate forces from each assigned body pair,
-       skipping force of body on itself (c == b). The first loop is
-       separated to avoid an additional if construct
-    */
-    b = globalStartB;
-    for (c = globalStartC; c < bodyCt && count < forces_per_proc[myid]; ++c) {
-        double dx = X(c) - X(b);
-        double dy = Y(c) - Y(b);
-        double angle = atan2(dy, dx);
-        double dsqr = dx * dx + dy * dy;
-        double mindist = R(b) + R(c);
-        double mindsqr = mindist * mindist;
-        double forced = ((dsqr < mindsqr) ? mindsqr : dsqr);
-        double force = M(b) * M(c) * GRAVITY / forced;
-        double xf = force * cos(angle);
-        double yf = force * sin(angle);
-
-        /* Slightly sneaky...
-           force of b on c is negative of c on b;
-        */
-        XF(b) += xf;
-        YF(b) += yf;
-        XF(c) -= xf;
-        YF(c) -= yf;
-
-        count++;
-    }
-
-    /*standard loop*/
-
-    for (b = globalStartB + 1; b < bodyCt && count < forces_per_proc[myid]; ++b) {
-        for (c = b + 1; c < bodyCt && count < forces_per_proc[myid]; ++c) {
-            double dx = X(c) - X(b);
-            double dy = Y(c) - Y(b);
-            double angle = atan2(dy, dx);
-            double dsqr = dx * dx + dy * dy;
-            double mindist = R(b) + R(c);
-            double mindsqr = mindist * mindist;
-            double forced = ((dsqr < mindsqr) ? mindsqr : dsqr);
-            double force = M(b) * M(c) * GRAVITY / forced;
-            double xf = force * cos(angle);
-            double yf = force * sin(angle);
-
-            /* Slightly sneaky...
-               force of b on c is negative of c on b;
-            */
-            XF(b) += xf;
-            YF(b) += yf;
-            XF(c) -= xf;
-            YF(c) -= yf;
-
-            count++;
+#include "nbody.h"
+#include "nbody-cli.h"
+#include "nbody-mpi.h"
+#include "nbody-parareal.h"
+#include "nbody-ppm.h"
+#include "nbody-shm.h"
+#include "nbody-perf.h"
+#include "nbody-dump.h"
+#include "nbody-model.h"
+
+
+static const struct option parOptions[] = {
+    { "exchange",   required_argument, 0, 'x' },
+    { "rebalance",  required_argument, 0, 'B' },
+    { "pack",       optional_argument, 0, 'k' },
+    { "blocks",     required_argument, 0, 'Q' },
+    { "parareal",   optional_argument, 0, 'R' },
+    { "coarse",     required_argument, 0, 'G' },
+    { "coarse-forces", required_argument, 0, 'g' },
+    { "predict",    no_argument,       0, 'M' },
+    { "shrink",     no_argument,       0, 'A' },
+    { "stats",      no_argument,       0, 'Y' },
+    { 0, 0, 0, 0 }
+};
+
+static int parareal;            /* --parareal given */
+static pararealParams pararealOpts;
+static int predict;             /* --predict given */
+static int shrink;              /* --shrink given */
+
+static int
+par_option(nbodyCli *cli, int opt, char *arg) {
+    switch (opt) {
+    case 'x':
+        cli->params.exchange = arg;
+        if (strcmp(arg, "orb") == 0) {
+            /* each process holds only its share: no body limit, and
+               only the tree and cell backends have a distributed form */
+            cli->unlimited = 1;
+            if (cli->params.forces == 0) {
+                cli->params.forces = &nbody_tree;
+            }
         }
+        return 0;
+    case 'B':
+        return (cli->params.balanceEvery = atoi(arg)) > 0 ? 0 : -1;
+    case 'R':
+        parareal = 1;
+        pararealOpts.tolerance = arg ? atof(arg) : 0;
+        return pararealOpts.tolerance >= 0 ? 0 : -1;
+    case 'G':
+        return (pararealOpts.coarseRatio = atoi(arg)) > 0 ? 0 : -1;
+    case 'g':
+        return (pararealOpts.coarseForces = nbody_find_forces(arg)) ? 0 : -1;
+    case 'Q':
+        return (cli->params.queueBlocks = atoi(arg)) > 0 ? 0 : -1;
+    case 'M':
+        predict = 1;
+        return 0;
+    case 'A':
+        shrink = 1;
+        return 0;
+    case 'Y':
+        cli->params.stats = 1;
+        return 0;
+    case 'k':
+        cli->params.pack = 1;
+        cli->params.packTolerance = arg ? atof(arg) : 0;
+        return cli->params.packTolerance >= 0 ? 0 : -1;
     }
+    return -1;
 }
 
-/**
-     * Function called at the begin to calculate the
-     * initial indexes for the assigned forces chunk
+static const cliExtra parExtra = {
+    parOptions, par_option,
+    "  --exchange=NAME     parallel layer: allreduce, owner (no force reduction),\n"
+    "                      rma (forces accumulated into their owners),\n"
+    "                      queue (pair blocks claimed dynamically),\n"
+    "                      hier (collectives within and between nodes),\n"
+    "                      shared (one copy per node), orb (distributed tree)\n"
+    "  --rebalance=K       orb: recompute the domains every K steps (default 10)\n"
+    "  --blocks=K          queue: pair blocks per process (default 8)\n"
+    "  --parareal[=TOL]    integrate one time slice per process, iterating until no\n"
+    "                      slice end moves more than TOL (default: until exact)\n"
+    "  --coarse=R          parareal: coarse time step of R steps (default 10)\n"
+    "  --coarse-forces=NAME  parareal: force backend of the coarse steps\n"
+    "  --pack[=TOL]        exchange only the new coordinates; with TOL, as float\n"
+    "                      deltas each within TOL pixels\n"
+    "  --predict           report the LogGP prediction of the step (nbody-logp)\n"
+    "  --shrink            run on as many of the processes as the first steps find\n"
+    "                      fastest (1, 2, 4, ... or all); the others exit\n"
+    "  --stats             report the step time percentiles and the position bytes\n"
+    "                      received per step\n"
+};
+
+
+/*  The LogGP prediction of this run: with --predict, its step and
+    the process count of the fastest one; else only a note when more
+    processes run than the model finds useful. Direct backends only,
+    as the model counts pair forces.
 */
-void
-calculateAssignedForces() {
-    int b, c;
-    int count = 0;
-    for (b = 0; b < bodyCt; ++b) {
-        for (c = b + 1; c < bodyCt; ++c) {
-            if(count == displs_forces[myid]) {
-                globalStartB = b;
-                globalStartC = c;
-                b = bodyCt;
-            }
-            count++;
+static void
+predict_run(const nbodyParams *p, int procs, FILE *out) {
+    const char *exchange = p->exchange ? p->exchange : "allreduce";
+    logpParams lp;
+    modelCost cost, best;
+    int ranks;
+
+    if (logp_load(&lp) < 0) {
+        if (predict) {
+            fprintf(out, "No LogGP parameters in $NBODY_LOGP (default ~/.nbody-logp): run nbody-logp first\n");
         }
+        return;
     }
-}
-
-/*compute the velocity of the assigned chunk of bodies*/
-void
-compute_velocities(void) {
-    int b;
-    for (b = displs_bodies[myid]; b < displs_bodies[myid] + bodies_per_proc[myid]; ++b) {
-        double xv = XV(b);
-        double yv = YV(b);
-        double force = sqrt(xv * xv + yv * yv) * FRICTION;
-        double angle = atan2(yv, xv);
-        double xf = XF(b) - (force * cos(angle));
-        double yf = YF(b) - (force * sin(angle));
-
-        XV(b) += (xf / M(b)) * DELTA_T;
-        YV(b) += (yf / M(b)) * DELTA_T;
-    }
-}
-
-/*compute the position of the assigned chunk of bodies*/
-void
-compute_positions(void) {
-    int b;
-    for (b = displs_bodies[myid]; b < displs_bodies[myid] + bodies_per_proc[myid]; ++b) {
-        double xn = X(b) + (XV(b) * DELTA_T);
-        double yn = Y(b) + (YV(b) * DELTA_T);
-
-        /* Bounce of image "walls" */
-        if (xn < 0) {
-            xn = 0;
-            XV(b) = -XV(b);
-        } else if (xn >= xdim) {
-            xn = xdim - 1;
-            XV(b) = -XV(b);
-        }
-        if (yn < 0) {
-            yn = 0;
-            YV(b) = -YV(b);
-        } else if (yn >= ydim) {
-            yn = ydim - 1;
-            YV(b) = -YV(b);
+    if ((p->forces && strncmp(p->forces->name, "direct", 6) != 0) ||
+            model_step(&lp, p->bodyCt, procs, exchange, &cost) < 0) {
+        if (predict) {
+            fprintf(out, "No prediction for the %s backend with the %s exchange\n",
+                    p->forces ? p->forces->name : "direct", exchange);
         }
-
-        /* Update position */
-        XN(b) = xn;
-        YN(b) = yn;
-    }
-}
-
-
-/*  Graphic output stuff...
-*/
-
-#include <fcntl.h>
-#include <sys/mman.h>
-
-int     fsize;
-unsigned char   *map;
-unsigned char   *image;
-
-
-unsigned char *
-map_P6(char *filename,
-       int *xdim,
-       int *ydim) {
-    /* The following is a fast and sloppy way to
-       map a color raw PPM (P6) image file
-    */
-    int fd;
-    unsigned char *p;
-    int maxval;
-
-    /* First, open the file... */
-    if ((fd = open(filename, O_RDWR)) < 0) {
-        return((unsigned char *) 0);
+        return;
     }
-
-    /* Read size and map the whole file... */
-    fsize = lseek(fd, ((off_t) 0), SEEK_END);
-    map = ((unsigned char *)
-           mmap(0,      /* Put it anywhere */
-                fsize,  /* Map the whole file */
-                (PROT_READ | PROT_WRITE),   /* Read/write */
-                MAP_SHARED, /* Not just for me */
-                fd,     /* The file */
-                0));    /* Right from the start */
-    if (map == ((unsigned char *) - 1)) {
-        close(fd);
-        return((unsigned char *) 0);
+    ranks = model_best_ranks(&lp, p->bodyCt, MODEL_MAXRANKS, exchange, &best);
+    if (predict) {
+        logp_describe(&lp, out);
+        fprintf(out, "Predicted step on %d processes: %.3f ms (compute %.3f, communication %.3f)\n",
+                procs, cost.total * 1e3, cost.compute * 1e3, cost.comm * 1e3);
+        fprintf(out, "Predicted fastest step: %.3f ms on %d processes\n", best.total * 1e3, ranks);
+    } else if (procs > ranks) {
+        fprintf(out, "Note: %d processes, but the LogGP model predicts the fastest step on %d (--predict)\n",
+                procs, ranks);
     }
+}
 
-    /* File should now be mapped; read magic value */
-    p = map;
-    if (*(p++) != 'P') goto ppm_exit;
-    switch (*(p++)) {
-    case '6':
-        break;
-    default:
-        goto ppm_exit;
-    }
 
-#define Eat_Space \
-    while ((*p == ' ') || \
-           (*p == '\t') || \
-           (*p == '\n') || \
-           (*p == '\r') || \
-           (*p == '#')) { \
-        if (*p == '#') while (*(++p) != '\n') ; \
-        ++p; \
+/*  --parareal: every process holds the whole simulation and
+    integrates its slice of the steps; no display on the way
+*/
+static void
+run_parareal(nbodyCli *cli, int myid) {
+    nbodySim *sim;
+    double start;
+
+    if (cli->params.exchange || cli->params.diagEvery || cli->params.reorderEvery ||
+            cli->params.stateFile || cli->publish || shrink) {
+        if (myid == 0) {
+            fprintf(stderr, "--parareal integrates the time slices out of order: no --exchange, --diag,\n"
+                    "--reorder, --ooc, --publish or --shrink\n");
+        }
+        MPI_Abort(MPI_COMM_WORLD, 1);
     }
-
-    Eat_Space;      /* Eat white space and comments */
-
-#define Get_Number(n) \
-    { \
-        int charval = *p; \
- \
-        if ((charval < '0') || (charval > '9')) goto ppm_exit; \
- \
-        n = (charval - '0'); \
-        charval = *(++p); \
-        while ((charval >= '0') && (charval <= '9')) { \
-            n *= 10; \
-            n += (charval - '0'); \
-            charval = *(++p); \
-        } \
+    if ((sim = nbody_create(&cli->params)) == 0) {
+        MPI_Abort(MPI_COMM_WORLD, 1);
     }
-
-    Get_Number(*xdim);  /* Get image width */
-
-    Eat_Space;      /* Eat white space and comments */
-    Get_Number(*ydim);  /* Get image width */
-
-    Eat_Space;      /* Eat white space and comments */
-    Get_Number(maxval); /* Get image max value */
-
-    /* Should be 8-bit binary after one whitespace char... */
-    if (maxval > 255) {
-ppm_exit:
-        close(fd);
-        munmap(map, fsize);
-        return((unsigned char *) 0);
+    start = MPI_Wtime();
+    if (parareal_run(sim, &pararealOpts, cli->steps, MPI_COMM_WORLD, myid == 0 ? stderr : 0) < 0) {
+        MPI_Abort(MPI_COMM_WORLD, 1);
     }
-    if ((*p != ' ') &&
-            (*p != '\t') &&
-            (*p != '\n') &&
-            (*p != '\r')) goto ppm_exit;
-
-    /* Here we are... next byte begins the 24-bit data */
-    return(p + 1);
-
-    /* Notice that we never clean-up after this:
-
-       close(fd);
-       munmap(map, fsize);
-
-       However, this is relatively harmless;
-       they will go away when this process dies.
-    */
-}
-
-#undef  Eat_Space
-#undef  Get_Number
-
-static inline void
-color(int x, int y, int b) {
-    unsigned char *p = image + (3 * (x + (y * xdim)));
-    int tint = ((0xfff * (b + 1)) / (bodyCt + 2));
-
-    p[0] = (tint & 0xf) << 4;
-    p[1] = (tint & 0xf0);
-    p[2] = (tint & 0xf00) >> 4;
-}
-
-static inline void
-black(int x, int y) {
-    unsigned char *p = image + (3 * (x + (y * xdim)));
-
-    p[2] = (p[1] = (p[0] = 0));
-}
-
-void
-display(void) {
-    double i, j;
-    int b;
-
-    /* For each pixel */
-    for (j = 0; j < ydim; ++j) {
-        for (i = 0; i < xdim; ++i) {
-            /* Find the first body covering here */
-            for (b = 0; b < bodyCt; ++b) {
-                double dy = Y(b) - j;
-                double dx = X(b) - i;
-                double d = sqrt(dx * dx + dy * dy);
-
-                if (d <= R(b) + 0.5) {
-                    /* This is it */
-                    color(i, j, b);
-                    goto colored;
-                }
-            }
-
-            /* No object -- empty space */
-            black(i, j);
-
-colored:
-            ;
+    if (myid == 0) {
+        if (cli->dump == 0) {
+            nbody_print(sim, stdout);
+        } else if (dump_write(sim, cli->dump, 0) < 0) {
+            fprintf(stderr, "Could not write %s\n", cli->dump);
         }
+        if (cli->dumpState && dump_write(sim, cli->dumpState, 1) < 0) {
+            fprintf(stderr, "Could not write %s\n", cli->dumpState);
+        }
+        fprintf(stderr, "N-body took %10.3f seconds\n", MPI_Wtime() - start);
     }
+    nbody_destroy(sim);
 }
 
-void
-print(void) {
-    int b;
-    for (b = 0; b < bodyCt; ++b) {
-        printf("%10.3f %10.3f %10.3f %10.3f %10.3f %10.3f\n", X(b), Y(b), XF(b), YF(b), XV(b), YV(b));
-    }
-}
-
-/**
-     * Function called for the MPI reduce operation
-     *
-     * @param in
-     *            array of forces to sum
-     * @param inout
-     *            array of forces to which sum the 'in' array
-     * @param dtype
-     *            datatype
-*/
-void sumForces(forceType *in, forceType *inout, int *len, MPI_Datatype *dtype) {
-    int i;
-    for (i = 0; i < *len; ++i) {
-        inout->xf += in->xf;
-        inout->yf += in->yf;
-        in++;
-        inout++;
-    }
-}
 
-
 /*  Main program...
 */
 
 int
 main(int argc, char **argv) {
     unsigned int lastup = 0;
-    unsigned int secsup;
-    int b;
+    nbodyCli cli;
+    ppmType ppm = { 0 };
+    nbodySim *sim;
+    shmPublisher *pub = 0;
+    perfCounters *perf = 0;
+    double counts[PERF_EVENTS], least[PERF_EVENTS];
     int steps;
     double rtime;
     struct timeval start;
     struct timeval end;
-    int i;
+    int myid;
     int  namelen;
     char processor_name[MPI_MAX_PROCESSOR_NAME];
+    tuneChoice tuned;
+    MPI_Comm comm = MPI_COMM_WORLD;
+    int provided;
+    int replicated;
 
-    if (argc != 5) {
-        fprintf(stderr,
-                "Usage: %s num_bodies secs_per_update ppm_output_file steps\n",
-                argv[0]);
-        exit(1);
-    }
-
-    if ((bodyCt = atol(argv[1])) > MAXBODIES ) {
-        fprintf(stderr, "Using only %d bodies...\n", MAXBODIES);
-        bodyCt = MAXBODIES;
-    } else if (bodyCt < 2) {
-        fprintf(stderr, "Using two bodies...\n");
-        bodyCt = 2;
-    }
+    cli_parse(argc, argv, &cli, &parExtra);
 
-    MPI_Init(&argc, &argv);
-    MPI_Comm_size(MPI_COMM_WORLD, &numprocs);
+    /*threaded force backends compute only, MPI stays on this thread*/
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
     MPI_Comm_rank(MPI_COMM_WORLD, &myid);
     MPI_Get_processor_name(processor_name, &namelen);
 
-    bodies = malloc(sizeof(bodyType) * bodyCt);
-    positions = malloc(sizeof(bodyType) * bodyCt);
-    forces = malloc(sizeof(forceType) * bodyCt);
+    map_P6(cli.ppmFile, &ppm);
+    cli.params.xdim = ppm.xdim;
+    cli.params.ydim = ppm.ydim;
+    steps = cli.steps;
 
-    /*forces initialization*/
-    for(i = 0; i < bodyCt; i++) {
-        forces[i].xf = 0;
-        forces[i].yf = 0;
+    fprintf(stderr, "Running N-body with %i bodies and %i steps\n", cli.params.bodyCt, steps);
+    if (myid == 0 && cli.params.init != INIT_RANDOM) {
+        fprintf(stderr, "Initial conditions: %s\n", init_name(cli.params.init));
     }
-
-    bodies_per_proc = malloc(sizeof(int) * numprocs);
-
-    secsup = atoi(argv[2]);
-    image = map_P6(argv[3], &xdim, &ydim);
-    steps = atoi(argv[4]);
-
-    fprintf(stderr, "Running N-body with %i bodies and %i steps\n", bodyCt, steps);
-
-    /* Initialize simulation data */
-    if(myid == 0) {
-        srand(SEED);
-        for (b = 0; b < bodyCt; ++b) {
-            X(b) = (rand() % xdim);
-            Y(b) = (rand() % ydim);
-            R(b) = 1 + ((b * b + 1.0) * sqrt(1.0 * ((xdim * xdim) + (ydim * ydim)))) /
-                   (25.0 * (bodyCt * bodyCt + 1.0));
-            M(b) = R(b) * R(b) * R(b);
-            XV(b) = ((rand() % 20000) - 10000) / 2000.0;
-            YV(b) = ((rand() % 20000) - 10000) / 2000.0;
-        }
-    }
-
     fprintf(stderr, "Process %d on %s\n", myid, processor_name);
 
-    //calculate the number of total forces to compute*/
-    int forceCt = 0;
-    for(i = 0; i < bodyCt; i++) {
-        forceCt += i;
+    if (parareal) {
+        run_parareal(&cli, myid);
+        MPI_Finalize();
+        return 0;
     }
 
-    forces_per_proc = malloc(sizeof(int) * numprocs);
-    displs_forces = malloc(sizeof(int) * numprocs);
-    displs_bodies = malloc(sizeof(int) * numprocs);
-
-    /*custom MPI dataType for the Forces distribution*/
-    const int nitems = 2;
-    int blocklengths[2] = {1, 1};
-    MPI_Datatype types[2] = {MPI_DOUBLE, MPI_DOUBLE};
-    MPI_Datatype mpi_force_type;
-    MPI_Aint     offsets[2];
-
-    offsets[0] = offsetof(forceType, xf);
-    offsets[1] = offsetof(forceType, yf);
-
-    MPI_Type_create_struct(nitems, blocklengths, offsets, types, &mpi_force_type);
-    MPI_Type_commit(&mpi_force_type);
-
-    /*custom MPI dataType for the Positions distribution*/
-    const int nitems2 = 2;
-    int blocklengths2[2] = {2, 2};
-    MPI_Datatype types2[2] = {MPI_DOUBLE, MPI_DOUBLE};
-    MPI_Datatype mpi_position_type;
-    MPI_Aint     offsets2[2];
-
-    offsets2[0] = offsetof(bodyPositionType, x);
-    offsets2[1] = offsetof(bodyPositionType, y);
-
-    MPI_Type_create_struct(nitems2, blocklengths2, offsets2, types2, &mpi_position_type);
-    MPI_Type_commit(&mpi_position_type);
-
-    /*custom MPI dataType for the Bodies distribution*/
-    const int nitems3 = 4;
-    int blocklengths3[4] = {1, 1, 1, 1};
-    MPI_Datatype types3[4] = {MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE,};
-    MPI_Datatype mpi_body_type;
-    MPI_Aint     offsets3[4];
-
-    offsets3[0] = offsetof(bodyType, xv);
-    offsets3[1] = offsetof(bodyType, yv);
-    offsets3[2] = offsetof(bodyType, mass);
-    offsets3[3] = offsetof(bodyType, radius);
-
-    MPI_Type_create_struct(nitems3, blocklengths3, offsets3, types3, &mpi_body_type);
-    MPI_Type_commit(&mpi_body_type);
-
-    /*custom MPI reduce operation*/
-    MPI_Op_create((MPI_User_function *) sumForces, 1, &mpi_sum);
-
-    /*calculate the forces to assign to each process and the displacements*/
-    int avarage_forces_per_proc = forceCt / numprocs;
-    int rem = forceCt % numprocs;
-    int sum = 0;
-
-    for (i = 0; i < numprocs; i++) {
-        forces_per_proc[i] = avarage_forces_per_proc;
-        if (rem > 0) {
-            forces_per_proc[i]++;
-            rem--;
-        }
-        displs_forces[i] = sum;
-        sum += forces_per_proc[i];
+    /* the processes left out have nothing more to do */
+    if (shrink && (comm = nbody_mpi_shrink(&cli.params, MPI_COMM_WORLD, stderr)) == MPI_COMM_NULL) {
+        MPI_Finalize();
+        return 0;
     }
 
-    /*calculate the bodies to assign to each process and the displacements*/
-    int avarage_bodies_per_proc = bodyCt / numprocs;
-    rem = bodyCt % numprocs;
-    sum = 0;
-
-    for (i = 0; i < numprocs; i++) {
-        bodies_per_proc[i] = avarage_bodies_per_proc;
-        if (rem > 0) {
-            bodies_per_proc[i]++;
-            rem--;
-        }
-        displs_bodies[i] = sum;
-        sum += bodies_per_proc[i];
+    if (nbody_mpi_tune(&cli.params, comm, cli.tune, &tuned, stderr) < 0) {
+        MPI_Abort(MPI_COMM_WORLD, 1);
     }
+    if (myid == 0) {
+        int procs;
 
-    int bufSize = bodyCt % numprocs == 0 ? bodyCt / numprocs : (bodyCt / numprocs + 1);
-
-    rec_positions = malloc(sizeof(bodyPositionType) * bufSize);
-    rec_bodies = malloc(sizeof(bodyType) * bufSize);
-
+        MPI_Comm_size(comm, &procs);
+        predict_run(&cli.params, procs, stderr);
+    }
 
-    calculateAssignedForces();
+    /* before the simulation, to inherit into its threads */
+    if (cli.counters && (perf = perf_open()) == 0 && myid == 0) {
+        fprintf(stderr, "Hardware counters not available\n");
+    }
 
-    /*broadcast the bodies and the positions to all the processes*/
-    MPI_Bcast(bodies, bodyCt, mpi_body_type, 0, MPI_COMM_WORLD);
-    MPI_Bcast(positions, bodyCt, mpi_body_type, 0, MPI_COMM_WORLD);
+    if(gettimeofday(&start, 0) != 0) {
+        fprintf(stderr, "could not do timing\n");
+        exit(1);
+    }
 
-    /*scatter the bodies and the positions to the processes*/
-    MPI_Scatterv(bodies, bodies_per_proc, displs_bodies, mpi_body_type, rec_bodies, bufSize, mpi_body_type, 0, MPI_COMM_WORLD);
-    MPI_Scatterv(positions, bodies_per_proc, displs_bodies, mpi_position_type, rec_positions, bufSize, mpi_position_type, 0, MPI_COMM_WORLD);
+    if ((sim = nbody_mpi_create(&cli.params, comm)) == 0) {
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    replicated = nbody_mpi_replicated(sim);
+    if (myid == 0 && cli.publish && (pub = shm_publish_open(cli.publish, sim, 4)) == 0) {
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    if (cli.params.place || cli.params.huge || mem_nodes() > 1) {
+        /*one write per process, so that the reports do not mix*/
+        char *report;
+        size_t size;
+        FILE *out = open_memstream(&report, &size);
+
+        fprintf(out, "Process %d memory placement:\n", myid);
+        nbody_memory_report(sim, out);
+        fclose(out);
+        fputs(report, stderr);
+        free(report);
+    }
 
-    int cont;
+    if(gettimeofday(&end, 0) != 0) {
+        fprintf(stderr, "could not do timing\n");
+        exit(1);
+    }
+    if (myid == 0 && cli.params.init != INIT_RANDOM) {
+        fprintf(stderr, "Initialization took %10.3f seconds\n",
+                (end.tv_sec + (end.tv_usec / 1000000.0)) -
+                (start.tv_sec + (start.tv_usec / 1000000.0)));
+    }
 
     if(gettimeofday(&start, 0) != 0) {
         fprintf(stderr, "could not do timing\n");
         exit(1);
     }
 
+    perf_start(perf);
+
     while (steps--) {
-        cont = 0;
-        clear_forces();
-        compute_forces();
-
-        /*Reduce all the forces calculated by each process*/
-        new_forces = malloc(sizeof(forceType) * bodyCt);
-        MPI_Allreduce(forces, new_forces, bodyCt, mpi_force_type, mpi_sum, MPI_COMM_WORLD);
-        free(forces);
-        forces = new_forces;
-
-        compute_velocities();
-        compute_positions();
-
-        /*gather the updated positions from all the nodes to all the nodes */
-        rec_positions = positions + displs_bodies[myid];
-        positions = malloc(sizeof(bodyPositionType) * bodyCt);
-        MPI_Allgatherv(rec_positions, bodies_per_proc[myid], mpi_position_type, positions, bodies_per_proc, displs_bodies, mpi_position_type, MPI_COMM_WORLD);
-
-        old ^= 1;
-        rec_positions = positions + displs_bodies[myid];
+        int draw, publish;
+
+        /*the others wait in the next exchange: only an abort ends them*/
+        if (nbody_step(sim, 1) < 0) {
+            fprintf(stderr, "Process %d: force computation failed in step %ld\n", myid, sim->step - 1);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+
+        /*the master draws the positions; unless every process holds
+          them all, it collects them first*/
+        draw = (myid == 0 && cli.secsup > 0 && (time(0) - lastup) > cli.secsup);
+        publish = (cli.publish && sim->step % cli.publishEvery == 0);
+        if (!replicated && (cli.secsup > 0 || publish)) {
+            MPI_Bcast(&draw, 1, MPI_INT, 0, comm);
+            if (draw || publish) {
+                nbody_mpi_gather(sim);
+            }
+        }
+        if (draw) {
+            nbody_display(sim, &ppm);
+            ppm_sync(&ppm);
+            lastup = time(0);
+        }
+        if (pub && publish) {
+            shm_publish(pub, sim);
+        }
     }
 
     if(gettimeofday(&end, 0) != 0) {
         fprintf(stderr, "could not do timing\n");
         exit(1);
     }
+    perf_stop(perf);
     rtime = (end.tv_sec + (end.tv_usec / 1000000.0)) -
             (start.tv_sec + (start.tv_usec / 1000000.0));
 
-
-    /*gather the updated positions from all the nodes to the master */
-    positions = malloc(sizeof(bodyPositionType) * bodyCt);
-    MPI_Gatherv(rec_positions, bodies_per_proc[myid], mpi_position_type, positions, bodies_per_proc, displs_bodies, mpi_position_type, 0, MPI_COMM_WORLD);
-
-    /*gather the updated bodies from all the nodes to the master */
-    rec_bodies = bodies + displs_bodies[myid];
-    bodies = malloc(sizeof(bodyType) * bodyCt);
-    MPI_Gatherv(rec_bodies, bodies_per_proc[myid], mpi_body_type, bodies, bodies_per_proc, displs_bodies, mpi_body_type, 0, MPI_COMM_WORLD);
+    /*the dump files are written by all the processes at once*/
+    if (cli.dump && nbody_mpi_dump(sim, cli.dump, 0) < 0) {
+        fprintf(stderr, "Could not write %s\n", cli.dump);
+    }
+    if (cli.dumpState && nbody_mpi_dump(sim, cli.dumpState, 1) < 0) {
+        fprintf(stderr, "Could not write %s\n", cli.dumpState);
+    }
+    if (cli.dump == 0) {
+        nbody_mpi_gather(sim);
+    }
 
     if(0 == myid) {
-        print();
+        if (cli.dump == 0) {
+            nbody_print(sim, stdout);
+        }
         fprintf(stderr, "N-body took %10.3f seconds\n", rtime);
+        if (sim->forcer->report) {
+            sim->forcer->report(sim, stderr);
+        }
+        if (sim->exchange->report) {
+            sim->exchange->report(sim, stderr);
+        }
     }
 
-    MPI_Finalize();
+    shm_publish_close(pub);
+    nbody_destroy(sim);
+
+    /*sum the counters of all the processes, unless one lacks them*/
+    if (cli.counters) {
+        perf_read(perf, counts);
+        MPI_Reduce(myid == 0 ? MPI_IN_PLACE : counts, counts, PERF_EVENTS, MPI_DOUBLE, MPI_SUM, 0, comm);
+        perf_read(perf, least);
+        MPI_Reduce(myid == 0 ? MPI_IN_PLACE : least, least, PERF_EVENTS, MPI_DOUBLE, MPI_MIN, 0, comm);
+        if (myid == 0 && perf) {
+            int i;
 
-    free(forces_per_proc);
-    free(displs_forces);
-    free(displs_bodies);
+            for (i = 0; i < PERF_EVENTS; ++i) {
+                counts[i] = least[i] < 0 ? -1 : counts[i];
+            }
+            perf_print(counts, cli.steps, stderr);
+        }
+        perf_close(perf);
+    }
+    if (comm != MPI_COMM_WORLD) {
+        MPI_Comm_free(&comm);
+    }
+    MPI_Finalize();
     return 0;
 }
@@ -0,0 +1,206 @@
+/*
+    Parareal time-parallel integration for nbody-par (--parareal).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "nbody-parareal.h"
+
+#define STATE_DOUBLES   4       /* x, y, xv, yv of a body */
+
+/*  The state of the bodies that changes over time */
+static void
+get_state(nbodySim *sim, double *u) {
+    int b;
+
+    for (b = 0; b < sim->bodyCt; ++b, u += STATE_DOUBLES) {
+        u[0] = X(b);
+        u[1] = Y(b);
+        u[2] = XV(b);
+        u[3] = YV(b);
+    }
+}
+
+static void
+set_state(nbodySim *sim, const double *u) {
+    int b;
+
+    for (b = 0; b < sim->bodyCt; ++b, u += STATE_DOUBLES) {
+        X(b) = u[0];
+        Y(b) = u[1];
+        XV(b) = u[2];
+        YV(b) = u[3];
+    }
+}
+
+/*  CPU seconds of this process: the fine slices share the cores of
+    oversubscribed runs, so their wall time would count the waits
+*/
+static double
+cpu_secs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*  Integrate from state 'in' for 'steps' steps of 'sim' into 'out';
+    -1 if a force pass failed
+*/
+static int
+propagate(nbodySim *sim, const double *in, int steps, double *out) {
+    int ok;
+
+    set_state(sim, in);
+    ok = (nbody_step(sim, steps) == 0);
+    get_state(sim, out);
+    return ok ? 0 : -1;
+}
+
+/*  Every process computes its time slice of the 'steps' steps of
+    sim, whose state is the initial one on every process, and at the
+    end holds the final state (and the forces of the last step).
+    Collective over comm; the master reports to 'log' (if any).
+    Returns the iterations done, -1 on failure.
+*/
+int
+parareal_run(nbodySim *sim, const pararealParams *pp, int steps, MPI_Comm comm, FILE *log) {
+    nbodyParams cp = sim->p;
+    nbodySim *coarse;
+    int ratio = pp->coarseRatio > 0 ? pp->coarseRatio : PARAREAL_RATIO;
+    int n, procs, lo, hi, coarseSteps, k, ok, i;
+    long count = (long) STATE_DOUBLES * sim->bodyCt;
+    double *buf, *start, *next, *end, *fine, *gold, *gnew, *swap;
+    double wall, sliceSecs = 0, diff = 0;
+
+    MPI_Comm_rank(comm, &n);
+    MPI_Comm_size(comm, &procs);
+    lo = (int) ((long long) steps * n / procs);
+    hi = (int) ((long long) steps * (n + 1) / procs);
+
+    /* the coarse steps span the slice exactly */
+    cp.forces = pp->coarseForces ? pp->coarseForces : sim->forcer;
+    coarse = nbody_alloc(&cp);
+    coarseSteps = (hi - lo + ratio / 2) / ratio;
+    if (coarseSteps < 1) {
+        coarseSteps = 1;
+    }
+    buf = malloc(sizeof(double) * 6 * count);
+    ok = (coarse != 0 && buf != 0);
+    MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_MIN, comm);
+    if (!ok) {
+        nbody_destroy(coarse);
+        free(buf);
+        return -1;
+    }
+    coarse->dt = sim->dt * (hi - lo) / coarseSteps;
+    /* masses and radii */
+    memcpy(coarse->bodies, sim->bodies, sizeof(bodyType) * sim->bodyCt);
+    start = buf;
+    next = buf + count;
+    end = buf + 2 * count;
+    fine = buf + 3 * count;
+    gold = buf + 4 * count;
+    gnew = buf + 5 * count;
+
+    MPI_Barrier(comm);
+    wall = MPI_Wtime();
+
+    /* prediction: the coarse propagator along all the slices */
+    if (n == 0) {
+        get_state(sim, start);
+    } else {
+        MPI_Recv(start, (int) count, MPI_DOUBLE, n - 1, 0, comm, MPI_STATUS_IGNORE);
+    }
+    ok = (propagate(coarse, start, coarseSteps, gold) == 0);
+    memcpy(end, gold, sizeof(double) * count);
+    if (n < procs - 1) {
+        MPI_Send(end, (int) count, MPI_DOUBLE, n + 1, 0, comm);
+    }
+
+    for (k = 1; k <= procs; ++k) {
+        int same;
+
+        /* a start that did not move has the same fine end as before */
+        if (k == 1 || memcmp(start, next, sizeof(double) * count) != 0) {
+            double t = cpu_secs();
+
+            ok = (propagate(sim, start, hi - lo, fine) == 0) && ok;
+            if (k == 1) {
+                sliceSecs = cpu_secs() - t;
+            }
+        }
+
+        /* correction, in a pipeline along the slices */
+        if (n == 0) {
+            memcpy(next, start, sizeof(double) * count);
+        } else {
+            MPI_Recv(next, (int) count, MPI_DOUBLE, n - 1, 0, comm, MPI_STATUS_IGNORE);
+        }
+        same = (memcmp(next, start, sizeof(double) * count) == 0);
+        if (same) {
+            memcpy(gnew, gold, sizeof(double) * count);
+        } else {
+            ok = (propagate(coarse, next, coarseSteps, gnew) == 0) && ok;
+        }
+        diff = 0;
+        for (i = 0; i < count; ++i) {
+            double u = fine[i] + (gnew[i] - gold[i]);
+
+            if (fabs(u - end[i]) > diff) {
+                diff = fabs(u - end[i]);
+            }
+            end[i] = u;
+        }
+        if (n < procs - 1) {
+            MPI_Send(end, (int) count, MPI_DOUBLE, n + 1, 0, comm);
+        }
+        swap = gold;
+        gold = gnew;
+        gnew = swap;
+        /* keep the old start in next, to tell whether it moved */
+        swap = start;
+        start = next;
+        next = swap;
+
+        MPI_Allreduce(MPI_IN_PLACE, &diff, 1, MPI_DOUBLE, MPI_MAX, comm);
+        MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_MIN, comm);
+        if (!ok || diff <= pp->tolerance) {
+            break;
+        }
+    }
+    if (!ok) {
+        nbody_destroy(coarse);
+        free(buf);
+        return -1;
+    }
+    if (k > procs) {
+        k = procs;
+    }
+
+    /* the end of the last slice, with the forces of its last step */
+    MPI_Bcast(end, (int) count, MPI_DOUBLE, procs - 1, comm);
+    MPI_Bcast(sim->forces, 2 * sim->bodyCt, MPI_DOUBLE, procs - 1, comm);
+    set_state(sim, end);
+    sim->step = steps;
+    wall = MPI_Wtime() - wall;
+
+    MPI_Allreduce(MPI_IN_PLACE, &sliceSecs, 1, MPI_DOUBLE, MPI_SUM, comm);
+    if (n == 0 && log) {
+        fprintf(log, "Parareal: %d iterations over %d slices (%s, last change %g), coarse %s every %d steps\n",
+                k, procs, diff <= pp->tolerance ? "converged" : "exact", diff, coarse->forcer->name, ratio);
+        if (sim->forcer->threaded) {
+            /* CPU time of several threads is no sequential wall time */
+            fprintf(log, "Parareal: %.3f s, the fine slices %.3f s of CPU time summed\n", wall, sliceSecs);
+        } else {
+            fprintf(log, "Parareal: %.3f s, sequential stepping %.3f s (CPU time of the fine slices "
+                    "summed): speedup %.2f\n", wall, sliceSecs, sliceSecs / wall);
+        }
+    }
+    nbody_destroy(coarse);
+    free(buf);
+    return k;
+}
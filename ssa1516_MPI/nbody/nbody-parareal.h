@@ -0,0 +1,35 @@
+/*
+    Parareal time-parallel integration for nbody-par (--parareal).
+
+    The steps of the run are cut into one time slice per process.
+    A cheap coarse propagator (coarseRatio times the time step, and
+    optionally another force backend) predicts the state at the start
+    of every slice; then, every iteration, each process integrates its
+    slice from the predicted start with the fine integrator (the
+    ordinary nbody_step()), and the starts are corrected in a pipeline:
+
+        U[n+1] = F(U[n] of the last iteration) + G(U[n]) - G(U[n] of the last iteration)
+
+    After k iterations the first k slices are exact, so at most one
+    iteration per process reproduces sequential stepping bit for bit;
+    with a tolerance the iterations stop once no slice end moves more
+    than that (in pixels and pixels per time unit).
+*/
+
+#ifndef NBODY_PARAREAL_H
+#define NBODY_PARAREAL_H
+
+#include <mpi.h>
+#include "nbody.h"
+
+#define PARAREAL_RATIO  10      /* default fine steps per coarse step */
+
+typedef struct {
+    double tolerance;           /* 0: iterate until exact */
+    int coarseRatio;            /* fine steps per coarse step (0: PARAREAL_RATIO) */
+    const nbodyForces *coarseForces;    /* 0: the fine backend */
+} pararealParams;
+
+int parareal_run(nbodySim *sim, const pararealParams *pp, int steps, MPI_Comm comm, FILE *log);
+
+#endif
@@ -0,0 +1,136 @@
+/*
+    Hardware event counters (Linux perf_event_open) around the main
+    loop of the N-Body front-ends.
+
+    The counters follow the calling thread and, being inherited, the
+    threads it creates afterwards; open them before creating the
+    simulation so that the thread pools are counted too (their counts
+    are added when they exit).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "nbody-perf.h"
+
+struct perfCounters {
+    int fd[PERF_EVENTS];        /* -1 where the event is not supported */
+};
+
+static const struct {
+    unsigned type;
+    unsigned long long config;
+    const char *name;
+} events[PERF_EVENTS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES, "cache references" },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache misses" },
+    { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+            (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), "L1d load misses" },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions" },
+};
+
+/*  0 if none of the events can be counted here */
+perfCounters *
+perf_open(void) {
+    perfCounters *perf = malloc(sizeof(perfCounters));
+    int i, ok = 0;
+
+    if (perf == 0) {
+        return 0;
+    }
+    for (i = 0; i < PERF_EVENTS; ++i) {
+        struct perf_event_attr attr;
+
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        perf->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        ok |= (perf->fd[i] >= 0);
+    }
+    if (!ok) {
+        free(perf);
+        return 0;
+    }
+    return perf;
+}
+
+void
+perf_start(perfCounters *perf) {
+    int i;
+
+    for (i = 0; perf && i < PERF_EVENTS; ++i) {
+        if (perf->fd[i] >= 0) {
+            ioctl(perf->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+void
+perf_stop(perfCounters *perf) {
+    int i;
+
+    for (i = 0; perf && i < PERF_EVENTS; ++i) {
+        if (perf->fd[i] >= 0) {
+            ioctl(perf->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+}
+
+/*  Counts, scaled up if the events were multiplexed; -1 where not
+    available
+*/
+int
+perf_read(perfCounters *perf, double v[PERF_EVENTS]) {
+    int i;
+
+    for (i = 0; i < PERF_EVENTS; ++i) {
+        uint64_t r[3];
+
+        v[i] = -1;
+        if (perf && perf->fd[i] >= 0 && read(perf->fd[i], r, sizeof(r)) == sizeof(r) && r[2] > 0) {
+            v[i] = (double) r[0] * r[1] / r[2];
+        }
+    }
+    return 0;
+}
+
+void
+perf_print(const double v[PERF_EVENTS], long steps, FILE *out) {
+    int i;
+
+    for (i = 0; i < PERF_EVENTS; ++i) {
+        if (v[i] < 0) {
+            fprintf(out, "%-18s not available\n", events[i].name);
+        } else {
+            fprintf(out, "%-18s %16.0f (%14.0f per step)\n", events[i].name,
+                    v[i], steps > 0 ? v[i] / steps : 0);
+        }
+    }
+    if (v[0] > 0 && v[1] >= 0) {
+        fprintf(out, "%-18s %15.2f%%\n", "cache miss rate", 100 * v[1] / v[0]);
+    }
+}
+
+void
+perf_close(perfCounters *perf) {
+    int i;
+
+    for (i = 0; perf && i < PERF_EVENTS; ++i) {
+        if (perf->fd[i] >= 0) {
+            close(perf->fd[i]);
+        }
+    }
+    free(perf);
+}
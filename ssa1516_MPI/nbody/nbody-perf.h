@@ -0,0 +1,22 @@
+/*
+    Hardware event counters (Linux perf_event_open) around the main
+    loop of the N-Body front-ends.
+*/
+
+#ifndef NBODY_PERF_H
+#define NBODY_PERF_H
+
+#include <stdio.h>
+
+#define PERF_EVENTS     4
+
+typedef struct perfCounters perfCounters;
+
+perfCounters *perf_open(void);
+void perf_start(perfCounters *perf);
+void perf_stop(perfCounters *perf);
+int perf_read(perfCounters *perf, double v[PERF_EVENTS]);
+void perf_print(const double v[PERF_EVENTS], long steps, FILE *out);
+void perf_close(perfCounters *perf);
+
+#endif
@@ -0,0 +1,715 @@
+/*
+    Particle-mesh force backend.
+
+    The pair force is split as 1/r^2 = erf part + erfc part at the
+    scale rs of a few mesh cells. The smooth erf part is computed on
+    a mesh: cloud-in-cell mass assignment, convolution with the force
+    kernel by FFT (zero padded to twice the mesh, so that space is
+    not periodic; divided by the transform of the two cloud-in-cell
+    windows) and interpolation back with the same weights. The pairs
+    closer than the cutoff or the clamping distance R(b) + R(c),
+    found with a cell list, get the clamped force of the direct sum
+    less exactly what the mesh gave them: the kernel between their
+    nodes, from a table of it near the origin.
+
+    Over several processes the mesh is split in slabs of rows: every
+    process deposits and interpolates the bodies of its rows and the
+    FFT transposes the mesh with the all-to-all of the parallel
+    layer; the short-range pairs are split by the body ranges. The
+    partial forces are combined by the layer like those of the
+    direct sum.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <complex.h>
+#include <sys/time.h>
+#include "nbody.h"
+
+#define PM_NODES    512         /* mesh nodes along the longer side, by default */
+#define PM_SPLIT    2.0         /* force split scale rs, in mesh cells */
+#define PM_CUT      4.5         /* short-range cutoff, in rs */
+
+typedef double complex cplx;
+
+typedef struct {
+    double h;                   /* mesh spacing in pixels */
+    double rs;                  /* force split scale */
+    double cut;                 /* short-range cutoff */
+    int nx, ny;                 /* nodes that can hold mass */
+    int mx, my;                 /* padded mesh, powers of two */
+    int rowLo, rowHi;           /* rows of this process */
+    int colLo, colHi;           /* columns of this process, after transposing */
+    cplx *wx, *wy;              /* twiddle factors */
+    cplx *rows;                 /* rows [rowLo, rowHi) of mx nodes */
+    cplx *density;              /* transformed mass, columns [colLo, colHi) of my nodes */
+    cplx *work;                 /* the same, times a kernel */
+    cplx *forceHat;             /* transformed x + iy force kernel (with the 1 / mx my) */
+    cplx *potentialHat;         /* transformed potential kernel */
+    cplx *send, *recv;          /* transpose buffers */
+    int *sendBytes, *recvBytes;     /* one block, with room for setup flags */
+    int failed;                 /* the mesh could not be set up */
+    cplx *near;                 /* force kernel at the node offsets [0, nearX] x [0, nearY] */
+    int nearX, nearY;
+
+    /* short-range pairs */
+    double cellSize;
+    int cellX, cellY;
+    int *head;                  /* first body of every cell, -1: none */
+    int *next;                  /* next body in the same cell */
+
+    long steps;
+    long pairs;                 /* short-range pairs summed */
+    double meshTime;
+    double shortTime;
+} pmType;
+
+
+static double
+now(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + (tv.tv_usec / 1000000.0);
+}
+
+/*  Share [*lo, *hi) of process q out of n items */
+static void
+slab(int n, int ranks, int q, int *lo, int *hi) {
+    *lo = (int) ((long) n * q / ranks);
+    *hi = (int) ((long) n * (q + 1) / ranks);
+}
+
+/*  Long-range part of the pair force and potential, per G m m */
+static double
+long_force(const pmType *pm, double d) {
+    double u = d / pm->rs;
+
+    return erf(u) / (d * d) - 2 / (sqrt(M_PI) * pm->rs * d) * exp(-u * u);
+}
+
+static double
+long_potential(const pmType *pm, double d) {
+    return d > 0 ? erf(d / pm->rs) / d : 2 / (sqrt(M_PI) * pm->rs);
+}
+
+
+static void
+twiddles(cplx *w, int n) {
+    int k;
+
+    for (k = 0; k < n / 2; ++k) {
+        w[k] = cexp(-2 * M_PI * I * k / n);
+    }
+}
+
+/*  In-place radix-2 transform of a[0, n), n a power of two; the
+    inverse is not divided by n
+*/
+static void
+fft(cplx *a, int n, const cplx *w, int inverse) {
+    int i, j, k, len;
+
+    for (i = 1, j = 0; i < n; ++i) {
+        int bit = n >> 1;
+
+        for (; j & bit; bit >>= 1) {
+            j ^= bit;
+        }
+        j ^= bit;
+        if (i < j) {
+            cplx t = a[i];
+
+            a[i] = a[j];
+            a[j] = t;
+        }
+    }
+    for (len = 2; len <= n; len <<= 1) {
+        int half = len / 2, step = n / len;
+
+        for (i = 0; i < n; i += len) {
+            for (k = 0; k < half; ++k) {
+                cplx t = inverse ? conj(w[k * step]) : w[k * step];
+                cplx u = a[i + k];
+                cplx v = a[i + k + half] * t;
+
+                a[i + k] = u + v;
+                a[i + k + half] = u - v;
+            }
+        }
+    }
+}
+
+static void
+all_to_all(nbodySim *sim, pmType *pm) {
+    if (sim->ranks > 1) {
+        sim->exchange->alltoall(sim, pm->send, pm->sendBytes, pm->recv, pm->recvBytes);
+    } else {
+        memcpy(pm->recv, pm->send, pm->sendBytes[0]);
+    }
+}
+
+/*  pm->rows to columns of 'cols' */
+static void
+to_columns(nbodySim *sim, pmType *pm, cplx *cols) {
+    cplx *out = pm->send, *in = pm->recv;
+    int q, r, c, lo, hi;
+
+    for (q = 0; q < sim->ranks; ++q) {
+        slab(pm->mx, sim->ranks, q, &lo, &hi);
+        for (c = lo; c < hi; ++c) {
+            for (r = pm->rowLo; r < pm->rowHi; ++r) {
+                *out++ = pm->rows[(long) (r - pm->rowLo) * pm->mx + c];
+            }
+        }
+        pm->sendBytes[q] = sizeof(cplx) * (hi - lo) * (pm->rowHi - pm->rowLo);
+        slab(pm->my, sim->ranks, q, &lo, &hi);
+        pm->recvBytes[q] = sizeof(cplx) * (hi - lo) * (pm->colHi - pm->colLo);
+    }
+    all_to_all(sim, pm);
+    for (q = 0; q < sim->ranks; ++q) {
+        slab(pm->my, sim->ranks, q, &lo, &hi);
+        for (c = pm->colLo; c < pm->colHi; ++c) {
+            for (r = lo; r < hi; ++r) {
+                cols[(long) (c - pm->colLo) * pm->my + r] = *in++;
+            }
+        }
+    }
+}
+
+/*  Columns of 'cols' back to pm->rows */
+static void
+to_rows(nbodySim *sim, pmType *pm, const cplx *cols) {
+    cplx *out = pm->send, *in = pm->recv;
+    int q, r, c, lo, hi;
+
+    for (q = 0; q < sim->ranks; ++q) {
+        slab(pm->my, sim->ranks, q, &lo, &hi);
+        for (c = pm->colLo; c < pm->colHi; ++c) {
+            for (r = lo; r < hi; ++r) {
+                *out++ = cols[(long) (c - pm->colLo) * pm->my + r];
+            }
+        }
+        pm->sendBytes[q] = sizeof(cplx) * (hi - lo) * (pm->colHi - pm->colLo);
+        slab(pm->mx, sim->ranks, q, &lo, &hi);
+        pm->recvBytes[q] = sizeof(cplx) * (hi - lo) * (pm->rowHi - pm->rowLo);
+    }
+    all_to_all(sim, pm);
+    for (q = 0; q < sim->ranks; ++q) {
+        slab(pm->mx, sim->ranks, q, &lo, &hi);
+        for (c = lo; c < hi; ++c) {
+            for (r = pm->rowLo; r < pm->rowHi; ++r) {
+                pm->rows[(long) (r - pm->rowLo) * pm->mx + c] = *in++;
+            }
+        }
+    }
+}
+
+/*  Transform pm->rows, of which rows [filled, my) are zero, into pm->density */
+static void
+forward(nbodySim *sim, pmType *pm, int filled) {
+    int r, c;
+
+    for (r = pm->rowLo; r < pm->rowHi && r < filled; ++r) {
+        fft(pm->rows + (long) (r - pm->rowLo) * pm->mx, pm->mx, pm->wx, 0);
+    }
+    to_columns(sim, pm, pm->density);
+    for (c = pm->colLo; c < pm->colHi; ++c) {
+        fft(pm->density + (long) (c - pm->colLo) * pm->my, pm->my, pm->wy, 0);
+    }
+}
+
+/*  pm->rows = mass convolved with the kernel of 'hat', in rows [0, ny) */
+static void
+convolve(nbodySim *sim, pmType *pm, const cplx *hat) {
+    long i, n = (long) (pm->colHi - pm->colLo) * pm->my;
+    int r, c;
+
+    for (i = 0; i < n; ++i) {
+        pm->work[i] = pm->density[i] * hat[i];
+    }
+    for (c = pm->colLo; c < pm->colHi; ++c) {
+        fft(pm->work + (long) (c - pm->colLo) * pm->my, pm->my, pm->wy, 1);
+    }
+    to_rows(sim, pm, pm->work);
+    for (r = pm->rowLo; r < pm->rowHi && r < pm->ny; ++r) {
+        fft(pm->rows + (long) (r - pm->rowLo) * pm->mx, pm->mx, pm->wx, 1);
+    }
+}
+
+/*  Transform of the cloud-in-cell window at frequency k of n nodes */
+static double
+window(int k, int n) {
+    double u = M_PI * (k < n / 2 ? k : k - n) / n;
+    double s = (u != 0) ? sin(u) / u : 1;
+
+    return s * s;
+}
+
+/*  Transform of the kernel k (0: force, 1: potential) into hat; the
+    force kernel undoes the smoothing of deposit() and interpolate()
+*/
+static void
+kernel(nbodySim *sim, pmType *pm, int k, cplx *hat) {
+    long i, n = (long) (pm->colHi - pm->colLo) * pm->my;
+    double scale = 1.0 / ((double) pm->mx * pm->my);
+    int r, c;
+
+    for (r = pm->rowLo; r < pm->rowHi; ++r) {
+        double y = pm->h * (r < pm->my / 2 ? r : r - pm->my);
+
+        for (c = 0; c < pm->mx; ++c) {
+            double x = pm->h * (c < pm->mx / 2 ? c : c - pm->mx);
+            double d = sqrt(x * x + y * y);
+            cplx *v = &pm->rows[(long) (r - pm->rowLo) * pm->mx + c];
+
+            /* field at the origin of a unit mass at -(x, y) */
+            if (k == 0) {
+                *v = d > 0 ? -sim->gravity * long_force(pm, d) / d * (x + I * y) : 0;
+            } else {
+                *v = -sim->gravity * long_potential(pm, d);
+            }
+        }
+    }
+    forward(sim, pm, pm->my);
+    for (i = 0; i < n; ++i) {
+        hat[i] = pm->density[i] * scale;
+    }
+    if (k == 0) {
+        for (c = pm->colLo; c < pm->colHi; ++c) {
+            double wx = window(c, pm->mx);
+
+            for (r = 0; r < pm->my; ++r) {
+                double w = wx * window(r, pm->my);
+
+                hat[(long) (c - pm->colLo) * pm->my + r] /= w * w;
+            }
+        }
+    }
+}
+
+/*  pm->near from the field of a unit mass at node 0, gathered from
+    the rows of every process (collective; buf holds two tables per
+    process)
+*/
+static void
+near_table(nbodySim *sim, pmType *pm, cplx *buf) {
+    long i, n = (long) (pm->colHi - pm->colLo) * pm->my;
+    long size = (long) (pm->nearX + 1) * (pm->nearY + 1);
+    cplx *recv = buf + size * sim->ranks;
+    int q, r;
+
+    for (i = 0; i < n; ++i) {
+        pm->density[i] = 1;
+    }
+    convolve(sim, pm, pm->forceHat);
+    memset(pm->near, 0, sizeof(cplx) * size);
+    for (r = pm->rowLo; r < pm->rowHi && r <= pm->nearY; ++r) {
+        memcpy(pm->near + (long) r * (pm->nearX + 1), pm->rows + (long) (r - pm->rowLo) * pm->mx,
+               sizeof(cplx) * (pm->nearX + 1));
+    }
+    if (sim->ranks == 1) {
+        return;
+    }
+    for (q = 0; q < sim->ranks; ++q) {
+        memcpy(buf + size * q, pm->near, sizeof(cplx) * size);
+        pm->sendBytes[q] = pm->recvBytes[q] = sizeof(cplx) * size;
+    }
+    sim->exchange->alltoall(sim, buf, pm->sendBytes, recv, pm->recvBytes);
+    /* every row from its one process, zeros from the others */
+    memset(pm->near, 0, sizeof(cplx) * size);
+    for (q = 0; q < sim->ranks; ++q) {
+        for (i = 0; i < size; ++i) {
+            pm->near[i] += recv[size * q + i];
+        }
+    }
+}
+
+/*  Node (*i, *j) below-left of body b and its weight fractions */
+static inline void
+cic(nbodySim *sim, const pmType *pm, int b, int *i, int *j, double *fx, double *fy) {
+    double u = X(b) / pm->h, v = Y(b) / pm->h;
+
+    /* bodies stay in [0, xdim) x [0, ydim), but initial states may not */
+    u = (u < 0) ? 0 : (u > pm->nx - 1) ? pm->nx - 1 : u;
+    v = (v < 0) ? 0 : (v > pm->ny - 1) ? pm->ny - 1 : v;
+    *i = (u < pm->nx - 1) ? (int) u : pm->nx - 2;
+    *j = (v < pm->ny - 1) ? (int) v : pm->ny - 2;
+    *fx = u - *i;
+    *fy = v - *j;
+}
+
+/*  Cell of body b in the short-range cell list */
+static inline int
+cell(nbodySim *sim, const pmType *pm, int b, int *ci, int *cj) {
+    *ci = (int) (X(b) / pm->cellSize);
+    *cj = (int) (Y(b) / pm->cellSize);
+    *ci = (*ci < 0) ? 0 : (*ci >= pm->cellX) ? pm->cellX - 1 : *ci;
+    *cj = (*cj < 0) ? 0 : (*cj >= pm->cellY) ? pm->cellY - 1 : *cj;
+    return *cj * pm->cellX + *ci;
+}
+
+static void
+deposit(nbodySim *sim, pmType *pm) {
+    int b, i, j, r;
+    double fx, fy;
+
+    memset(pm->rows, 0, sizeof(cplx) * (pm->rowHi - pm->rowLo) * pm->mx);
+    for (b = 0; b < sim->bodyCt; ++b) {
+        cic(sim, pm, b, &i, &j, &fx, &fy);
+        for (r = j; r <= j + 1; ++r) {
+            if (r >= pm->rowLo && r < pm->rowHi) {
+                double m = M(b) * (r == j ? 1 - fy : fy);
+                cplx *row = pm->rows + (long) (r - pm->rowLo) * pm->mx;
+
+                row[i] += m * (1 - fx);
+                row[i + 1] += m * fx;
+            }
+        }
+    }
+}
+
+/*  Add M(b) times the interpolated field in pm->rows to the forces
+    (or, for the potential, return the sum over the bodies)
+*/
+static double
+interpolate(nbodySim *sim, pmType *pm, int potential) {
+    double sum = 0;
+    int b, i, j, r;
+    double fx, fy;
+
+    for (b = 0; b < sim->bodyCt; ++b) {
+        cplx a = 0;
+
+        cic(sim, pm, b, &i, &j, &fx, &fy);
+        if (j + 1 < pm->rowLo || j >= pm->rowHi) {
+            continue;
+        }
+        for (r = j; r <= j + 1; ++r) {
+            if (r >= pm->rowLo && r < pm->rowHi) {
+                double w = (r == j ? 1 - fy : fy);
+                const cplx *row = pm->rows + (long) (r - pm->rowLo) * pm->mx;
+
+                a += w * ((1 - fx) * row[i] + fx * row[i + 1]);
+            }
+        }
+        if (potential) {
+            sum += M(b) * creal(a);
+        } else {
+            XF(b) += M(b) * creal(a);
+            YF(b) += M(b) * cimag(a);
+        }
+    }
+    return sum;
+}
+
+/*  Mesh potential of body b on itself */
+static double
+self_potential(nbodySim *sim, const pmType *pm, int b) {
+    double wx[2], wy[2], sum = 0;
+    int i, j, p, q, s, t;
+    double fx, fy;
+
+    cic(sim, pm, b, &i, &j, &fx, &fy);
+    wx[0] = 1 - fx;
+    wx[1] = fx;
+    wy[0] = 1 - fy;
+    wy[1] = fy;
+    for (p = 0; p < 2; ++p) {
+        for (q = 0; q < 2; ++q) {
+            for (s = 0; s < 2; ++s) {
+                for (t = 0; t < 2; ++t) {
+                    sum += wx[p] * wy[q] * wx[s] * wy[t] *
+                           long_potential(pm, pm->h * sqrt((p - s) * (p - s) + (q - t) * (q - t)));
+                }
+            }
+        }
+    }
+    return -sim->gravity * M(b) * M(b) * sum;
+}
+
+/*  Force kernel at node offset (i, j), by its symmetry in both axes */
+static inline cplx
+near_field(const pmType *pm, int i, int j) {
+    cplx v = pm->near[(long) abs(j) * (pm->nearX + 1) + abs(i)];
+
+    return ((i < 0) ? -creal(v) : creal(v)) + I * ((j < 0) ? -cimag(v) : cimag(v));
+}
+
+/*  Mesh field at body b of a unit mass at body c */
+static cplx
+mesh_pair(nbodySim *sim, const pmType *pm, int b, int c) {
+    double wx[2], wy[2], vx[2], vy[2];
+    int ib, jb, ic, jc, p, q, s, t;
+    double fx, fy;
+    cplx sum = 0;
+
+    cic(sim, pm, b, &ib, &jb, &fx, &fy);
+    wx[0] = 1 - fx;
+    wx[1] = fx;
+    wy[0] = 1 - fy;
+    wy[1] = fy;
+    cic(sim, pm, c, &ic, &jc, &fx, &fy);
+    vx[0] = 1 - fx;
+    vx[1] = fx;
+    vy[0] = 1 - fy;
+    vy[1] = fy;
+    for (q = 0; q < 2; ++q) {
+        for (p = 0; p < 2; ++p) {
+            for (t = 0; t < 2; ++t) {
+                for (s = 0; s < 2; ++s) {
+                    sum += wx[p] * wy[q] * vx[s] * vy[t] *
+                           near_field(pm, ib + p - ic - s, jb + q - jc - t);
+                }
+            }
+        }
+    }
+    return sum;
+}
+
+/*  Clamped direct force of the pair minus its mesh part; each pair
+    once, from the body with the larger radius (then index), which
+    searches far enough for the clamping distance of both
+*/
+static void
+short_range(nbodySim *sim, pmType *pm) {
+    double potential = 0;
+    int b, c, ci, cj, cells = pm->cellX * pm->cellY;
+
+    for (c = 0; c < cells; ++c) {
+        pm->head[c] = -1;
+    }
+    for (b = sim->bodyCt - 1; b >= 0; --b) {
+        c = cell(sim, pm, b, &ci, &cj);
+        pm->next[b] = pm->head[c];
+        pm->head[c] = b;
+    }
+
+    for (b = sim->first; b < sim->last; ++b) {
+        double reach = (2 * R(b) > pm->cut) ? 2 * R(b) : pm->cut;
+        int span = (int) ceil(reach / pm->cellSize);
+        int i, j;
+
+        cell(sim, pm, b, &ci, &cj);
+        for (j = (cj - span > 0 ? cj - span : 0); j <= cj + span && j < pm->cellY; ++j) {
+            for (i = (ci - span > 0 ? ci - span : 0); i <= ci + span && i < pm->cellX; ++i) {
+                for (c = pm->head[j * pm->cellX + i]; c >= 0; c = pm->next[c]) {
+                    double dx, dy, dsqr, mindist, mindsqr, limit, force, d, xf, yf;
+                    cplx mesh;
+
+                    if (R(c) > R(b) || (R(c) == R(b) && c >= b)) {
+                        continue;
+                    }
+                    dx = X(c) - X(b);
+                    dy = Y(c) - Y(b);
+                    dsqr = dx * dx + dy * dy;
+                    mindist = R(b) + R(c);
+                    mindsqr = mindist * mindist;
+                    limit = (mindist > pm->cut) ? mindist : pm->cut;
+                    if (dsqr >= limit * limit) {
+                        continue;
+                    }
+                    force = M(b) * M(c) * sim->gravity / ((dsqr < mindsqr) ? mindsqr : dsqr);
+                    d = sqrt(dsqr);
+                    mesh = M(b) * M(c) * mesh_pair(sim, pm, b, c);
+                    if (d > 0) {
+                        xf = force * dx / d - creal(mesh);
+                        yf = force * dy / d - cimag(mesh);
+                    } else {
+                        /* along +x on the lower index, as in the direct sum */
+                        xf = ((b < c) ? force : -force) - creal(mesh);
+                        yf = -cimag(mesh);
+                    }
+                    XF(b) += xf;
+                    YF(b) += yf;
+                    XF(c) -= xf;
+                    YF(c) -= yf;
+                    if (sim->diagStep) {
+                        potential -= force * ((dsqr < mindsqr) ? (2 * mindist - d) : d) -
+                                     M(b) * M(c) * sim->gravity * long_potential(pm, d);
+                    }
+                    pm->pairs++;
+                }
+            }
+        }
+    }
+    sim->potential += potential;
+}
+
+static int
+pm_init(nbodySim *sim) {
+    pmType *pm = calloc(1, sizeof(pmType));
+    int longer = (sim->xdim > sim->ydim) ? sim->xdim : sim->ydim;
+
+    if (pm == 0) {
+        return -1;
+    }
+    sim->forceState = pm;
+    pm->h = sim->p.meshCell > 0 ? sim->p.meshCell : (double) longer / (PM_NODES - 2);
+    pm->rs = PM_SPLIT * pm->h;
+    pm->cut = PM_CUT * pm->rs;
+    pm->nx = (int) (sim->xdim / pm->h) + 2;
+    pm->ny = (int) (sim->ydim / pm->h) + 2;
+    for (pm->mx = 2; pm->mx < 2 * pm->nx; pm->mx *= 2)
+        ;
+    for (pm->my = 2; pm->my < 2 * pm->ny; pm->my *= 2)
+        ;
+
+    pm->cellSize = pm->cut;
+    pm->cellX = (int) (sim->xdim / pm->cellSize) + 1;
+    pm->cellY = (int) (sim->ydim / pm->cellSize) + 1;
+    pm->head = malloc(sizeof(int) * pm->cellX * pm->cellY);
+    pm->next = malloc(sizeof(int) * sim->bodyCt);
+    pm->wx = malloc(sizeof(cplx) * pm->mx / 2);
+    pm->wy = malloc(sizeof(cplx) * pm->my / 2);
+    if (pm->head == 0 || pm->next == 0 || pm->wx == 0 || pm->wy == 0) {
+        return -1;
+    }
+    twiddles(pm->wx, pm->mx);
+    twiddles(pm->wy, pm->my);
+    return 0;
+}
+
+/*  Whether ok is set on every process (collective) */
+static int
+all_ok(nbodySim *sim, pmType *pm, int ok) {
+    int *send = pm->sendBytes + 2 * sim->ranks, *recv = send + sim->ranks;
+    int q;
+
+    if (sim->ranks == 1) {
+        return ok;
+    }
+    for (q = 0; q < sim->ranks; ++q) {
+        send[q] = ok;
+        pm->sendBytes[q] = pm->recvBytes[q] = sizeof(int);
+    }
+    sim->exchange->alltoall(sim, send, pm->sendBytes, recv, pm->recvBytes);
+    for (q = 0; q < sim->ranks; ++q) {
+        ok = ok && recv[q];
+    }
+    return ok;
+}
+
+/*  The slabs depend on the parallel layer, set after pm_init(): on
+    the first step (collective). The processes agree on the outcome
+    before any transform, so that they all fail together.
+*/
+static int
+pm_setup(nbodySim *sim, pmType *pm) {
+    double reach = pm->cut;
+    long rows, cols, n, size;
+    cplx *buf;
+    int b, ok;
+
+    if ((pm->sendBytes = malloc(sizeof(int) * 4 * sim->ranks)) == 0) {
+        return -1;
+    }
+    pm->recvBytes = pm->sendBytes + sim->ranks;
+    slab(pm->my, sim->ranks, sim->rank, &pm->rowLo, &pm->rowHi);
+    slab(pm->mx, sim->ranks, sim->rank, &pm->colLo, &pm->colHi);
+    rows = (long) (pm->rowHi - pm->rowLo) * pm->mx;
+    cols = (long) (pm->colHi - pm->colLo) * pm->my;
+    n = (rows > cols ? rows : cols) + 1;
+    pm->rows = malloc(sizeof(cplx) * (rows + 1));
+    pm->density = malloc(sizeof(cplx) * (cols + 1));
+    pm->work = malloc(sizeof(cplx) * (cols + 1));
+    pm->forceHat = malloc(sizeof(cplx) * (cols + 1));
+    pm->potentialHat = malloc(sizeof(cplx) * (cols + 1));
+    pm->send = malloc(sizeof(cplx) * n);
+    pm->recv = malloc(sizeof(cplx) * n);
+
+    /* node offsets of the short-range pairs (radii are fixed) */
+    for (b = 0; b < sim->bodyCt; ++b) {
+        reach = (2 * R(b) > reach) ? 2 * R(b) : reach;
+    }
+    pm->nearX = (int) ceil(reach / pm->h) + 1;
+    pm->nearY = pm->nearX;
+    pm->nearX = (pm->nearX < pm->nx - 1) ? pm->nearX : pm->nx - 1;
+    pm->nearY = (pm->nearY < pm->ny - 1) ? pm->nearY : pm->ny - 1;
+    size = (long) (pm->nearX + 1) * (pm->nearY + 1);
+    pm->near = malloc(sizeof(cplx) * size);
+    buf = malloc(sizeof(cplx) * size * 2 * sim->ranks);
+
+    ok = (pm->rows && pm->density && pm->work && pm->forceHat && pm->potentialHat &&
+          pm->send && pm->recv && pm->near && buf);
+    if (!all_ok(sim, pm, ok)) {
+        free(buf);
+        return -1;
+    }
+    kernel(sim, pm, 0, pm->forceHat);
+    kernel(sim, pm, 1, pm->potentialHat);
+    near_table(sim, pm, buf);
+    free(buf);
+    return 0;
+}
+
+static int
+pm_forces(nbodySim *sim) {
+    pmType *pm = sim->forceState;
+    double t = now();
+    int b;
+
+    if (pm->failed) {
+        return -1;
+    }
+    if (pm->sendBytes == 0 && pm_setup(sim, pm) < 0) {
+        fprintf(stderr, "Out of memory for the %dx%d mesh\n", pm->mx, pm->my);
+        pm->failed = 1;
+        return -1;
+    }
+    deposit(sim, pm);
+    forward(sim, pm, pm->ny);
+    convolve(sim, pm, pm->forceHat);
+    interpolate(sim, pm, 0);
+    if (sim->diagStep) {
+        convolve(sim, pm, pm->potentialHat);
+        sim->potential += interpolate(sim, pm, 1) / 2;
+        for (b = sim->first; b < sim->last; ++b) {
+            sim->potential -= self_potential(sim, pm, b) / 2;
+        }
+    }
+    pm->meshTime += now() - t;
+
+    t = now();
+    short_range(sim, pm);
+    pm->shortTime += now() - t;
+    pm->steps++;
+    return 0;
+}
+
+static void
+pm_report(nbodySim *sim, FILE *out) {
+    pmType *pm = sim->forceState;
+
+    fprintf(out, "Particle-mesh forces: %dx%d mesh (%dx%d padded), spacing %.3f, cutoff %.3f, %.0f short-range pairs per step, mesh %10.3f seconds, short range %10.3f seconds\n",
+            pm->nx, pm->ny, pm->mx, pm->my, pm->h, pm->cut,
+            pm->steps ? (double) pm->pairs / pm->steps : 0.0, pm->meshTime, pm->shortTime);
+}
+
+static void
+pm_free(nbodySim *sim) {
+    pmType *pm = sim->forceState;
+
+    if (pm == 0) {
+        return;
+    }
+    free(pm->wx);
+    free(pm->wy);
+    free(pm->rows);
+    free(pm->density);
+    free(pm->work);
+    free(pm->forceHat);
+    free(pm->potentialHat);
+    free(pm->send);
+    free(pm->recv);
+    free(pm->sendBytes);
+    free(pm->near);
+    free(pm->head);
+    free(pm->next);
+    free(pm);
+}
+
+const nbodyForces nbody_pm = {
+    "pm", pm_init, pm_forces, pm_free, 0, 0, pm_report, 1
+};
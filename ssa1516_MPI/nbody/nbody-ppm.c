@@ -0,0 +1,177 @@
+/*
+    Graphic output of the N-Body simulation.
+*/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <math.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "nbody-ppm.h"
+
+
+unsigned char *
+map_P6(char *filename, ppmType *ppm) {
+    /* The following is a fast and sloppy way to
+       map a color raw PPM (P6) image file
+    */
+    int fd;
+    unsigned char *p;
+    int maxval;
+
+    /* First, open the file... */
+    if ((fd = open(filename, O_RDWR)) < 0) {
+        return((unsigned char *) 0);
+    }
+
+    /* Read size and map the whole file... */
+    ppm->fsize = lseek(fd, ((off_t) 0), SEEK_END);
+    ppm->map = ((unsigned char *)
+           mmap(0,		/* Put it anywhere */
+                ppm->fsize,	/* Map the whole file */
+                (PROT_READ | PROT_WRITE),	/* Read/write */
+                MAP_SHARED,	/* Not just for me */
+                fd,		/* The file */
+                0));	/* Right from the start */
+    if (ppm->map == ((unsigned char *) - 1)) {
+        close(fd);
+        return((unsigned char *) 0);
+    }
+
+    /* File should now be mapped; read magic value */
+    p = ppm->map;
+    if (*(p++) != 'P') goto ppm_exit;
+    switch (*(p++)) {
+    case '6':
+        break;
+    default:
+        goto ppm_exit;
+    }
+
+#define	Eat_Space \
+	while ((*p == ' ') || \
+	       (*p == '\t') || \
+	       (*p == '\n') || \
+	       (*p == '\r') || \
+	       (*p == '#')) { \
+		if (*p == '#') while (*(++p) != '\n') ; \
+		++p; \
+	}
+
+    Eat_Space;		/* Eat white space and comments */
+
+#define	Get_Number(n) \
+	{ \
+		int charval = *p; \
+ \
+		if ((charval < '0') || (charval > '9')) goto ppm_exit; \
+ \
+		n = (charval - '0'); \
+		charval = *(++p); \
+		while ((charval >= '0') && (charval <= '9')) { \
+			n *= 10; \
+			n += (charval - '0'); \
+			charval = *(++p); \
+		} \
+	}
+
+    Get_Number(ppm->xdim);	/* Get image width */
+
+    Eat_Space;		/* Eat white space and comments */
+    Get_Number(ppm->ydim);	/* Get image width */
+
+    Eat_Space;		/* Eat white space and comments */
+    Get_Number(maxval);	/* Get image max value */
+
+    /* Should be 8-bit binary after one whitespace char... */
+    if (maxval > 255) {
+ppm_exit:
+        close(fd);
+        munmap(ppm->map, ppm->fsize);
+        return((unsigned char *) 0);
+    }
+    if ((*p != ' ') &&
+            (*p != '\t') &&
+            (*p != '\n') &&
+            (*p != '\r')) goto ppm_exit;
+
+    /* Here we are... next byte begins the 24-bit data */
+    return(ppm->image = p + 1);
+
+    /* Notice that we never clean-up after this:
+
+       close(fd);
+       munmap(map, fsize);
+
+       However, this is relatively harmless;
+       they will go away when this process dies.
+    */
+}
+
+#undef	Eat_Space
+#undef	Get_Number
+
+/*  b is the original index of the body, which picks its tint */
+static inline void
+color(const nbodySim *sim, ppmType *ppm, int x, int y, int b) {
+    unsigned char *p = ppm->image + (3 * (x + (y * ppm->xdim)));
+    int tint = ((0xfff * (b + 1)) / (sim->bodyCt + 2));
+
+    p[0] = (tint & 0xf) << 4;
+    p[1] = (tint & 0xf0);
+    p[2] = (tint & 0xf00) >> 4;
+}
+
+static inline void
+black(ppmType *ppm, int x, int y) {
+    unsigned char *p = ppm->image + (3 * (x + (y * ppm->xdim)));
+
+    p[2] = (p[1] = (p[0] = 0));
+}
+
+void
+nbody_display(const nbodySim *sim, ppmType *ppm) {
+    double i, j;
+    int b;
+
+    /* For each pixel */
+    for (j = 0; j < ppm->ydim; ++j) {
+        for (i = 0; i < ppm->xdim; ++i) {
+            int first = sim->bodyCt;
+
+            /* Find the first body covering here */
+            for (b = 0; b < sim->bodyCt; ++b) {
+                double dy = Y(b) - j;
+                double dx = X(b) - i;
+                double d = sqrt(dx * dx + dy * dy);
+
+                if (d <= R(b) + 0.5) {
+                    if (sim->ids == 0) {
+                        /* This is it */
+                        color(sim, ppm, i, j, b);
+                        goto colored;
+                    }
+                    /* reordered: first in the original order */
+                    if (sim->ids[b] < first) {
+                        first = sim->ids[b];
+                    }
+                }
+            }
+            if (first < sim->bodyCt) {
+                color(sim, ppm, i, j, first);
+                goto colored;
+            }
+
+            /* No object -- empty space */
+            black(ppm, i, j);
+
+colored:
+            ;
+        }
+    }
+}
+
+void
+ppm_sync(ppmType *ppm) {
+    msync(ppm->map, ppm->fsize, MS_SYNC);	/* Force write */
+}
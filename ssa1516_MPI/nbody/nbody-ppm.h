@@ -0,0 +1,22 @@
+/*
+    Graphic output of the N-Body simulation.
+*/
+
+#ifndef NBODY_PPM_H
+#define NBODY_PPM_H
+
+#include "nbody.h"
+
+typedef struct {
+    int fsize;              /* size of the mapped file */
+    unsigned char *map;     /* whole file */
+    unsigned char *image;   /* 24-bit pixels, 0 if the file could not be mapped */
+    int xdim;
+    int ydim;
+} ppmType;
+
+unsigned char *map_P6(char *filename, ppmType *ppm);
+void nbody_display(const nbodySim *sim, ppmType *ppm);
+void ppm_sync(ppmType *ppm);
+
+#endif
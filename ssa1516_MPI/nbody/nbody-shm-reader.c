@@ -0,0 +1,115 @@
+/*
+    Reference reader of the positions published with --publish.
+
+    Follows the newest frame and prints one summary line per frame
+    (sequence number, step, centre of the bodies and their bounding
+    box), or all current coordinates with -a. Never blocks the
+    simulation: see nbody-shm.h for the protocol.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "nbody-shm.h"
+
+/*  Copy frame n into buf; 0 if the simulation overwrote it meanwhile */
+static int
+read_frame(shmHeader *h, uint64_t n, shmFrame *buf) {
+    shmFrame *f = SHM_FRAME(h, (n - 1) % h->slots);
+    uint64_t seq = atomic_load_explicit(&f->seq, memory_order_acquire);
+
+    if (seq != 2 * n) {
+        return 0;
+    }
+    memcpy(buf, f, h->frameBytes);
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&f->seq, memory_order_relaxed) == seq;
+}
+
+static void
+print_frame(shmHeader *h, uint64_t n, shmFrame *f, int all) {
+    bodyPositionType *p = SHM_POSITIONS(f);
+    double sx = 0, sy = 0;
+    double minx = h->xdim, miny = h->ydim, maxx = 0, maxy = 0;
+    int b;
+
+    for (b = 0; b < h->bodyCt; ++b) {
+        double x = p[b].x[f->old];
+        double y = p[b].y[f->old];
+
+        if (all) {
+            printf("%10.3f %10.3f\n", x, y);
+        }
+        sx += x;
+        sy += y;
+        minx = x < minx ? x : minx;
+        miny = y < miny ? y : miny;
+        maxx = x > maxx ? x : maxx;
+        maxy = y > maxy ? y : maxy;
+    }
+    printf("frame %8llu step %10lld centre %10.3f %10.3f box %10.3f %10.3f %10.3f %10.3f\n",
+           (unsigned long long) n, (long long) f->step,
+           sx / h->bodyCt, sy / h->bodyCt, minx, miny, maxx, maxy);
+    fflush(stdout);
+}
+
+int
+main(int argc, char **argv) {
+    shmHeader *h = 0;
+    shmFrame *frame;
+    struct stat st;
+    uint64_t seen = 0;
+    int all = 0;
+    int fd;
+
+    if (argc > 1 && strcmp(argv[1], "-a") == 0) {
+        all = 1;
+        --argc;
+        ++argv;
+    }
+    if (argc != 2) {
+        fprintf(stderr, "Usage: nbody-shm-reader [-a] shm_name\n");
+        exit(1);
+    }
+
+    /* wait for the simulation to create and fill in the segment */
+    while ((fd = shm_open(argv[1], O_RDONLY, 0)) < 0 ||
+            fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(shmHeader)) {
+        if (fd >= 0) close(fd);
+        usleep(100000);
+    }
+    h = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED) {
+        perror(argv[1]);
+        exit(1);
+    }
+    while (memcmp(h->magic, NBODY_SHM_MAGIC, 8) != 0) {
+        usleep(10000);
+    }
+    atomic_thread_fence(memory_order_acquire);
+    if (h->version != NBODY_SHM_VERSION) {
+        fprintf(stderr, "%s: unknown version %u\n", argv[1], h->version);
+        exit(1);
+    }
+    frame = malloc(h->frameBytes);
+
+    for (;;) {
+        uint64_t n = atomic_load_explicit(&h->latest, memory_order_acquire);
+
+        if (n != seen && read_frame(h, n, frame)) {
+            print_frame(h, n, frame, all);
+            seen = n;
+        } else if (atomic_load_explicit(&h->closed, memory_order_acquire) &&
+                   n == seen) {
+            break;
+        } else {
+            usleep(1000);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,95 @@
+/*
+    Publishing of N-Body positions in POSIX shared memory.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "nbody-shm.h"
+
+
+/*  Create (or replace) the segment 'name' for frames of sim */
+shmPublisher *
+shm_publish_open(const char *name, const nbodySim *sim, int slots) {
+    shmPublisher *pub = calloc(1, sizeof(shmPublisher));
+    size_t frameBytes = sizeof(shmFrame) + sizeof(bodyPositionType) * sim->bodyCt;
+    int fd;
+
+    if (pub == 0) {
+        return 0;
+    }
+    pub->name = strdup(name);
+    pub->size = sizeof(shmHeader) + frameBytes * slots;
+
+    if ((fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+        perror(name);
+        free(pub->name);
+        free(pub);
+        return 0;
+    }
+    if (ftruncate(fd, pub->size) < 0 ||
+            (pub->header = mmap(0, pub->size, PROT_READ | PROT_WRITE,
+                                MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        perror(name);
+        close(fd);
+        shm_unlink(name);
+        free(pub->name);
+        free(pub);
+        return 0;
+    }
+    close(fd);
+
+    pub->header->version = NBODY_SHM_VERSION;
+    pub->header->slots = slots;
+    pub->header->bodyCt = sim->bodyCt;
+    pub->header->xdim = sim->xdim;
+    pub->header->ydim = sim->ydim;
+    pub->header->frameBytes = frameBytes;
+    atomic_store(&pub->header->latest, 0);
+    atomic_store(&pub->header->closed, 0);
+    /* readers check the magic last */
+    atomic_thread_fence(memory_order_release);
+    memcpy(pub->header->magic, NBODY_SHM_MAGIC, 8);
+    return pub;
+}
+
+/*  Publish the current positions: one copy of the position array,
+    in the original order if the bodies were reordered */
+void
+shm_publish(shmPublisher *pub, const nbodySim *sim) {
+    uint64_t n = ++pub->frames;
+    shmFrame *f = SHM_FRAME(pub->header, (n - 1) % pub->header->slots);
+
+    atomic_store_explicit(&f->seq, 2 * n - 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    f->step = sim->step;
+    f->old = sim->old;
+    if (sim->ids) {
+        bodyPositionType *to = SHM_POSITIONS(f);
+        int b;
+
+        for (b = 0; b < sim->bodyCt; ++b) {
+            to[sim->ids[b]] = sim->positions[b];
+        }
+    } else {
+        memcpy(SHM_POSITIONS(f), sim->positions, sizeof(bodyPositionType) * sim->bodyCt);
+    }
+    atomic_store_explicit(&f->seq, 2 * n, memory_order_release);
+    atomic_store_explicit(&pub->header->latest, n, memory_order_release);
+}
+
+/*  Tell readers that no more frames will come and remove the name */
+void
+shm_publish_close(shmPublisher *pub) {
+    if (pub == 0) {
+        return;
+    }
+    atomic_store_explicit(&pub->header->closed, 1, memory_order_release);
+    munmap(pub->header, pub->size);
+    shm_unlink(pub->name);
+    free(pub->name);
+    free(pub);
+}
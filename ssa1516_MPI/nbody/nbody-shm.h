@@ -0,0 +1,59 @@
+/*
+    Publishing of N-Body positions in POSIX shared memory.
+
+    The segment holds a shmHeader followed by a ring of 'slots'
+    frames. A frame is a shmFrame header plus a verbatim copy of the
+    bodyPositionType array; the current coordinates are x[old] and
+    y[old]. Frames are numbered from 1 and frame n lives in slot
+    (n - 1) % slots. Readers never lock: a slot's seq is odd while
+    the simulation writes it and 2n once frame n is complete, so a
+    reader copies the frame out and accepts it only if seq was 2n
+    both before and after the copy (see nbody-shm-reader.c).
+*/
+
+#ifndef NBODY_SHM_H
+#define NBODY_SHM_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include "nbody.h"
+
+#define NBODY_SHM_MAGIC     "NBODYSHM"
+#define NBODY_SHM_VERSION   1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t slots;             /* frames in the ring */
+    int32_t bodyCt;
+    int32_t xdim;
+    int32_t ydim;
+    uint32_t frameBytes;        /* size of a frame, header included */
+    _Atomic uint64_t latest;    /* last complete frame, 0: none yet */
+    _Atomic uint32_t closed;    /* the simulation has finished */
+    uint32_t pad;
+} shmHeader;
+
+typedef struct {
+    _Atomic uint64_t seq;       /* 2n when frame n is complete, odd while written */
+    int64_t step;               /* simulation step of the snapshot */
+    int32_t old;                /* which of x[2]/y[2] is current */
+    int32_t pad[3];
+} shmFrame;
+
+#define SHM_FRAME(h, slot) \
+    ((shmFrame *) ((char *) (h) + sizeof(shmHeader) + (size_t) (slot) * (h)->frameBytes))
+#define SHM_POSITIONS(f)    ((bodyPositionType *) ((f) + 1))
+
+typedef struct {
+    char *name;
+    shmHeader *header;
+    size_t size;
+    uint64_t frames;            /* frames published so far */
+} shmPublisher;
+
+shmPublisher *shm_publish_open(const char *name, const nbodySim *sim, int slots);
+void shm_publish(shmPublisher *pub, const nbodySim *sim);
+void shm_publish_close(shmPublisher *pub);
+
+#endif
@@ -0,0 +1,112 @@
+/*
+    Fork-join thread pool for the N-Body kernels.
+
+    The workers live as long as the pool and meet the caller at a
+    barrier before and after every task, so running a task costs
+    two barrier crossings instead of thread creation.
+*/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "nbody-threads.h"
+
+struct threadPool {
+    int count;
+    pthread_t *threads;
+    pthread_barrier_t start;
+    pthread_barrier_t done;
+    poolTask task;              /* 0 tells the workers to quit */
+    void *arg;
+};
+
+typedef struct {
+    threadPool *pool;
+    int id;
+} workerType;
+
+static void *
+worker(void *p) {
+    workerType w = *(workerType *) p;
+    threadPool *pool = w.pool;
+
+    free(p);
+    for (;;) {
+        pthread_barrier_wait(&pool->start);
+        if (pool->task == 0) {
+            break;
+        }
+        pool->task(pool->arg, w.id, pool->count);
+        pthread_barrier_wait(&pool->done);
+    }
+    return 0;
+}
+
+int
+nbody_cores(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return n > 0 ? (int) n : 1;
+}
+
+/*  Pool of 'threads' threads, the caller included (0: one per core) */
+threadPool *
+pool_create(int threads) {
+    threadPool *pool = calloc(1, sizeof(threadPool));
+    int i;
+
+    if (pool == 0) {
+        return 0;
+    }
+    pool->count = threads > 0 ? threads : nbody_cores();
+    pool->threads = malloc(sizeof(pthread_t) * pool->count);
+    pthread_barrier_init(&pool->start, 0, pool->count);
+    pthread_barrier_init(&pool->done, 0, pool->count);
+    for (i = 1; i < pool->count; ++i) {
+        workerType *w = malloc(sizeof(workerType));
+
+        w->pool = pool;
+        w->id = i;
+        pthread_create(&pool->threads[i], 0, worker, w);
+    }
+    return pool;
+}
+
+int
+pool_size(const threadPool *pool) {
+    return pool->count;
+}
+
+/*  Run task on every thread of the pool and wait for all of them */
+void
+pool_run(threadPool *pool, poolTask task, void *arg) {
+    if (pool->count == 1) {
+        task(arg, 0, 1);
+        return;
+    }
+    pool->task = task;
+    pool->arg = arg;
+    pthread_barrier_wait(&pool->start);
+    task(arg, 0, pool->count);
+    pthread_barrier_wait(&pool->done);
+}
+
+void
+pool_destroy(threadPool *pool) {
+    int i;
+
+    if (pool == 0) {
+        return;
+    }
+    if (pool->count > 1) {
+        pool->task = 0;
+        pthread_barrier_wait(&pool->start);
+        for (i = 1; i < pool->count; ++i) {
+            pthread_join(pool->threads[i], 0);
+        }
+    }
+    pthread_barrier_destroy(&pool->start);
+    pthread_barrier_destroy(&pool->done);
+    free(pool->threads);
+    free(pool);
+}
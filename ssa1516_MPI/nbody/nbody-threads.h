@@ -0,0 +1,19 @@
+/*
+    Fork-join thread pool for the N-Body kernels.
+*/
+
+#ifndef NBODY_THREADS_H
+#define NBODY_THREADS_H
+
+typedef struct threadPool threadPool;
+
+/*  Work of thread id out of count; id 0 is the calling thread */
+typedef void (*poolTask)(void *arg, int id, int count);
+
+int nbody_cores(void);
+threadPool *pool_create(int threads);
+int pool_size(const threadPool *pool);
+void pool_run(threadPool *pool, poolTask task, void *arg);
+void pool_destroy(threadPool *pool);
+
+#endif
@@ -0,0 +1,306 @@
+/*
+    Cache-blocked direct sum (--forces=direct-tiled).
+
+    The pair triangle is cut into square tiles of --tile bodies
+    (default: two tiles in the L1 data cache). A row of tiles is
+    copied into a compact buffer of positions, masses, radii and
+    forces and stays in cache while the tiles right of it stream
+    through a second buffer; the row forces are kept in registers over
+    a tile, the column forces are written back once per tile pair and
+    the row forces once per row of tiles. Every body still sees its
+    pairs in the order of direct, so the forces are the same bits, but
+    a body is read from memory once per row of tiles instead of once
+    per body before it.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "nbody.h"
+#include "nbody-kernel.h"
+
+#define TILE_BYTES      (6 * sizeof(double))    /* per body of a tile buffer */
+#define TILE_MIN        64
+#define TILE_DEFAULT    256     /* without a known L1 size */
+
+static const int tileWidths[] = { 128, 256, 512, 1024, 2048, 4096, 0 };
+
+typedef struct {
+    double *x, *y;
+    double *m, *r;
+    double *xf, *yf;
+    int lo;                     /* body in the first place */
+} tileBuffer;
+
+typedef struct {
+    int tile;                   /* bodies per tile */
+    tileBuffer rows;            /* the row of tiles being done */
+    tileBuffer cols;            /* a tile right of it */
+    long tilePairs;             /* tile pairs visited */
+    double copied;              /* bytes loaded into and flushed from the buffers */
+    long steps;
+} tiledType;
+
+/*  Two tiles in the L1 data cache */
+static int
+default_tile(int bodyCt) {
+    long l1 = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+    int tile = l1 > 0 ? (int) (l1 / 2 / TILE_BYTES) : TILE_DEFAULT;
+
+    if (tile < TILE_MIN) {
+        tile = TILE_MIN;
+    }
+    return tile < bodyCt ? tile : bodyCt;
+}
+
+static int
+buffer_alloc(tileBuffer *buf, int tile) {
+    double *all = malloc(TILE_BYTES * tile);
+
+    if (all == 0) {
+        return -1;
+    }
+    buf->x = all;
+    buf->y = all + tile;
+    buf->m = all + 2 * tile;
+    buf->r = all + 3 * tile;
+    buf->xf = all + 4 * tile;
+    buf->yf = all + 5 * tile;
+    return 0;
+}
+
+/*  Copy bodies [lo, hi) into buf; with 'forces', their forces too */
+static void
+buffer_load(nbodySim *sim, tileBuffer *buf, int lo, int hi, int forces) {
+    tiledType *td = sim->forceState;
+    int b;
+
+    td->copied += (double) (hi - lo) * (forces ? 6 : 4) * sizeof(double);
+    buf->lo = lo;
+    for (b = lo; b < hi; ++b) {
+        buf->x[b - lo] = X(b);
+        buf->y[b - lo] = Y(b);
+        buf->m[b - lo] = M(b);
+        buf->r[b - lo] = R(b);
+    }
+    if (forces) {
+        for (b = lo; b < hi; ++b) {
+            buf->xf[b - lo] = XF(b);
+            buf->yf[b - lo] = YF(b);
+        }
+    }
+}
+
+static void
+buffer_flush(nbodySim *sim, const tileBuffer *buf, int hi) {
+    tiledType *td = sim->forceState;
+    int b;
+
+    td->copied += (double) (hi - buf->lo) * 2 * sizeof(double);
+    for (b = buf->lo; b < hi; ++b) {
+        XF(b) = buf->xf[b - buf->lo];
+        YF(b) = buf->yf[b - buf->lo];
+    }
+}
+
+/*  Pairs (b, c), b < c, of rows [rowLo, rowHi) of 'rows' x columns
+    [colLo, colHi) of 'cols' (which may be the same buffer) that fall
+    in [pairLo, pairHi), whose ends are (startB, startC) and (endB, endC)
+*/
+static inline double
+tile_block(nbodySim *sim, tileBuffer *rows, int rowLo, int rowHi,
+           tileBuffer *cols, int colLo, int colHi, int endB, int endC, const int energy) {
+    double potential = 0;
+    int b, c;
+
+    for (b = rowLo; b < rowHi; ++b) {
+        int i = b - rows->lo;
+        int lo = (b == sim->startB) ? sim->startC : b + 1;
+        int hi = (b == endB) ? endC : sim->bodyCt;
+        double xb = rows->x[i], yb = rows->y[i];
+        double mb = rows->m[i], rb = rows->r[i];
+        double fx = rows->xf[i], fy = rows->yf[i];
+
+        if (lo < colLo) {
+            lo = colLo;
+        }
+        if (hi > colHi) {
+            hi = colHi;
+        }
+        for (c = lo; c < hi; ++c) {
+            int j = c - cols->lo;
+            double xf, yf;
+
+            potential -= pair_force(cols->x[j] - xb, cols->y[j] - yb, mb * cols->m[j], rb + cols->r[j],
+                                    sim->gravity, &xf, &yf, energy);
+            fx += xf;
+            fy += yf;
+            cols->xf[j] -= xf;
+            cols->yf[j] -= yf;
+        }
+        rows->xf[i] = fx;
+        rows->yf[i] = fy;
+    }
+    return potential;
+}
+
+/*  Force of columns [colLo, colHi) of 'cols' on rows [rowLo, rowHi);
+    a pair is evaluated from its lower index, as in direct_force()
+*/
+static inline double
+tile_owner_block(nbodySim *sim, tileBuffer *rows, int rowLo, int rowHi,
+                 const tileBuffer *cols, int colLo, int colHi, const int energy) {
+    double potential = 0;
+    int b, c;
+
+    for (b = rowLo; b < rowHi; ++b) {
+        int i = b - rows->lo;
+        double xb = rows->x[i], yb = rows->y[i];
+        double mb = rows->m[i], rb = rows->r[i];
+        double fx = rows->xf[i], fy = rows->yf[i];
+
+        for (c = colLo; c < colHi; ++c) {
+            int j = c - cols->lo;
+            double xf, yf;
+
+            if (c > b) {
+                potential -= pair_force(cols->x[j] - xb, cols->y[j] - yb, mb * cols->m[j], rb + cols->r[j],
+                                        sim->gravity, &xf, &yf, energy) / 2;
+                fx += xf;
+                fy += yf;
+            } else if (c < b) {
+                potential -= pair_force(xb - cols->x[j], yb - cols->y[j], cols->m[j] * mb, cols->r[j] + rb,
+                                        sim->gravity, &xf, &yf, energy) / 2;
+                fx -= xf;
+                fy -= yf;
+            }
+        }
+        rows->xf[i] = fx;
+        rows->yf[i] = fy;
+    }
+    return potential;
+}
+
+/*  Owner-computes: the tiles of [first, last) against all the column
+    tiles in order
+*/
+static void
+tiled_owner(nbodySim *sim) {
+    tiledType *td = sim->forceState;
+    int tile = td->tile;
+    int tiles = (sim->bodyCt + tile - 1) / tile;
+    int rowLo, J;
+
+    for (rowLo = sim->first; rowLo < sim->last; rowLo += tile) {
+        int rowHi = (rowLo + tile < sim->last) ? rowLo + tile : sim->last;
+
+        buffer_load(sim, &td->rows, rowLo, rowHi, 1);
+        for (J = 0; J < tiles; ++J) {
+            int colLo = J * tile;
+            int colHi = (colLo + tile < sim->bodyCt) ? colLo + tile : sim->bodyCt;
+
+            buffer_load(sim, &td->cols, colLo, colHi, 0);
+            if (sim->diagStep) {
+                sim->potential += tile_owner_block(sim, &td->rows, rowLo, rowHi, &td->cols, colLo, colHi, 1);
+            } else {
+                tile_owner_block(sim, &td->rows, rowLo, rowHi, &td->cols, colLo, colHi, 0);
+            }
+            td->tilePairs++;
+        }
+        buffer_flush(sim, &td->rows, rowHi);
+    }
+}
+
+/*  Rows of tiles I in order, and within one the diagonal tile, then
+    the tiles J > I in order: the same order of the pairs of every
+    body as direct_range()
+*/
+static int
+tiled_forces(nbodySim *sim) {
+    tiledType *td = sim->forceState;
+    int tile = td->tile;
+    int tiles = (sim->bodyCt + tile - 1) / tile;
+    int endB, endC, I, J;
+
+    td->steps++;
+    if (sim->owner) {
+        tiled_owner(sim);
+        return 0;
+    }
+    if (sim->pairLo >= sim->pairHi) {
+        return 0;
+    }
+    nbody_pair_start(sim->bodyCt, sim->pairHi, &endB, &endC);
+    for (I = sim->startB / tile; I <= endB / tile && I < tiles; ++I) {
+        int rowLo = (I * tile > sim->startB) ? I * tile : sim->startB;
+        int tileHi = ((I + 1) * tile < sim->bodyCt) ? (I + 1) * tile : sim->bodyCt;
+        int rowHi = (tileHi < endB + 1) ? tileHi : endB + 1;
+
+        /* the diagonal tile is its own column tile */
+        buffer_load(sim, &td->rows, rowLo, tileHi, 1);
+        if (sim->diagStep) {
+            sim->potential += tile_block(sim, &td->rows, rowLo, rowHi, &td->rows, rowLo, tileHi, endB, endC, 1);
+        } else {
+            tile_block(sim, &td->rows, rowLo, rowHi, &td->rows, rowLo, tileHi, endB, endC, 0);
+        }
+        td->tilePairs++;
+
+        for (J = I + 1; J < tiles; ++J) {
+            int colLo = J * tile;
+            int colHi = (colLo + tile < sim->bodyCt) ? colLo + tile : sim->bodyCt;
+
+            buffer_load(sim, &td->cols, colLo, colHi, 1);
+            if (sim->diagStep) {
+                sim->potential += tile_block(sim, &td->rows, rowLo, rowHi, &td->cols, colLo, colHi, endB, endC, 1);
+            } else {
+                tile_block(sim, &td->rows, rowLo, rowHi, &td->cols, colLo, colHi, endB, endC, 0);
+            }
+            buffer_flush(sim, &td->cols, colHi);
+            td->tilePairs++;
+        }
+        buffer_flush(sim, &td->rows, tileHi);
+    }
+    return 0;
+}
+
+static int
+tiled_init(nbodySim *sim) {
+    tiledType *td = calloc(1, sizeof(tiledType));
+
+    if (td == 0) {
+        return -1;
+    }
+    sim->forceState = td;
+    td->tile = sim->p.tile > 0 ? sim->p.tile : default_tile(sim->bodyCt);
+    if (td->tile > sim->bodyCt) {
+        td->tile = sim->bodyCt > 0 ? sim->bodyCt : 1;
+    }
+    /* on failure tiled_free() takes what was allocated (cols.x is still 0) */
+    if (buffer_alloc(&td->rows, td->tile) < 0 || buffer_alloc(&td->cols, td->tile) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static void
+tiled_report(nbodySim *sim, FILE *out) {
+    tiledType *td = sim->forceState;
+
+    fprintf(out, "Tiled forces: tiles of %d bodies, %ld tile pairs, %.1f MB through the tile buffers per step\n",
+            td->tile, td->tilePairs, td->steps ? td->copied / td->steps / 1e6 : 0.0);
+}
+
+static void
+tiled_free(nbodySim *sim) {
+    tiledType *td = sim->forceState;
+
+    if (td) {
+        free(td->rows.x);
+        free(td->cols.x);
+        free(td);
+    }
+}
+
+const nbodyForces nbody_direct_tiled = {
+    "direct-tiled", tiled_init, tiled_forces, tiled_free, 0, tileWidths, tiled_report, 0, 1
+};
@@ -0,0 +1,389 @@
+/*
+    Barnes-Hut quadtree and the tree force backend.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "nbody-tree.h"
+
+#define STACK       (4 * TREE_DEPTH + 4)
+
+static void
+swap_points(quadTree *t, int i, int j) {
+    treePoint p = t->points[i];
+    int k = t->index[i];
+
+    t->points[i] = t->points[j];
+    t->index[i] = t->index[j];
+    t->points[j] = p;
+    t->index[j] = k;
+}
+
+/*  Move the points of [first, first + count) with coordinate below
+    mid first; returns how many they are
+*/
+static int
+partition(quadTree *t, int first, int count, int axis, double mid) {
+    int i = first, j = first + count - 1;
+
+    while (i <= j) {
+        double v = axis ? t->points[i].y : t->points[i].x;
+
+        if (v < mid) {
+            ++i;
+        } else {
+            swap_points(t, i, j--);
+        }
+    }
+    return i - first;
+}
+
+static int
+new_nodes(quadTree *t, int n) {
+    if (t->nodeCt + n > t->nodeCap) {
+        int cap = t->nodeCap ? 2 * t->nodeCap : 64;
+        treeNode *nodes;
+
+        while (cap < t->nodeCt + n) {
+            cap *= 2;
+        }
+        if ((nodes = realloc(t->nodes, sizeof(treeNode) * cap)) == 0) {
+            return -1;
+        }
+        t->nodes = nodes;
+        t->nodeCap = cap;
+    }
+    t->nodeCt += n;
+    return t->nodeCt - n;
+}
+
+/*  Split node n (nodes may move, so by index) */
+static int
+build(quadTree *t, int n, int depth) {
+    treeNode *node = &t->nodes[n];
+    double x0 = node->x0, y0 = node->y0, half = node->size / 2;
+    int first = node->first, count = node->count;
+    int low, lowLeft, highLeft, child, q;
+    double mass = 0, mx = 0, my = 0;
+
+    if (count <= TREE_LEAF || depth >= TREE_DEPTH) {
+        for (q = first; q < first + count; ++q) {
+            mass += t->points[q].mass;
+            mx += t->points[q].mass * t->points[q].x;
+            my += t->points[q].mass * t->points[q].y;
+        }
+        node->child = -1;
+    } else {
+        /* children in the order (low y: low x, high x), (high y: ...) */
+        low = partition(t, first, count, 1, y0 + half);
+        lowLeft = partition(t, first, low, 0, x0 + half);
+        highLeft = partition(t, first + low, count - low, 0, x0 + half);
+        if ((child = new_nodes(t, 4)) < 0) {
+            return -1;
+        }
+        node = &t->nodes[n];
+        node->child = child;
+        for (q = 0; q < 4; ++q) {
+            treeNode *c = &t->nodes[child + q];
+
+            c->x0 = x0 + ((q & 1) ? half : 0);
+            c->y0 = y0 + ((q & 2) ? half : 0);
+            c->size = half;
+        }
+        t->nodes[child].first = first;
+        t->nodes[child].count = lowLeft;
+        t->nodes[child + 1].first = first + lowLeft;
+        t->nodes[child + 1].count = low - lowLeft;
+        t->nodes[child + 2].first = first + low;
+        t->nodes[child + 2].count = highLeft;
+        t->nodes[child + 3].first = first + low + highLeft;
+        t->nodes[child + 3].count = count - low - highLeft;
+        for (q = 0; q < 4; ++q) {
+            if (build(t, child + q, depth + 1) < 0) {
+                return -1;
+            }
+            mass += t->nodes[child + q].mass;
+            mx += t->nodes[child + q].mass * t->nodes[child + q].cx;
+            my += t->nodes[child + q].mass * t->nodes[child + q].cy;
+        }
+        node = &t->nodes[n];
+    }
+    node->mass = mass;
+    node->cx = mass > 0 ? mx / mass : x0 + half;
+    node->cy = mass > 0 ? my / mass : y0 + half;
+    return 0;
+}
+
+quadTree *
+tree_build(const treePoint *points, int count) {
+    quadTree *t = calloc(1, sizeof(quadTree));
+    double xlo = 0, xhi = 1, ylo = 0, yhi = 1;
+    treeNode *root;
+    int i;
+
+    if (t == 0) {
+        return 0;
+    }
+    t->count = count;
+    t->points = malloc(sizeof(treePoint) * (count ? count : 1));
+    t->index = malloc(sizeof(int) * (count ? count : 1));
+    if (t->points == 0 || t->index == 0 || new_nodes(t, 1) < 0) {
+        tree_free(t);
+        return 0;
+    }
+    memcpy(t->points, points, sizeof(treePoint) * count);
+    for (i = 0; i < count; ++i) {
+        t->index[i] = i;
+        if (i == 0 || points[i].x < xlo) xlo = points[i].x;
+        if (i == 0 || points[i].x > xhi) xhi = points[i].x;
+        if (i == 0 || points[i].y < ylo) ylo = points[i].y;
+        if (i == 0 || points[i].y > yhi) yhi = points[i].y;
+    }
+
+    root = &t->nodes[0];
+    root->x0 = xlo;
+    root->y0 = ylo;
+    /* a square holding every point, upper edges included */
+    root->size = ((xhi - xlo > yhi - ylo) ? xhi - xlo : yhi - ylo) * (1 + 1e-9) + 1e-9;
+    root->first = 0;
+    root->count = count;
+    if (build(t, 0, 0) < 0) {
+        tree_free(t);
+        return 0;
+    }
+    return t;
+}
+
+void
+tree_free(quadTree *tree) {
+    if (tree) {
+        free(tree->points);
+        free(tree->index);
+        free(tree->nodes);
+        free(tree);
+    }
+}
+
+/*  Pull of point p on body b, with the clamping of the direct sum */
+static inline void
+pull(const treePoint *b, const treePoint *p, double gravity, double *xf, double *yf, double *potential) {
+    double dx = p->x - b->x;
+    double dy = p->y - b->y;
+    double dsqr = dx * dx + dy * dy;
+    double mindist = b->radius + p->radius;
+    double mindsqr = mindist * mindist;
+    double forced = ((dsqr < mindsqr) ? mindsqr : dsqr);
+    double force = b->mass * p->mass * gravity / forced;
+    double d = sqrt(dsqr);
+
+    if (d > 0) {
+        *xf += force * dx / d;
+        *yf += force * dy / d;
+    } else {
+        /* as atan2(0, 0) in the direct sum */
+        *xf += force;
+    }
+    *potential -= force * ((dsqr < mindsqr) ? (2 * mindist - d) : d);
+}
+
+/*  Force on b of every point but the input point self (-1: none) */
+void
+tree_force(const quadTree *tree, const treePoint *b, int self, double theta, double gravity,
+           double *xf, double *yf, double *potential, long *work) {
+    int stack[STACK];
+    int top = 0;
+
+    if (tree->count == 0) {
+        return;
+    }
+    stack[top++] = 0;
+    while (top > 0) {
+        const treeNode *n = &tree->nodes[stack[--top]];
+
+        if (n->mass <= 0) {
+            continue;
+        }
+        if (n->child < 0) {
+            int q;
+
+            for (q = n->first; q < n->first + n->count; ++q) {
+                if (tree->index[q] != self) {
+                    pull(b, &tree->points[q], gravity, xf, yf, potential);
+                    ++*work;
+                }
+            }
+        } else {
+            double dx = n->cx - b->x;
+            double dy = n->cy - b->y;
+            int inside = (b->x >= n->x0 && b->x < n->x0 + n->size &&
+                          b->y >= n->y0 && b->y < n->y0 + n->size);
+
+            if (!inside && n->size * n->size < theta * theta * (dx * dx + dy * dy)) {
+                treePoint cell = { n->cx, n->cy, n->mass, 0 };
+
+                pull(b, &cell, gravity, xf, yf, potential);
+                ++*work;
+            } else {
+                int q;
+
+                for (q = 3; q >= 0; --q) {
+                    stack[top++] = n->child + q;
+                }
+            }
+        }
+    }
+}
+
+static int
+append(treePoint **out, int *count, int *cap, const treePoint *p) {
+    if (*count == *cap) {
+        int size = *cap ? 2 * *cap : 256;
+        treePoint *more = realloc(*out, sizeof(treePoint) * size);
+
+        if (more == 0) {
+            return -1;
+        }
+        *out = more;
+        *cap = size;
+    }
+    (*out)[(*count)++] = *p;
+    return 0;
+}
+
+/*  Append to *out what bodies anywhere in box {xlo, xhi, ylo, yhi}
+    need of the tree: the cells that every such body would accept
+    as a whole, and the points of the leaves some would open
+*/
+int
+tree_essential(const quadTree *tree, const double box[4], double theta,
+               treePoint **out, int *count, int *cap) {
+    int stack[STACK];
+    int top = 0;
+
+    if (tree->count == 0) {
+        return 0;
+    }
+    stack[top++] = 0;
+    while (top > 0) {
+        const treeNode *n = &tree->nodes[stack[--top]];
+        double dx, dy;
+        int q;
+
+        if (n->mass <= 0) {
+            continue;
+        }
+        /* distance from the centre of mass to the box */
+        dx = (n->cx < box[0]) ? box[0] - n->cx : (n->cx > box[1]) ? n->cx - box[1] : 0;
+        dy = (n->cy < box[2]) ? box[2] - n->cy : (n->cy > box[3]) ? n->cy - box[3] : 0;
+        if ((n->x0 > box[1] || n->x0 + n->size < box[0] ||
+                 n->y0 > box[3] || n->y0 + n->size < box[2]) &&
+                n->size * n->size < theta * theta * (dx * dx + dy * dy)) {
+            treePoint cell = { n->cx, n->cy, n->mass, 0 };
+
+            if (append(out, count, cap, &cell) < 0) {
+                return -1;
+            }
+        } else if (n->child < 0) {
+            for (q = n->first; q < n->first + n->count; ++q) {
+                if (append(out, count, cap, &tree->points[q]) < 0) {
+                    return -1;
+                }
+            }
+        } else {
+            for (q = 3; q >= 0; --q) {
+                stack[top++] = n->child + q;
+            }
+        }
+    }
+    return 0;
+}
+
+
+/*  Tree backend: forces on bodies [first, last) from every body this
+    process holds (all of them, or its own plus what the parallel layer
+    imports), O(N log N).
+*/
+static int
+tree_init(nbodySim *sim) {
+    if (sim->work == 0 && (sim->work = malloc(sizeof(float) * sim->bodyCt)) == 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int
+tree_forces(nbodySim *sim) {
+    int distributed = (sim->exchange && sim->exchange->essential);
+    int lo = distributed ? sim->first : 0;
+    int hi = distributed ? sim->last : sim->bodyCt;
+    int own = hi - lo;
+    treePoint *points = malloc(sizeof(treePoint) * (own ? own : 1));
+    treePoint *remote = 0;
+    quadTree *tree = 0;
+    int count = own;
+    int b;
+
+    for (b = lo; points && b < hi; ++b) {
+        treePoint *p = &points[b - lo];
+
+        p->x = X(b);
+        p->y = Y(b);
+        p->mass = M(b);
+        p->radius = R(b);
+    }
+    if (points) {
+        tree = tree_build(points, own);
+    }
+    if (distributed) {
+        /* collective: taken part in without a tree too, sending nothing */
+        int n = sim->exchange->essential(sim, tree, &remote);
+
+        if (tree && n > 0) {
+            treePoint *all = realloc(points, sizeof(treePoint) * (own + n));
+
+            tree_free(tree);
+            tree = 0;
+            if (all) {
+                points = all;
+                memcpy(points + own, remote, sizeof(treePoint) * n);
+                count = own + n;
+                tree = tree_build(points, count);
+            }
+        }
+        free(remote);
+    }
+    if (tree == 0) {
+        fprintf(stderr, "Out of memory for the tree of %d bodies\n", count);
+        free(points);
+        return -1;
+    }
+
+    for (b = sim->first; b < sim->last; ++b) {
+        double xf = 0, yf = 0, potential = 0;
+        long work = 0;
+
+        tree_force(tree, &points[b - lo], b - lo, sim->p.theta, sim->gravity, &xf, &yf, &potential, &work);
+        XF(b) += xf;
+        YF(b) += yf;
+        sim->work[b] = work;
+        if (sim->diagStep) {
+            /* every pair is seen from both ends */
+            sim->potential += potential / 2;
+        }
+    }
+    tree_free(tree);
+    free(points);
+    return 0;
+}
+
+static void
+tree_free_state(nbodySim *sim) {
+    free(sim->work);
+    sim->work = 0;
+}
+
+const nbodyForces nbody_tree = {
+    "tree", tree_init, tree_forces, tree_free_state, 0, 0, 0, 1, 1
+};
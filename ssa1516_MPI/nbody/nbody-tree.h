@@ -0,0 +1,53 @@
+/*
+    Barnes-Hut quadtree.
+
+    A cell whose size seen from a body is below the opening angle
+    theta acts as one point at its centre of mass; closer cells are
+    opened down to leaves of at most TREE_LEAF points, whose forces
+    are the exact pair forces. Points with a radius are bodies; the
+    radius-less ones stand for cells of another process.
+*/
+
+#ifndef NBODY_TREE_H
+#define NBODY_TREE_H
+
+#include "nbody.h"
+
+#define TREE_LEAF       8
+#define TREE_DEPTH      48      /* coincident points stop splitting here */
+
+struct treePoint {
+    double x;
+    double y;
+    double mass;
+    double radius;      /* 0 for a cell of another process */
+    int id;             /* original index of the body (cell backend only) */
+};
+
+typedef struct {
+    double cx, cy;      /* centre of mass */
+    double mass;
+    double x0, y0;      /* lower corner of the square cell */
+    double size;
+    int child;          /* first of four consecutive children, -1 for a leaf */
+    int first;          /* points [first, first + count) */
+    int count;
+} treeNode;
+
+struct quadTree {
+    treePoint *points;  /* sorted so that every cell is contiguous */
+    int *index;         /* position of every sorted point in the input */
+    int count;
+    treeNode *nodes;
+    int nodeCt;
+    int nodeCap;
+};
+
+quadTree *tree_build(const treePoint *points, int count);
+void tree_free(quadTree *tree);
+void tree_force(const quadTree *tree, const treePoint *b, int self, double theta, double gravity,
+                double *xf, double *yf, double *potential, long *work);
+int tree_essential(const quadTree *tree, const double box[4], double theta,
+                   treePoint **out, int *count, int *cap);
+
+#endif
@@ -0,0 +1,334 @@
+/*
+    Autotuning of the N-Body force backend and its knobs.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "nbody-tune.h"
+#include "nbody-threads.h"
+
+#define MAXLINE     512
+#define MAXCANDS    32
+
+static int
+cache_path(char *path, size_t size) {
+    const char *env = getenv("NBODY_TUNE_CACHE");
+    const char *home = getenv("HOME");
+
+    if (env && *env) {
+        snprintf(path, size, "%s", env);
+    } else if (home && *home) {
+        snprintf(path, size, "%s/.nbody-tune", home);
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static void
+host_name(char *host, size_t size) {
+    if (gethostname(host, size) != 0) {
+        snprintf(host, size, "localhost");
+    }
+    host[size - 1] = 0;
+}
+
+/*  Power-of-two range [lo, 2 lo) holding bodyCt */
+static int
+range_lo(int bodyCt) {
+    int lo = 1;
+
+    while (lo <= bodyCt / 2) {
+        lo *= 2;
+    }
+    return lo;
+}
+
+/*  Parse a cache line; 1 if it is an entry for key */
+static int
+parse_entry(const char *line, const tuneKey *key, tuneChoice *choice) {
+    char host[256], myhost[256], program[64];
+    int nlo, nhi, cores, ranks, rpn;
+    tuneChoice c;
+
+    if (line[0] == '#' ||
+            sscanf(line, "%255s %63s %d %d %d %d %d %31s %d %d %31s %lf",
+                   host, program, &nlo, &nhi, &cores, &ranks, &rpn,
+                   c.forces, &c.threads, &c.tile, c.exchange, &c.secs) != 12) {
+        return 0;
+    }
+    host_name(myhost, sizeof(myhost));
+    if (strcmp(host, myhost) != 0 || strcmp(program, key->program) != 0 ||
+            key->bodyCt < nlo || key->bodyCt >= nhi || cores != key->cores ||
+            ranks != key->ranks || rpn != key->ranksPerNode) {
+        return 0;
+    }
+    if (choice) {
+        *choice = c;
+    }
+    return 1;
+}
+
+/*  Cached choice for key: 0 if found, -1 if none (or its backend is
+    not part of this build)
+*/
+int
+tune_lookup(const tuneKey *key, tuneChoice *choice) {
+    char path[MAXLINE], line[MAXLINE];
+    tuneChoice c;
+    int found = 0;
+    FILE *in;
+
+    if (cache_path(path, sizeof(path)) < 0 || (in = fopen(path, "r")) == 0) {
+        return -1;
+    }
+    /* later entries win */
+    while (fgets(line, sizeof(line), in)) {
+        if (parse_entry(line, key, &c) && nbody_find_forces(c.forces)) {
+            *choice = c;
+            found = 1;
+        }
+    }
+    fclose(in);
+    return found ? 0 : -1;
+}
+
+/*  Replace the entry of key in the cache with choice */
+int
+tune_store(const tuneKey *key, const tuneChoice *choice) {
+    char path[MAXLINE], tmp[MAXLINE + 32], line[MAXLINE], host[256];
+    int lo = range_lo(key->bodyCt);
+    FILE *in, *out;
+
+    if (cache_path(path, sizeof(path)) < 0) {
+        return -1;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.%ld", path, (long) getpid());
+    if ((out = fopen(tmp, "w")) == 0) {
+        perror(tmp);
+        return -1;
+    }
+    if ((in = fopen(path, "r")) != 0) {
+        while (fgets(line, sizeof(line), in)) {
+            if (!parse_entry(line, key, 0)) {
+                fputs(line, out);
+            }
+        }
+        fclose(in);
+    } else {
+        fprintf(out, "# host program nlo nhi cores ranks ranks_per_node forces threads tile exchange secs\n");
+    }
+    host_name(host, sizeof(host));
+    fprintf(out, "%s %s %d %d %d %d %d %s %d %d %s %.6e\n",
+            host, key->program, lo, 2 * lo, key->cores, key->ranks,
+            key->ranksPerNode, choice->forces, choice->threads,
+            choice->tile, choice->exchange, choice->secs);
+    if (fclose(out) != 0 || rename(tmp, path) != 0) {
+        perror(path);
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/*  Nonzero if the command line fixed any knob */
+int
+tune_fixed(const nbodyParams *p) {
+    return p->forces != 0 || p->threads != 0 || p->tile != 0 || p->exchange != 0;
+}
+
+/*  Use choice in p; choice must outlive p */
+void
+tune_apply(const tuneChoice *choice, nbodyParams *p) {
+    p->forces = nbody_find_forces(choice->forces);
+    p->threads = choice->threads;
+    p->tile = choice->tile;
+    p->exchange = strcmp(choice->exchange, "-") != 0 ? choice->exchange : 0;
+}
+
+void
+tune_describe(const tuneChoice *choice, FILE *out) {
+    fprintf(out, "%s threads=%d tile=%d exchange=%s (%.3f ms/step)\n",
+            choice->forces, choice->threads, choice->tile,
+            choice->exchange, choice->secs * 1000);
+}
+
+/*  Seconds per step of candidate p, at most TUNE_MAXSTEPS steps */
+static double
+measure(const nbodyParams *p, tuneTimer timer, void *arg) {
+    double secs = timer(p, 1, arg);
+    int steps;
+
+    if (secs < 0) {
+        return secs;
+    }
+    steps = (secs * TUNE_MAXSTEPS < TUNE_BUDGET) ? TUNE_MAXSTEPS
+            : (int) (TUNE_BUDGET / secs);
+    if (steps > 1) {
+        secs = timer(p, steps, arg);
+        secs = (secs < 0) ? secs : secs / steps;
+    }
+    return secs;
+}
+
+/*  Time every candidate not fixed in p and put the fastest in best.
+    Parallel runs call this on every process with the same arguments
+    (log only on one of them), the timer agreeing on the times.
+*/
+int
+tune_run(const tuneKey *key, const nbodyParams *p,
+         const char *const *exchanges, tuneTimer timer, void *arg,
+         tuneChoice *best, FILE *log) {
+    static const char *const none[] = { "-", 0 };
+    const nbodyForces *const *backends = nbody_backends();
+    int maxThreads = key->cores / (key->ranksPerNode > 0 ? key->ranksPerNode : 1);
+    int threads[MAXCANDS], tiles[MAXCANDS];
+    int nthreads, ntiles;
+    int f, t, w, x;
+
+    if (maxThreads < 1) {
+        maxThreads = 1;
+    }
+    if (p->exchange) {
+        static const char *fixed[2];
+
+        fixed[0] = p->exchange;
+        exchanges = fixed;
+    } else if (exchanges == 0) {
+        exchanges = none;
+    }
+    if (log) {
+        fprintf(log, "Tuning %d bodies on %d cores, %d processes (%d per node)\n",
+                key->bodyCt, key->cores, key->ranks, key->ranksPerNode);
+    }
+
+    best->secs = -1;
+    for (f = 0; backends[f]; ++f) {
+        const nbodyForces *forcer = backends[f];
+
+        /* approximations only when asked for */
+        if (p->forces ? p->forces != forcer : forcer->approximate) {
+            continue;
+        }
+        nthreads = 0;
+        if (!forcer->threaded) {
+            threads[nthreads++] = 1;
+        } else if (p->threads) {
+            threads[nthreads++] = p->threads;
+        } else {
+            for (t = 1; t < maxThreads && nthreads < MAXCANDS - 1; t *= 2) {
+                threads[nthreads++] = t;
+            }
+            threads[nthreads++] = maxThreads;
+        }
+        ntiles = 0;
+        if (forcer->tiles == 0) {
+            tiles[ntiles++] = 0;
+        } else if (p->tile) {
+            tiles[ntiles++] = p->tile;
+        } else {
+            /* widths past N all come to one tile of N */
+            for (w = 0; forcer->tiles[w] && ntiles < MAXCANDS; ++w) {
+                int width = forcer->tiles[w] < p->bodyCt ? forcer->tiles[w] : p->bodyCt;
+
+                if (ntiles == 0 || tiles[ntiles - 1] != width) {
+                    tiles[ntiles++] = width;
+                }
+            }
+        }
+
+        for (t = 0; t < nthreads; ++t) {
+            for (w = 0; w < ntiles; ++w) {
+                for (x = 0; exchanges[x]; ++x) {
+                    nbodyParams q = *p;
+                    tuneChoice c;
+
+                    q.forces = forcer;
+                    q.threads = threads[t];
+                    q.tile = tiles[w];
+                    q.exchange = strcmp(exchanges[x], "-") != 0 ? exchanges[x] : 0;
+                    q.diagEvery = 0;
+
+                    snprintf(c.forces, sizeof(c.forces), "%s", forcer->name);
+                    c.threads = threads[t];
+                    c.tile = tiles[w];
+                    snprintf(c.exchange, sizeof(c.exchange), "%s", exchanges[x]);
+                    c.secs = measure(&q, timer, arg);
+                    if (log) {
+                        fprintf(log, "  ");
+                        if (c.secs < 0) {
+                            fprintf(log, "%s threads=%d tile=%d exchange=%s failed\n",
+                                    c.forces, c.threads, c.tile, c.exchange);
+                        } else {
+                            tune_describe(&c, log);
+                        }
+                    }
+                    if (c.secs >= 0 && (best->secs < 0 || c.secs < best->secs)) {
+                        *best = c;
+                    }
+                }
+            }
+        }
+    }
+    return best->secs < 0 ? -1 : 0;
+}
+
+double
+tune_time_local(const nbodyParams *p, int steps, void *arg) {
+    nbodySim *sim = nbody_create(p);
+    struct timeval start, end;
+    int ok;
+
+    if (sim == 0) {
+        return -1;
+    }
+    ok = (nbody_step(sim, 1) == 0);
+    gettimeofday(&start, 0);
+    ok = (nbody_step(sim, steps) == 0) && ok;
+    gettimeofday(&end, 0);
+    nbody_destroy(sim);
+    if (!ok) {
+        return -1;
+    }
+    return (end.tv_sec + (end.tv_usec / 1000000.0)) -
+           (start.tv_sec + (start.tv_usec / 1000000.0));
+}
+
+/*  Tune p of a single-process run of program; 1 if choice was
+    applied to p, 0 if p was left alone, -1 on failure
+*/
+int
+tune_local(nbodyParams *p, tuneMode mode, const char *program,
+           tuneChoice *choice, FILE *log) {
+    tuneKey key;
+
+    key.program = program;
+    key.bodyCt = p->bodyCt;
+    key.cores = nbody_cores();
+    key.ranks = 1;
+    key.ranksPerNode = 1;
+
+    if (mode == TUNE_OFF || (mode == TUNE_AUTO && tune_fixed(p))) {
+        return 0;
+    }
+    if (mode == TUNE_AUTO) {
+        if (tune_lookup(&key, choice) < 0) {
+            return 0;
+        }
+        fprintf(log, "Tuned settings from cache: ");
+    } else {
+        if (tune_run(&key, p, 0, tune_time_local, 0, choice, log) < 0) {
+            return -1;
+        }
+        if (!tune_fixed(p)) {
+            tune_store(&key, choice);
+        }
+        fprintf(log, "Tuned settings: ");
+    }
+    tune_describe(choice, log);
+    tune_apply(choice, p);
+    return 1;
+}
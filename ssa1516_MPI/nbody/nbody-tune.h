@@ -0,0 +1,66 @@
+/*
+    Autotuning of the N-Body force backend and its knobs.
+
+    A calibration times a few steps of every candidate (force backend
+    x thread count x tile width x parallel layer) on the actual
+    problem and keeps the fastest. Winners are remembered per host in
+    a cache file ($NBODY_TUNE_CACHE, default ~/.nbody-tune), one line
+    per entry:
+
+        host program nlo nhi cores ranks ranks_per_node forces threads tile exchange secs
+
+    for bodyCt in [nlo, nhi), a power-of-two range. Later runs with
+    the same key apply the entry without calibrating.
+*/
+
+#ifndef NBODY_TUNE_H
+#define NBODY_TUNE_H
+
+#include <stdio.h>
+#include "nbody.h"
+
+#define TUNE_BUDGET     0.25    /* seconds of timed steps per candidate */
+#define TUNE_MAXSTEPS   20
+
+typedef enum {
+    TUNE_AUTO = 0,      /* apply a cached choice if there is one */
+    TUNE_FORCE,         /* calibrate now and update the cache */
+    TUNE_OFF            /* run what the command line says */
+} tuneMode;
+
+typedef struct {
+    char forces[32];    /* backend name */
+    int threads;
+    int tile;
+    char exchange[32];  /* parallel layer, "-" for none */
+    double secs;        /* per step */
+} tuneChoice;
+
+typedef struct {
+    const char *program;
+    int bodyCt;
+    int cores;          /* of the node */
+    int ranks;          /* processes of the run */
+    int ranksPerNode;   /* fixed by the launcher, so part of the key */
+} tuneKey;
+
+/*  Seconds taken by 'steps' steps of a fresh simulation with
+    parameters p (after one untimed step), agreed by all processes
+    of a parallel run; negative if the candidate cannot run.
+*/
+typedef double (*tuneTimer)(const nbodyParams *p, int steps, void *arg);
+
+int tune_lookup(const tuneKey *key, tuneChoice *choice);
+int tune_store(const tuneKey *key, const tuneChoice *choice);
+int tune_run(const tuneKey *key, const nbodyParams *p,
+             const char *const *exchanges, tuneTimer timer, void *arg,
+             tuneChoice *best, FILE *log);
+int tune_fixed(const nbodyParams *p);
+void tune_apply(const tuneChoice *choice, nbodyParams *p);
+void tune_describe(const tuneChoice *choice, FILE *out);
+
+double tune_time_local(const nbodyParams *p, int steps, void *arg);
+int tune_local(nbodyParams *p, tuneMode mode, const char *program,
+               tuneChoice *choice, FILE *log);
+
+#endif
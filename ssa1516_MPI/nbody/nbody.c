@@ -0,0 +1,590 @@
+/*
+    N-Body simulation engine.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "nbody.h"
+#include "nbody-threads.h"
+#include "nbody-kernel.h"
+#include "nbody-ooc.h"
+#include "nbody-dump.h"
+
+
+void
+nbody_defaults(nbodyParams *p) {
+    memset(p, 0, sizeof(*p));
+    p->init = INIT_RANDOM;
+    p->seed = SEED;
+    p->diagOut = stderr;
+    p->theta = 0.5;
+    p->gravity = GRAVITY;
+    p->friction = FRICTION;
+}
+
+long long
+nbody_pair_count(int bodyCt) {
+    return (long long) bodyCt * (bodyCt - 1) / 2;
+}
+
+/*  First pair of the range starting at 'pair', pairs being numbered
+    row by row: (0,1) (0,2) ... (0,N-1) (1,2) ...
+*/
+void
+nbody_pair_start(int bodyCt, long long pair, int *b, int *c) {
+    int row = 0;
+
+    while (row < bodyCt - 1 && pair >= bodyCt - 1 - row) {
+        pair -= bodyCt - 1 - row;
+        ++row;
+    }
+    *b = row;
+    *c = row + 1 + (int) pair;
+}
+
+/*  Restrict the force pass to pairs [lo, hi) */
+void
+nbody_set_pairs(nbodySim *sim, long long lo, long long hi) {
+    sim->pairLo = lo;
+    sim->pairHi = hi;
+    nbody_pair_start(sim->bodyCt, lo, &sim->startB, &sim->startC);
+}
+
+nbodySim *
+nbody_alloc(const nbodyParams *p) {
+    nbodySim *sim = calloc(1, sizeof(nbodySim));
+
+    if (sim == 0) {
+        return 0;
+    }
+    sim->p = *p;
+    sim->bodyCt = p->bodyCt;
+    sim->xdim = p->xdim;
+    sim->ydim = p->ydim;
+    if (p->stateFile) {
+        ooc_map(sim);
+    } else {
+        /* untouched until initialized, see nbody-numa.h */
+        sim->bodies = mem_alloc(sizeof(bodyType) * sim->bodyCt, p->place, p->huge);
+        sim->positions = mem_alloc(sizeof(bodyPositionType) * sim->bodyCt, p->place, p->huge);
+        sim->forces = mem_alloc(sizeof(forceType) * sim->bodyCt, p->place, p->huge);
+    }
+    sim->forcer = p->forces ? p->forces : &nbody_direct;
+    if (p->reorderEvery > 0 && (sim->ids = malloc(sizeof(int) * sim->bodyCt)) != 0) {
+        int b;
+
+        for (b = 0; b < sim->bodyCt; ++b) {
+            sim->ids[b] = b;
+        }
+    }
+    if (sim->bodies == 0 || sim->positions == 0 || sim->forces == 0 ||
+            (p->reorderEvery > 0 && sim->ids == 0)) {
+        nbody_destroy(sim);
+        return 0;
+    }
+
+    sim->dt = p->dt > 0 ? p->dt : DELTA_T;
+    sim->gravity = p->gravity;
+    sim->friction = p->friction;
+    sim->ranks = 1;
+    sim->first = 0;
+    sim->last = sim->bodyCt;
+    nbody_set_pairs(sim, 0, nbody_pair_count(sim->bodyCt));
+
+    /* the backend's free() takes what its init() got so far */
+    if (sim->forcer->init && sim->forcer->init(sim) < 0) {
+        nbody_destroy(sim);
+        return 0;
+    }
+    return sim;
+}
+
+/*  Generate the initial state of bodies [lo, hi) */
+int
+nbody_init_range(nbodySim *sim, int lo, int hi) {
+    initBodyType chunk[INIT_CHUNK];
+    initParams init;
+    int b, i;
+
+    init.kind = sim->p.init;
+    init.seed = sim->p.seed;
+    init.bodyCt = sim->bodyCt;
+    init.xdim = sim->xdim;
+    init.ydim = sim->ydim;
+    init.gravity = sim->gravity;
+    init.file = sim->p.initFile;
+    if (init_open(&init) < 0) {
+        return -1;
+    }
+    for (b = lo; b < hi; b += INIT_CHUNK) {
+        int n = (hi - b < INIT_CHUNK) ? hi - b : INIT_CHUNK;
+
+        if (init_bodies(&init, b, b + n, chunk) < 0) {
+            init_close(&init);
+            return -1;
+        }
+        for (i = 0; i < n; ++i) {
+            X(b + i) = chunk[i].x;
+            Y(b + i) = chunk[i].y;
+            R(b + i) = chunk[i].radius;
+            M(b + i) = chunk[i].mass;
+            XV(b + i) = chunk[i].xv;
+            YV(b + i) = chunk[i].yv;
+        }
+    }
+    init_close(&init);
+    return 0;
+}
+
+nbodySim *
+nbody_create(const nbodyParams *p) {
+    nbodySim *sim = nbody_alloc(p);
+
+    if (sim != 0 && nbody_init_range(sim, 0, sim->bodyCt) < 0) {
+        nbody_destroy(sim);
+        return 0;
+    }
+    return sim;
+}
+
+void
+nbody_destroy(nbodySim *sim) {
+    if (sim == 0) {
+        return;
+    }
+    if (sim->exchange && sim->exchange->free) {
+        sim->exchange->free(sim);
+    }
+    if (sim->forcer && sim->forcer->free) {
+        sim->forcer->free(sim);
+    }
+    if (sim->stateMap) {
+        ooc_unmap(sim);
+    } else {
+        mem_free(sim->bodies, sizeof(bodyType) * sim->bodyCt, sim->p.huge);
+        mem_free(sim->positions, sizeof(bodyPositionType) * sim->bodyCt, sim->p.huge);
+        mem_free(sim->forces, sizeof(forceType) * sim->bodyCt, sim->p.huge);
+    }
+    free(sim->ids);
+    free(sim);
+}
+
+
+static void
+clear_forces(nbodySim *sim) {
+    int distributed = (sim->exchange && sim->exchange->essential);
+    int b;
+
+    /* Clear force accumulation variables (of the own bodies only, if
+       the others are not held here) */
+    for (b = distributed ? sim->first : 0; b < (distributed ? sim->last : sim->bodyCt); ++b) {
+        YF(b) = (XF(b) = 0);
+    }
+}
+
+/*  Add the forces of 'todo' pairs, starting with (startB, startC),
+    to 'forces'; 'energy' is a constant in every call, so the compiler
+    emits a plain force loop and a fused force/energy loop.
+*/
+static inline double
+direct_range(nbodySim *sim, forceType *forces, int startB, int startC,
+             long long todo, const int energy) {
+    int bodyCt = sim->bodyCt;
+    long long count = 0;
+    double potential = 0;
+    int b, c;
+
+    /* Incrementally accumulate forces from each assigned body pair,
+       skipping force of body on itself (c == b). The first loop is
+       separated to avoid an additional if construct
+    */
+    b = startB;
+    for (c = startC; c < bodyCt && count < todo; ++c) {
+        direct_pair(sim, forces, b, c, energy, &potential);
+        count++;
+    }
+
+    /*standard loop*/
+
+    for (b = startB + 1; b < bodyCt && count < todo; ++b) {
+        for (c = b + 1; c < bodyCt && count < todo; ++c) {
+            direct_pair(sim, forces, b, c, energy, &potential);
+            count++;
+        }
+    }
+    return potential;
+}
+
+/*  Add to 'forces' the force of every other body on bodies [lo, hi) */
+static inline double
+owner_range(nbodySim *sim, forceType *forces, int lo, int hi, const int energy) {
+    double potential = 0;
+    int b, c;
+
+    for (b = lo; b < hi; ++b) {
+        for (c = 0; c < b; ++c) {
+            direct_force(sim, forces, b, c, energy, &potential);
+        }
+        for (c = b + 1; c < sim->bodyCt; ++c) {
+            direct_force(sim, forces, b, c, energy, &potential);
+        }
+    }
+    return potential;
+}
+
+static int
+direct_forces(nbodySim *sim) {
+    long long todo = sim->pairHi - sim->pairLo;
+
+    if (sim->owner) {
+        if (sim->diagStep) {
+            sim->potential += owner_range(sim, sim->forces, sim->first, sim->last, 1);
+        } else {
+            owner_range(sim, sim->forces, sim->first, sim->last, 0);
+        }
+    } else if (sim->diagStep) {
+        sim->potential += direct_range(sim, sim->forces, sim->startB, sim->startC, todo, 1);
+    } else {
+        direct_range(sim, sim->forces, sim->startB, sim->startC, todo, 0);
+    }
+    return 0;
+}
+
+/*  O(N^2) pairwise sum, Newton's third law halving the pairs */
+const nbodyForces nbody_direct = {
+    "direct", 0, direct_forces, 0, 0, 0, 0, 0, 1
+};
+
+
+/*  The same pair loop on a thread pool: thread t takes the t-th
+    share of the pairs into a private force array, then every thread
+    sums a slice of the bodies over all arrays.
+*/
+typedef struct {
+    nbodySim *sim;
+    threadPool *pool;
+    forceType *partial;         /* one force array per thread */
+    double *potential;          /* one partial potential per thread */
+} directMtType;
+
+static void
+direct_mt_pairs(void *arg, int id, int count) {
+    directMtType *mt = arg;
+    nbodySim *sim = mt->sim;
+    forceType *forces = mt->partial + (long) id * sim->bodyCt;
+    long long total = sim->pairHi - sim->pairLo;
+    long long lo = sim->pairLo + total * id / count;
+    long long hi = sim->pairLo + total * (id + 1) / count;
+    int b, c;
+
+    memset(forces, 0, sizeof(forceType) * sim->bodyCt);
+    nbody_pair_start(sim->bodyCt, lo, &b, &c);
+    if (sim->diagStep) {
+        mt->potential[id] = direct_range(sim, forces, b, c, hi - lo, 1);
+    } else {
+        direct_range(sim, forces, b, c, hi - lo, 0);
+    }
+}
+
+/*  Owner-computes: thread t takes the t-th share of [first, last) */
+static void
+direct_mt_owner(void *arg, int id, int count) {
+    directMtType *mt = arg;
+    nbodySim *sim = mt->sim;
+    int lo = sim->first + (int) ((long long) (sim->last - sim->first) * id / count);
+    int hi = sim->first + (int) ((long long) (sim->last - sim->first) * (id + 1) / count);
+
+    if (sim->diagStep) {
+        mt->potential[id] = owner_range(sim, sim->forces, lo, hi, 1);
+    } else {
+        owner_range(sim, sim->forces, lo, hi, 0);
+    }
+}
+
+static void
+direct_mt_sum(void *arg, int id, int count) {
+    directMtType *mt = arg;
+    nbodySim *sim = mt->sim;
+    int lo = (int) ((long long) sim->bodyCt * id / count);
+    int hi = (int) ((long long) sim->bodyCt * (id + 1) / count);
+    int b, t;
+
+    for (t = 0; t < count; ++t) {
+        forceType *forces = mt->partial + (long) t * sim->bodyCt;
+
+        for (b = lo; b < hi; ++b) {
+            XF(b) += forces[b].xf;
+            YF(b) += forces[b].yf;
+        }
+    }
+}
+
+/*  First touch of the body arrays: every thread the slice it sums */
+static void
+direct_mt_touch(void *arg, int id, int count) {
+    directMtType *mt = arg;
+    nbodySim *sim = mt->sim;
+    int lo = (int) ((long long) sim->bodyCt * id / count);
+    int hi = (int) ((long long) sim->bodyCt * (id + 1) / count);
+
+    memset(sim->positions + lo, 0, sizeof(bodyPositionType) * (hi - lo));
+    memset(sim->bodies + lo, 0, sizeof(bodyType) * (hi - lo));
+    memset(sim->forces + lo, 0, sizeof(forceType) * (hi - lo));
+}
+
+static int
+direct_mt_init(nbodySim *sim) {
+    directMtType *mt = calloc(1, sizeof(directMtType));
+
+    if (mt == 0 || (mt->pool = pool_create(sim->p.threads)) == 0) {
+        free(mt);
+        return -1;
+    }
+    mt->sim = sim;
+    mt->partial = malloc(sizeof(forceType) * sim->bodyCt * pool_size(mt->pool));
+    mt->potential = calloc(pool_size(mt->pool), sizeof(double));
+    sim->forceState = mt;
+    if (sim->stateMap == 0) {
+        pool_run(mt->pool, direct_mt_touch, mt);
+    }
+    return (mt->partial && mt->potential) ? 0 : -1;
+}
+
+static int
+direct_mt_forces(nbodySim *sim) {
+    directMtType *mt = sim->forceState;
+    int t;
+
+    if (sim->owner) {
+        pool_run(mt->pool, direct_mt_owner, mt);
+    } else {
+        pool_run(mt->pool, direct_mt_pairs, mt);
+        pool_run(mt->pool, direct_mt_sum, mt);
+    }
+    if (sim->diagStep) {
+        for (t = 0; t < pool_size(mt->pool); ++t) {
+            sim->potential += mt->potential[t];
+        }
+    }
+    return 0;
+}
+
+static void
+direct_mt_free(nbodySim *sim) {
+    directMtType *mt = sim->forceState;
+
+    if (mt) {
+        pool_destroy(mt->pool);
+        free(mt->partial);
+        free(mt->potential);
+        free(mt);
+    }
+}
+
+const nbodyForces nbody_direct_mt = {
+    "direct-mt", direct_mt_init, direct_mt_forces, direct_mt_free, 1, 0, 0, 0, 1
+};
+
+static const nbodyForces *backends[] = {
+    &nbody_direct, &nbody_direct_mt, &nbody_direct_tiled, &nbody_direct_ooc, &nbody_tree, &nbody_pm, &nbody_cell, 0
+};
+
+const nbodyForces *const *
+nbody_backends(void) {
+    return backends;
+}
+
+const nbodyForces *
+nbody_find_forces(const char *name) {
+    int i;
+
+    for (i = 0; backends[i]; ++i) {
+        if (strcmp(backends[i]->name, name) == 0) {
+            return backends[i];
+        }
+    }
+    return 0;
+}
+
+static void
+compute_velocities(nbodySim *sim) {
+    int b;
+
+    for (b = sim->first; b < sim->last; ++b) {
+        double xv = XV(b);
+        double yv = YV(b);
+        double force = sqrt(xv * xv + yv * yv) * sim->friction;
+        double angle = atan2(yv, xv);
+        double xf = XF(b) - (force * cos(angle));
+        double yf = YF(b) - (force * sin(angle));
+
+        if (sim->p.diagEvery) {
+            double vsqr = xv * xv + yv * yv;
+
+            sim->dissipated += sim->friction * vsqr * sim->dt;
+            if (sim->diagStep) {
+                sim->kinetic += 0.5 * M(b) * vsqr;
+                sim->xmom += M(b) * xv;
+                sim->ymom += M(b) * yv;
+            }
+        }
+
+        XV(b) += (xf / M(b)) * sim->dt;
+        YV(b) += (yf / M(b)) * sim->dt;
+    }
+}
+
+static void
+compute_positions(nbodySim *sim) {
+    int b;
+
+    for (b = sim->first; b < sim->last; ++b) {
+        double xn = X(b) + (XV(b) * sim->dt);
+        double yn = Y(b) + (YV(b) * sim->dt);
+
+        /* Bounce of image "walls" */
+        if (xn < 0) {
+            xn = 0;
+            XV(b) = -XV(b);
+        } else if (xn >= sim->xdim) {
+            xn = sim->xdim - 1;
+            XV(b) = -XV(b);
+        }
+        if (yn < 0) {
+            yn = 0;
+            YV(b) = -YV(b);
+        } else if (yn >= sim->ydim) {
+            yn = sim->ydim - 1;
+            YV(b) = -YV(b);
+        }
+
+        /* Update position */
+        XN(b) = xn;
+        YN(b) = yn;
+    }
+}
+
+/*  Sum up the conserved quantities of all the processes and report
+    their drift since the first report
+*/
+static void
+diagnose(nbodySim *sim) {
+    double v[5];
+    double energy;
+
+    v[0] = sim->potential;
+    v[1] = sim->kinetic;
+    v[2] = sim->dissipated;
+    v[3] = sim->xmom;
+    v[4] = sim->ymom;
+    if (sim->exchange && sim->exchange->reduce) {
+        sim->exchange->reduce(sim, v, 5);
+    }
+    sim->potential = sim->kinetic = sim->xmom = sim->ymom = 0;
+    if (sim->rank != 0) {
+        return;
+    }
+
+    energy = v[0] + v[1] + v[2];
+    if (sim->diagReports++ == 0) {
+        sim->energy0 = energy;
+        sim->xmom0 = v[3];
+        sim->ymom0 = v[4];
+    }
+    if (sim->p.diagOut) {
+        fprintf(sim->p.diagOut, "step %8ld: E %14.6e (K %11.4e U %11.4e lost %11.4e) dE/E0 %10.3e P %11.4e %11.4e dP %10.3e\n",
+                sim->step, energy, v[1], v[0], v[2],
+                (energy - sim->energy0) / fabs(sim->energy0), v[3], v[4],
+                sqrt((v[3] - sim->xmom0) * (v[3] - sim->xmom0) + (v[4] - sim->ymom0) * (v[4] - sim->ymom0)));
+    }
+}
+
+/*  Take n steps; 0, or -1 if the force pass of any of them failed.
+    All n are still taken, so that parallel layers keep their
+    processes in step, but such a step's forces are incomplete.
+*/
+int
+nbody_step(nbodySim *sim, int n) {
+    int ok = 1;
+
+    while (n--) {
+        if (sim->p.reorderEvery > 0 && sim->step % sim->p.reorderEvery == 0) {
+            nbody_reorder(sim);
+        }
+        if (sim->exchange && sim->exchange->balance) {
+            sim->exchange->balance(sim);
+        }
+        sim->diagStep = (sim->p.diagEvery > 0 && sim->step % sim->p.diagEvery == 0);
+        clear_forces(sim);
+        if (sim->exchange && sim->exchange->schedule) {
+            ok = (sim->exchange->schedule(sim) == 0) && ok;
+        } else {
+            ok = (sim->forcer->compute(sim) == 0) && ok;
+        }
+        if (sim->exchange && sim->exchange->forces) {
+            sim->exchange->forces(sim);
+        }
+        compute_velocities(sim);
+        compute_positions(sim);
+        if (sim->diagStep) {
+            diagnose(sim);
+        }
+        if (sim->exchange && sim->exchange->positions) {
+            sim->exchange->positions(sim);
+        }
+
+        /* Flip old & new coordinates */
+        sim->old ^= 1;
+        ++sim->step;
+    }
+    return ok ? 0 : -1;
+}
+
+
+nbodyView
+nbody_positions(const nbodySim *sim) {
+    nbodyView v;
+
+    v.x = &sim->positions[0].x[sim->old];
+    v.y = &sim->positions[0].y[sim->old];
+    v.stride = sizeof(bodyPositionType) / sizeof(double);
+    v.count = sim->bodyCt;
+    return v;
+}
+
+nbodyView
+nbody_velocities(const nbodySim *sim) {
+    nbodyView v;
+
+    v.x = &sim->bodies[0].xv;
+    v.y = &sim->bodies[0].yv;
+    v.stride = sizeof(bodyType) / sizeof(double);
+    v.count = sim->bodyCt;
+    return v;
+}
+
+nbodyView
+nbody_forces(const nbodySim *sim) {
+    nbodyView v;
+
+    v.x = &sim->forces[0].xf;
+    v.y = &sim->forces[0].yf;
+    v.stride = sizeof(forceType) / sizeof(double);
+    v.count = sim->bodyCt;
+    return v;
+}
+
+/*  NUMA nodes and huge pages of the body arrays */
+void
+nbody_memory_report(const nbodySim *sim, FILE *out) {
+    mem_report("positions", sim->positions, sizeof(bodyPositionType) * sim->bodyCt, out);
+    mem_report("bodies", sim->bodies, sizeof(bodyType) * sim->bodyCt, out);
+    mem_report("forces", sim->forces, sizeof(forceType) * sim->bodyCt, out);
+}
+
+void
+nbody_print(const nbodySim *sim, FILE *out) {
+    dump_text(sim, out);
+}
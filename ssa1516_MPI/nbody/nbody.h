@@ -0,0 +1,236 @@
+/*
+    N-Body simulation engine.
+
+    All state of a simulation lives in its nbodySim handle, so any
+    number of independent simulations can share a process (only the
+    'random' initial conditions use the process-wide rand() stream).
+    nbody-seq and nbody-par are front-ends of this library; nbody-mpi.h
+    adds the MPI decomposition on top of it.
+*/
+
+#ifndef NBODY_H
+#define NBODY_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include "nbody-init.h"
+#include "nbody-numa.h"
+
+#define GRAVITY     1.1
+#define FRICTION    0.01
+#define DELTA_T     (0.025/5000)
+#define BOUNCE      -0.9
+#define SEED        27102015
+
+typedef struct {
+    double xv;          /* velocity along X-axis */
+    double yv;          /* velocity along Y-axis */
+    double mass;        /* Mass of the body */
+    double radius;      /* width (derived from mass) */
+} bodyType;
+
+typedef struct {
+    double x[2];        /* Old and new X-axis coordinates */
+    double y[2];        /* Old and new Y-axis coordinates */
+} bodyPositionType;
+
+typedef struct {
+    double xf;          /* force along X-axis */
+    double yf;          /* force along Y-axis */
+} forceType;
+
+typedef struct nbodySim nbodySim;
+typedef struct quadTree quadTree;       /* nbody-tree.h */
+typedef struct treePoint treePoint;
+
+typedef enum {
+    CURVE_MORTON = 0,
+    CURVE_HILBERT
+} orderCurve;
+
+/*  Force backend: compute() adds the forces of the pairs
+    [pairLo, pairHi) (or whatever share of the work its parallel
+    layer assigned) to the cleared force array; 0, or -1 (after a
+    message) if it could not.
+*/
+typedef struct {
+    const char *name;
+    int (*init)(nbodySim *sim);         /* optional, at creation */
+    int (*compute)(nbodySim *sim);
+    void (*free)(nbodySim *sim);        /* optional; also after a failed init() */
+    int threaded;                       /* uses nbodyParams.threads */
+    const int *tiles;                   /* tile widths worth tuning, 0-terminated (0: no tiles) */
+    void (*report)(nbodySim *sim, FILE *out);   /* optional, statistics */
+    int approximate;                    /* not the exact pair sum: never picked by the tuner */
+    int owner;                          /* supports nbodySim.owner */
+} nbodyForces;
+
+/*  Parallel layer: combines the partial results of the processes
+    that share a simulation. Any hook may be 0.
+*/
+typedef struct {
+    const char *name;
+    void (*forces)(nbodySim *sim);      /* after the force pass */
+    void (*positions)(nbodySim *sim);   /* after the position update */
+    void (*reduce)(nbodySim *sim, double *v, int n);    /* sum on rank 0 */
+    void (*free)(nbodySim *sim);
+    void (*bodies)(nbodySim *sim);      /* give every process all the bodies */
+    void (*balance)(nbodySim *sim);     /* before the force pass */
+
+    /* Layers that distribute the bodies themselves hold only
+       [first, last) here; tree backends then pass the tree of those
+       and get back the points of the other processes they need
+       (malloc()ed, count returned). */
+    int (*essential)(nbodySim *sim, const quadTree *local, treePoint **remote);
+
+    /* Personalized all-to-all of the processes (sendBytes[q] from
+       send to process q, packed in rank order; likewise recv), for
+       backends that distribute their own data */
+    void (*alltoall)(nbodySim *sim, const void *send, const int *sendBytes,
+                     void *recv, const int *recvBytes);
+    void (*report)(nbodySim *sim, FILE *out);   /* optional, statistics */
+    int (*schedule)(nbodySim *sim);     /* runs the force pass itself, instead of one forcer->compute() */
+
+    /* Distributed layers: the bodies of the other processes within
+       'reach' of any of ours, for cutoff backends (malloc()ed, count
+       returned) */
+    int (*halo)(nbodySim *sim, double reach, treePoint **remote);
+} nbodyExchange;
+
+typedef struct {
+    int bodyCt;                 /* number of bodies */
+    int xdim;                   /* dimensions of space */
+    int ydim;
+    initKind init;              /* initial conditions */
+    unsigned long seed;
+    const char *initFile;       /* state file for INIT_FILE */
+    int diagEvery;              /* report conserved quantities every diagEvery steps (0: never) */
+    FILE *diagOut;              /* where to report them */
+    const nbodyForces *forces;  /* force backend (0: nbody_direct) */
+    int threads;                /* threads of threaded backends (0: one per core) */
+    int tile;                   /* tile width of tiled backends (0: their default) */
+    const char *exchange;       /* parallel layer by name (0: its default) */
+    const char *stateFile;      /* keep the body arrays in this mapped file (0: in memory) */
+    int reorderEvery;           /* sort the bodies along a curve every K steps (0: never) */
+    orderCurve curve;
+    placePolicy place;          /* NUMA placement of the body arrays */
+    hugePolicy huge;            /* page size of the body arrays */
+    double theta;               /* opening angle of tree backends */
+    double meshCell;            /* mesh spacing of mesh backends in pixels (0: theirs) */
+    double cutoff;              /* interaction range of cutoff backends in pixels (0: theirs) */
+    int balanceEvery;           /* steps between load balancing of layers that do it (0: theirs) */
+    double dt;                  /* time step (0: DELTA_T) */
+    double gravity;             /* gravitational constant */
+    double friction;            /* friction coefficient */
+    int queueBlocks;            /* pair blocks per process of work-queue layers (0: theirs) */
+    int pack;                   /* replicating layers exchange only the new coordinates */
+    double packTolerance;       /* ... as float deltas, each within this many pixels (0: doubles) */
+    int stats;                  /* layers report step times and exchanged bytes */
+} nbodyParams;
+
+struct nbodySim {
+    nbodyParams p;
+    int bodyCt;
+    int xdim;
+    int ydim;
+    int old;                    /* Flips between 0 and 1 */
+    double dt;                  /* time step */
+    double gravity;
+    double friction;
+    long step;                  /* steps done so far */
+    bodyType *bodies;           /* list of bodies */
+    bodyPositionType *positions;    /* list of bodies position */
+    forceType *forces;          /* list of forces per body */
+    int *ids;                   /* original index of every slot (0: not reordered) */
+    float *work;                /* interactions of every body in the last force pass (0: not counted) */
+    void *stateMap;             /* mapping of p.stateFile holding the three */
+    size_t stateSize;
+
+    /* share of the work done here (everything, unless narrowed by
+       a parallel layer) */
+    int first;                  /* bodies [first, last) are integrated here */
+    int last;
+    int owner;                  /* instead of the pairs, the whole force on [first, last) */
+    long long pairLo;           /* pairs [pairLo, pairHi) are computed here */
+    long long pairHi;
+    int startB;                 /* first pair of the range */
+    int startC;
+
+    const nbodyForces *forcer;
+    void *forceState;
+    const nbodyExchange *exchange;
+    void *exchangeState;
+    int rank;                   /* 0 on the process that reports */
+    int ranks;                  /* processes sharing the simulation */
+
+    /* in-situ diagnostics */
+    int diagStep;               /* this step accumulates diagnostics */
+    double potential;           /* potential energy */
+    double kinetic;             /* kinetic energy */
+    double dissipated;          /* energy lost to friction so far */
+    double xmom, ymom;          /* momentum */
+    int diagReports;
+    double energy0, xmom0, ymom0;
+};
+
+/*  Zero-copy, read-only view of a vector field of the bodies:
+    body i is at (x[i * stride], y[i * stride]). Valid until the
+    next nbody_step(). With reordering, i is a slot: nbody_ids()
+    gives the original index of the body there.
+*/
+typedef struct {
+    const double *x;
+    const double *y;
+    int stride;
+    int count;
+} nbodyView;
+
+#define NBODY_X(v, i)   ((v).x[(long) (i) * (v).stride])
+#define NBODY_Y(v, i)   ((v).y[(long) (i) * (v).stride])
+
+/*  Macros to hide memory layout, for code holding a nbodySim *sim
+*/
+#define X(B)        sim->positions[B].x[sim->old]
+#define XN(B)       sim->positions[B].x[sim->old^1]
+#define Y(B)        sim->positions[B].y[sim->old]
+#define YN(B)       sim->positions[B].y[sim->old^1]
+#define XF(B)       sim->forces[B].xf
+#define YF(B)       sim->forces[B].yf
+#define XV(B)       sim->bodies[B].xv
+#define YV(B)       sim->bodies[B].yv
+#define R(B)        sim->bodies[B].radius
+#define M(B)        sim->bodies[B].mass
+
+extern const nbodyForces nbody_direct;
+extern const nbodyForces nbody_direct_mt;
+extern const nbodyForces nbody_direct_tiled;
+extern const nbodyForces nbody_direct_ooc;
+extern const nbodyForces nbody_tree;
+extern const nbodyForces nbody_pm;
+extern const nbodyForces nbody_cell;
+
+const nbodyForces *const *nbody_backends(void);
+const nbodyForces *nbody_find_forces(const char *name);
+
+void nbody_defaults(nbodyParams *p);
+nbodySim *nbody_alloc(const nbodyParams *p);
+int nbody_init_range(nbodySim *sim, int lo, int hi);
+nbodySim *nbody_create(const nbodyParams *p);
+void nbody_destroy(nbodySim *sim);
+
+void nbody_pair_start(int bodyCt, long long pair, int *b, int *c);
+void nbody_set_pairs(nbodySim *sim, long long lo, long long hi);
+long long nbody_pair_count(int bodyCt);
+int nbody_step(nbodySim *sim, int n);
+
+nbodyView nbody_positions(const nbodySim *sim);
+nbodyView nbody_velocities(const nbodySim *sim);
+nbodyView nbody_forces(const nbodySim *sim);
+void nbody_print(const nbodySim *sim, FILE *out);
+void nbody_memory_report(const nbodySim *sim, FILE *out);
+
+int nbody_parse_curve(const char *name, orderCurve *curve);
+int nbody_reorder(nbodySim *sim);
+const int *nbody_ids(const nbodySim *sim);
+
+#endif